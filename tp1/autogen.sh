@@ -72,7 +72,7 @@ mkdir -p $BUILD_AUX
 
 $LIBTOOLIZE --copy --force
 #aclocal -I gnulib/m4
-aclocal
+aclocal -I m4
 autoheader
 automake --add-missing --foreign
 autoconf
@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# Compare les dispositions du canevas (--layout rows et morton) de 2^24 à
+# 2^29 segments. Avec perf, les défauts de cache et de TLB sont mesurés en
+# plus du temps écoulé.
+#
+
+# variables
+EXE="./src/dragonizer"
+LIBS="serial pthread"
+LAYOUTS="rows morton"
+PWR_MIN=24
+PWR_MAX=29
+THREADS=4
+REPEAT=3
+OUT_DIR="results"
+OUT="${OUT_DIR}/layout_dragonizer.csv"
+EVENTS="cache-references,cache-misses,L1-dcache-load-misses,dTLB-load-misses"
+
+PERF=""
+if perf stat -e cache-misses true > /dev/null 2>&1; then
+	PERF="perf"
+fi
+
+# lib,layout,pwr,event,value
+run_layout() {
+
+	lib=$1
+	layout=$2
+	pwr=$3
+
+	CMD="$EXE --cmd draw --lib $lib --layout $layout --power $pwr --thread $THREADS -o /dev/null"
+	echo "running lib=$lib layout=$layout pwr=$pwr"
+	start=$(date +%s.%N)
+	if [ -n "$PERF" ]; then
+		perf stat -x, -e $EVENTS -o "${OUT_DIR}/perf.tmp" $CMD > /dev/null
+		awk -F, -v pre="$lib,$layout,$pwr" '/^[0-9]/ { print pre "," $3 "," $1 }' \
+			"${OUT_DIR}/perf.tmp" >> $OUT
+	else
+		$CMD > /dev/null
+	fi
+	end=$(date +%s.%N)
+	echo "$lib,$layout,$pwr,elapsed,$(echo "$start $end" | awk '{ print $2 - $1 }')" >> $OUT
+}
+
+mkdir -p $OUT_DIR
+echo "lib,layout,power,event,value" > $OUT
+[ -z "$PERF" ] && echo "perf not available, only the elapsed time is measured"
+
+for pwr in $(seq $PWR_MIN $PWR_MAX); do
+for lib in $LIBS; do
+for layout in $LAYOUTS; do
+for i in $(seq 1 $REPEAT); do
+	run_layout $lib $layout $pwr
+done
+done
+done
+done
+
+rm -f "${OUT_DIR}/perf.tmp"
@@ -13,6 +13,7 @@ CMDS="draw limits"
 REPEAT=3
 OUT_DIR="results"
 OUT_PRE="time_dragonizer.data"
+BENCH_OUT="bench_dragonizer.csv"
 
 run_experiment() {
 
@@ -51,6 +52,13 @@ run_parallel() {
 	done
 }
 
+# Temps par phase, mesurés dans dragonizer pour chaque librairie
+run_bench() {
+	echo "running bench pwr=$PWR threads=1..$THREADS_MAX"
+	$EXE --cmd bench --power $PWR --thread $THREADS_MAX --repeat $REPEAT \
+		-o "${OUT_DIR}/dragon_bench_${PWR}.pgm" > "${OUT_DIR}/${BENCH_OUT}"
+}
+
 case $1 in 
 	serial)
 		run_serial
@@ -58,8 +66,11 @@ case $1 in
 	parallel)
 		run_parallel
 		;;
+	bench)
+		run_bench
+		;;
 	*)
-		echo "Unknown or missing parameter [ serial | parallel ]"
+		echo "Unknown or missing parameter [ serial | parallel | bench ]"
 		exit 1
 esac
 
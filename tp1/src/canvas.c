@@ -0,0 +1,511 @@
+/*
+ * canvas.c
+ *
+ * Sparse canvas made of lazily allocated tiles. Most of the bounding box
+ * of a large dragon is empty, so only the tiles actually drawn are
+ * allocated.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "canvas.h"
+
+#define CANVAS_HUGE_PAGE	((size_t) CANVAS_SLAB_TILES * CANVAS_TILE_AREA)
+
+const char *canvas_pages_names[CANVAS_PAGES_COUNT] = {
+	[CANVAS_PAGES_MALLOC] = "malloc",
+	[CANVAS_PAGES_THP] = "thp",
+	[CANVAS_PAGES_HUGETLB] = "hugetlb",
+};
+
+const char *canvas_layout_names[CANVAS_LAYOUT_COUNT] = {
+	[CANVAS_LAYOUT_ROWS] = "rows",
+	[CANVAS_LAYOUT_MORTON] = "morton",
+};
+
+const uint16_t canvas_spread[CANVAS_TILE_SIZE >> CANVAS_BLOCK_SHIFT] = {
+	0x000, 0x001, 0x004, 0x005, 0x010, 0x011, 0x014, 0x015,
+	0x040, 0x041, 0x044, 0x045, 0x050, 0x051, 0x054, 0x055,
+	0x100, 0x101, 0x104, 0x105, 0x110, 0x111, 0x114, 0x115,
+	0x140, 0x141, 0x144, 0x145, 0x150, 0x151, 0x154, 0x155,
+};
+
+static enum canvas_pages canvas_pages = CANVAS_PAGES_THP;
+static enum canvas_layout canvas_layout = CANVAS_LAYOUT_ROWS;
+
+/*
+ * Memory used by the canvases created afterwards.
+ */
+void canvas_set_pages(enum canvas_pages pages)
+{
+	canvas_pages = pages;
+}
+
+/*
+ * Layout of the tiles of the canvases created afterwards.
+ */
+void canvas_set_layout(enum canvas_layout layout)
+{
+	canvas_layout = layout;
+}
+
+/*
+ * Whether the canvases created afterwards have a hash per tile, set by
+ * canvas_hash_row() when the owner of the row has painted it.
+ */
+static int canvas_hashes = 0;
+
+void canvas_set_hashes(int keep)
+{
+	canvas_hashes = keep;
+}
+
+/*
+ * Slabs kept by canvas_free() for the next canvases, up to spare_max
+ * bytes, see canvas_keep_slabs().
+ */
+static struct canvas_slab *spare_slabs = NULL;
+static size_t spare_size = 0;
+static size_t spare_max = 0;
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void slabs_unmap(struct canvas_slab *slab)
+{
+	struct canvas_slab *next;
+
+	for (; slab != NULL; slab = next) {
+		next = slab->next;
+		munmap(slab->base, slab->size);
+		free(slab);
+	}
+}
+
+/*
+ * Keep up to max bytes of slabs from the canvases freed, to be reused by
+ * the next ones instead of being mapped again. This is for many small
+ * draws in a row: a slab reused was touched already and keeps its node.
+ * A max of 0 unmaps the slabs kept.
+ */
+void canvas_keep_slabs(size_t max)
+{
+	struct canvas_slab *unmap = NULL;
+
+	pthread_mutex_lock(&spare_lock);
+	spare_max = max;
+	if (max == 0) {
+		unmap = spare_slabs;
+		spare_slabs = NULL;
+		spare_size = 0;
+	}
+	pthread_mutex_unlock(&spare_lock);
+	slabs_unmap(unmap);
+}
+
+static struct canvas_slab *slab_reuse(size_t size)
+{
+	struct canvas_slab **prev, *slab = NULL;
+
+	pthread_mutex_lock(&spare_lock);
+	for (prev = &spare_slabs; *prev != NULL; prev = &(*prev)->next) {
+		if ((*prev)->size == size) {
+			slab = *prev;
+			*prev = slab->next;
+			spare_size -= size;
+			slab->next = NULL;
+			slab->used = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&spare_lock);
+	return slab;
+}
+
+/*
+ * Map a transparent huge page aligned on its size, by trimming a larger
+ * mapping, and ask for it to be backed by a huge page.
+ */
+static char *map_huge_page(void)
+{
+	size_t size = CANVAS_HUGE_PAGE;
+	char *map, *base;
+	uintptr_t head;
+
+	map = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	head = (size - ((uintptr_t) map & (size - 1))) & (size - 1);
+	base = map + head;
+	if (head > 0)
+		munmap(map, head);
+	munmap(base + size, size - head);
+	madvise(base, size, MADV_HUGEPAGE);
+	return base;
+}
+
+/*
+ * Slab of cap tiles. The pages are not touched here: they are placed by
+ * the first write to each tile, in canvas_tile().
+ */
+static struct canvas_slab *slab_create(int cap, enum canvas_pages pages)
+{
+	struct canvas_slab *slab;
+	char *base = NULL;
+	size_t size = (size_t) cap * CANVAS_TILE_AREA;
+
+	if (__atomic_load_n(&spare_max, __ATOMIC_RELAXED) > 0 && (slab = slab_reuse(size)) != NULL)
+		return slab;
+
+	slab = (struct canvas_slab *) calloc(1, sizeof(struct canvas_slab));
+	if (slab == NULL)
+		return NULL;
+
+	if (size == CANVAS_HUGE_PAGE) {
+		if (pages == CANVAS_PAGES_HUGETLB) {
+			base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (base == MAP_FAILED)
+				base = NULL;
+		}
+		if (base == NULL)
+			base = map_huge_page();
+	} else {
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED)
+			base = NULL;
+	}
+
+	if (base == NULL) {
+		free(slab);
+		return NULL;
+	}
+	slab->base = base;
+	slab->size = size;
+	slab->cap = cap;
+	return slab;
+}
+
+static void slabs_destroy(struct canvas_slab *slab)
+{
+	struct canvas_slab *next, *unmap = NULL;
+
+	pthread_mutex_lock(&spare_lock);
+	for (; slab != NULL; slab = next) {
+		next = slab->next;
+		if (spare_size + slab->size <= spare_max) {
+			slab->next = spare_slabs;
+			spare_slabs = slab;
+			spare_size += slab->size;
+		} else {
+			slab->next = unmap;
+			unmap = slab;
+		}
+	}
+	pthread_mutex_unlock(&spare_lock);
+	slabs_unmap(unmap);
+}
+
+/*
+ * Memory of a new tile of the tile row ty. The slab of a row is shared
+ * by the threads drawing it, a full slab is replaced by a new one.
+ */
+static char *tile_alloc(struct canvas *canvas, int64_t ty)
+{
+	struct canvas_slab **row, *slab, *fresh;
+	int cap, i;
+
+	if (canvas->pages == CANVAS_PAGES_MALLOC)
+		return (char *) malloc(CANVAS_TILE_AREA);
+
+	row = &canvas->rows[ty];
+	cap = canvas->tiles_x < CANVAS_SLAB_TILES ? canvas->tiles_x : CANVAS_SLAB_TILES;
+	for (;;) {
+		slab = __atomic_load_n(row, __ATOMIC_ACQUIRE);
+		if (slab != NULL) {
+			i = __atomic_fetch_add(&slab->used, 1, __ATOMIC_RELAXED);
+			if (i < slab->cap)
+				return slab->base + (size_t) i * CANVAS_TILE_AREA;
+		}
+
+		if ((fresh = slab_create(cap, canvas->pages)) == NULL)
+			return NULL;
+		if (!__atomic_compare_exchange_n(row, &slab, fresh, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			slabs_destroy(fresh);
+			continue;
+		}
+
+		fresh->next = __atomic_load_n(&canvas->slabs, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&canvas->slabs, &fresh->next, fresh, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+}
+
+/*
+ * A tile from a slab cannot be given back, it stays unused until the
+ * canvas is freed.
+ */
+static void tile_release(struct canvas *canvas, char *tile)
+{
+	if (canvas->pages == CANVAS_PAGES_MALLOC)
+		free(tile);
+}
+
+struct canvas *canvas_create(int64_t width, int64_t height)
+{
+	struct canvas *canvas;
+
+	if (width <= 0 || height <= 0)
+		return NULL;
+
+	canvas = (struct canvas *) malloc(sizeof(struct canvas));
+	if (canvas == NULL)
+		return NULL;
+
+	canvas->width = width;
+	canvas->height = height;
+	canvas->tiles_x = (width + CANVAS_TILE_MASK) >> CANVAS_TILE_SHIFT;
+	canvas->tiles_y = (height + CANVAS_TILE_MASK) >> CANVAS_TILE_SHIFT;
+	canvas->tiles = (char **) calloc(canvas->tiles_x * canvas->tiles_y, sizeof(char *));
+	if (canvas->tiles == NULL) {
+		free(canvas);
+		return NULL;
+	}
+
+	canvas->pages = canvas_pages;
+	canvas->layout = canvas_layout;
+	canvas->slabs = NULL;
+	canvas->rows = NULL;
+	canvas->hashes = NULL;
+	if (canvas->pages != CANVAS_PAGES_MALLOC) {
+		canvas->rows = (struct canvas_slab **) calloc(canvas->tiles_y, sizeof(struct canvas_slab *));
+		if (canvas->rows == NULL)
+			goto err;
+	}
+	if (canvas_hashes) {
+		canvas->hashes = (uint64_t *) calloc(canvas->tiles_x * canvas->tiles_y, sizeof(uint64_t));
+		if (canvas->hashes == NULL)
+			goto err;
+	}
+	return canvas;
+
+err:
+	free(canvas->rows);
+	free(canvas->tiles);
+	free(canvas);
+	return NULL;
+}
+
+void canvas_free(struct canvas *canvas)
+{
+	if (canvas == NULL)
+		return;
+	canvas_clear(canvas, 0, canvas->tiles_x * canvas->tiles_y);
+	slabs_destroy(canvas->slabs);
+	free(canvas->rows);
+	free(canvas->tiles);
+	free(canvas->hashes);
+	free(canvas);
+}
+
+/*
+ * Return the tile (tx, ty), allocating it if needed, or NULL if it could
+ * not be allocated. Several threads may race to allocate the same tile,
+ * only one allocation is kept. The tile is cleared by the calling
+ * thread, which is the first to touch it.
+ */
+char *canvas_tile(struct canvas *canvas, int64_t tx, int64_t ty)
+{
+	char **slot = &canvas->tiles[ty * canvas->tiles_x + tx];
+	char *expected = NULL;
+	char *tile;
+
+	tile = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (tile != NULL)
+		return tile;
+
+	tile = tile_alloc(canvas, ty);
+	if (tile == NULL) {
+		fprintf(stderr, "error: canvas tile (%ld, %ld) not allocated\n", (long) tx, (long) ty);
+		return NULL;
+	}
+	memset(tile, CANVAS_BLANK, CANVAS_TILE_AREA);
+
+	if (!__atomic_compare_exchange_n(slot, &expected, tile, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		tile_release(canvas, tile);
+		tile = expected;
+	}
+	return tile;
+}
+
+/*
+ * Release the tiles [start, end[, in row-major tile order, which makes
+ * them blank again. The memory of slabs is only unmapped by
+ * canvas_free().
+ */
+void canvas_clear(struct canvas *canvas, int64_t start, int64_t end)
+{
+	int64_t i;
+
+	for (i = start; i < end; i++) {
+		tile_release(canvas, canvas->tiles[i]);
+		canvas->tiles[i] = NULL;
+		if (canvas->hashes != NULL)
+			canvas->hashes[i] = 0;
+	}
+}
+
+int64_t canvas_tiles_used(const struct canvas *canvas)
+{
+	int64_t i, used = 0;
+
+	for (i = 0; i < canvas->tiles_x * canvas->tiles_y; i++)
+		if (canvas->tiles[i] != NULL)
+			used++;
+	return used;
+}
+
+/*
+ * Copy the len pixels from (x, y) of a Morton tile into buf, in row
+ * order. Inside a block, the pixels of a row are contiguous.
+ */
+const char *canvas_gather(const char *tile, int64_t x, int64_t y, int64_t len, char *buf)
+{
+	int64_t k, n;
+
+	for (k = 0; k < len; k += n, x += n) {
+		n = CANVAS_BLOCK_SIZE - (x & CANVAS_BLOCK_MASK);
+		if (n == CANVAS_BLOCK_SIZE && len - k >= CANVAS_BLOCK_SIZE) {
+			memcpy(buf + k, tile + canvas_morton(x, y), CANVAS_BLOCK_SIZE);
+			continue;
+		}
+		if (n > len - k)
+			n = len - k;
+		memcpy(buf + k, tile + canvas_morton(x, y), n);
+	}
+	return buf;
+}
+
+static void scatter(char *tile, int64_t x, int64_t y, const char *row, int64_t len)
+{
+	int64_t k, n;
+
+	for (k = 0; k < len; k += n, x += n) {
+		n = CANVAS_BLOCK_SIZE - (x & CANVAS_BLOCK_MASK);
+		if (n > len - k)
+			n = len - k;
+		memcpy(tile + canvas_morton(x, y), row + k, n);
+	}
+}
+
+/*
+ * Grow the canvas to width x height, the old pixel (x, y) moving to
+ * (x + dx, y + dy). When the shift is a whole number of tiles, only the
+ * tile pointers move, otherwise every tile row is copied to its new
+ * place. The tiles of the new canvas are filled by translation, so the
+ * rows copied from different old tiles never overlap. If a tile cannot
+ * be allocated, the canvas is left as it was.
+ */
+int canvas_grow(struct canvas *canvas, int64_t width, int64_t height, int64_t dx, int64_t dy)
+{
+	struct canvas grown;
+	int64_t tx, ty, y, x0, y0, len;
+	char buf[CANVAS_TILE_SIZE];
+	char *old;
+
+	if (dx < 0 || dy < 0 || width < canvas->width + dx || height < canvas->height + dy)
+		return -1;
+
+	grown.width = width;
+	grown.height = height;
+	grown.tiles_x = (width + CANVAS_TILE_MASK) >> CANVAS_TILE_SHIFT;
+	grown.tiles_y = (height + CANVAS_TILE_MASK) >> CANVAS_TILE_SHIFT;
+	grown.tiles = (char **) calloc(grown.tiles_x * grown.tiles_y, sizeof(char *));
+	if (grown.tiles == NULL)
+		return -1;
+	grown.pages = canvas->pages;
+	grown.layout = canvas->layout;
+	grown.slabs = NULL;
+	grown.rows = NULL;
+	grown.hashes = NULL;
+	if (grown.pages != CANVAS_PAGES_MALLOC) {
+		grown.rows = (struct canvas_slab **) calloc(grown.tiles_y, sizeof(struct canvas_slab *));
+		if (grown.rows == NULL) {
+			free(grown.tiles);
+			return -1;
+		}
+	}
+
+	for (ty = 0; ty < canvas->tiles_y; ty++) {
+		for (tx = 0; tx < canvas->tiles_x; tx++) {
+			old = canvas->tiles[ty * canvas->tiles_x + tx];
+			if (old == NULL)
+				continue;
+
+			if (((dx | dy) & CANVAS_TILE_MASK) == 0) {
+				grown.tiles[((ty << CANVAS_TILE_SHIFT) + dy) / CANVAS_TILE_SIZE * grown.tiles_x
+					+ ((tx << CANVAS_TILE_SHIFT) + dx) / CANVAS_TILE_SIZE] = old;
+				continue;
+			}
+
+			x0 = (tx << CANVAS_TILE_SHIFT) + dx;
+			y0 = (ty << CANVAS_TILE_SHIFT) + dy;
+			for (y = 0; y < CANVAS_TILE_SIZE; y++) {
+				const char *row = old + (y << CANVAS_TILE_SHIFT);
+				int64_t x = x0;
+
+				if (canvas->layout == CANVAS_LAYOUT_MORTON)
+					row = canvas_gather(old, 0, y, CANVAS_TILE_SIZE, buf);
+
+				/* Une rangée de tuile tombe sur au plus deux tuiles. */
+				while (x < x0 + CANVAS_TILE_SIZE) {
+					len = (x | CANVAS_TILE_MASK) + 1 - x;
+					if (len > x0 + CANVAS_TILE_SIZE - x)
+						len = x0 + CANVAS_TILE_SIZE - x;
+					if (x < width && y0 + y < height) {
+						char *dst = canvas_tile(&grown, x >> CANVAS_TILE_SHIFT,
+								(y0 + y) >> CANVAS_TILE_SHIFT);
+						if (dst == NULL)
+							goto err;
+						if (canvas->layout == CANVAS_LAYOUT_MORTON)
+							scatter(dst, x, y0 + y, row + (x - x0), len);
+						else
+							memcpy(dst + canvas_offset(x, y0 + y), row + (x - x0), len);
+					}
+					x += len;
+				}
+			}
+		}
+	}
+
+	/* Les tuiles déplacées restent dans leurs slabs, les tuiles
+	 * copiées libèrent les anciens. */
+	if (((dx | dy) & CANVAS_TILE_MASK) == 0) {
+		grown.slabs = canvas->slabs;
+	} else {
+		canvas_clear(canvas, 0, canvas->tiles_x * canvas->tiles_y);
+		slabs_destroy(canvas->slabs);
+	}
+	/* Les tuiles ont bougé, canvas_hash() refait leurs empreintes. */
+	free(canvas->rows);
+	free(canvas->tiles);
+	free(canvas->hashes);
+	*canvas = grown;
+	return 0;
+
+err:
+	/* Les anciennes tuiles ne sont libérées qu'une fois toutes copiées */
+	canvas_clear(&grown, 0, grown.tiles_x * grown.tiles_y);
+	slabs_destroy(grown.slabs);
+	free(grown.rows);
+	free(grown.tiles);
+	return -1;
+}
@@ -0,0 +1,173 @@
+/*
+ * canvas.h
+ *
+ * Sparse canvas of the dragon, made of square tiles allocated on first
+ * write. Coordinates are 64-bit, and a pixel that was never written has
+ * the value CANVAS_BLANK.
+ */
+
+#ifndef CANVAS_H_
+#define CANVAS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CANVAS_TILE_SHIFT	8
+#define CANVAS_TILE_SIZE	(1 << CANVAS_TILE_SHIFT)
+#define CANVAS_TILE_MASK	(CANVAS_TILE_SIZE - 1)
+#define CANVAS_TILE_AREA	(CANVAS_TILE_SIZE * CANVAS_TILE_SIZE)
+#define CANVAS_BLANK		(-1)
+
+/*
+ * Tiles of a slab, 2 MiB when full so that a slab is one huge page.
+ */
+#define CANVAS_SLAB_TILES	32
+
+/*
+ * Memory backing the tiles. With slabs, the tiles of a tile row are
+ * carved from the slabs of that row, which are mapped without being
+ * touched: the pages land on the node of the thread painting the row.
+ */
+enum canvas_pages {
+	CANVAS_PAGES_MALLOC,		/* one malloc per tile */
+	CANVAS_PAGES_THP,			/* slabs with madvise(MADV_HUGEPAGE) */
+	CANVAS_PAGES_HUGETLB,		/* slabs with MAP_HUGETLB, else THP */
+	CANVAS_PAGES_COUNT,
+};
+
+extern const char *canvas_pages_names[CANVAS_PAGES_COUNT];
+
+/*
+ * Order of the pixels inside a tile. The rows are contiguous by default,
+ * so a vertical step of the walk lands CANVAS_TILE_SIZE bytes away. With
+ * the Morton layout, a tile is made of 8x8 blocks of one cache line each,
+ * in Z-order, so the neighbours of a pixel in both directions are close;
+ * the rows are gathered back, 8 pixels at a time, when the canvas is
+ * read.
+ */
+enum canvas_layout {
+	CANVAS_LAYOUT_ROWS,
+	CANVAS_LAYOUT_MORTON,
+	CANVAS_LAYOUT_COUNT,
+};
+
+extern const char *canvas_layout_names[CANVAS_LAYOUT_COUNT];
+
+#define CANVAS_BLOCK_SHIFT	3
+#define CANVAS_BLOCK_SIZE	(1 << CANVAS_BLOCK_SHIFT)
+#define CANVAS_BLOCK_MASK	(CANVAS_BLOCK_SIZE - 1)
+
+/* Bits of a block index spread over the even bits. */
+extern const uint16_t canvas_spread[CANVAS_TILE_SIZE >> CANVAS_BLOCK_SHIFT];
+
+struct canvas_slab {
+	struct canvas_slab *next;
+	char *base;
+	size_t size;
+	int cap;
+	int used;
+};
+
+struct canvas {
+	int64_t width;
+	int64_t height;
+	int64_t tiles_x;
+	int64_t tiles_y;
+	char **tiles;
+	enum canvas_pages pages;
+	enum canvas_layout layout;
+	struct canvas_slab **rows;		/* current slab of each tile row */
+	struct canvas_slab *slabs;		/* every slab, freed with the canvas */
+	uint64_t *hashes;				/* hash of each painted tile, or NULL */
+};
+
+void canvas_set_pages(enum canvas_pages pages);
+void canvas_set_layout(enum canvas_layout layout);
+void canvas_keep_slabs(size_t max);
+void canvas_set_hashes(int keep);
+
+struct canvas *canvas_create(int64_t width, int64_t height);
+void canvas_free(struct canvas *canvas);
+char *canvas_tile(struct canvas *canvas, int64_t tx, int64_t ty);
+void canvas_clear(struct canvas *canvas, int64_t start, int64_t end);
+int64_t canvas_tiles_used(const struct canvas *canvas);
+int canvas_grow(struct canvas *canvas, int64_t width, int64_t height, int64_t dx, int64_t dy);
+const char *canvas_gather(const char *tile, int64_t x, int64_t y, int64_t len, char *buf);
+
+#define CANVAS_FREE(var) do {	\
+	canvas_free(var);			\
+	var = NULL;					\
+} while(0)
+
+/*
+ * Tile holding the pixel (x, y), or NULL if it was never written. The
+ * tile pointers may be set concurrently by canvas_tile().
+ */
+static inline char *canvas_tile_at(const struct canvas *canvas, int64_t x, int64_t y)
+{
+	int64_t index = (y >> CANVAS_TILE_SHIFT) * canvas->tiles_x + (x >> CANVAS_TILE_SHIFT);
+	return __atomic_load_n(&canvas->tiles[index], __ATOMIC_ACQUIRE);
+}
+
+static inline int64_t canvas_offset(int64_t x, int64_t y)
+{
+	return ((y & CANVAS_TILE_MASK) << CANVAS_TILE_SHIFT) | (x & CANVAS_TILE_MASK);
+}
+
+static inline int64_t canvas_morton(int64_t x, int64_t y)
+{
+	int64_t bx = (x & CANVAS_TILE_MASK) >> CANVAS_BLOCK_SHIFT;
+	int64_t by = (y & CANVAS_TILE_MASK) >> CANVAS_BLOCK_SHIFT;
+
+	return ((int64_t) (canvas_spread[bx] | (canvas_spread[by] << 1)) << (2 * CANVAS_BLOCK_SHIFT)) |
+			((y & CANVAS_BLOCK_MASK) << CANVAS_BLOCK_SHIFT) | (x & CANVAS_BLOCK_MASK);
+}
+
+/*
+ * Offset of (x, y) in its tile. The walkers read the layout once before
+ * their loop, since stores to the tiles may alias the canvas.
+ */
+static inline int64_t canvas_layout_offset(enum canvas_layout layout, int64_t x, int64_t y)
+{
+	return layout == CANVAS_LAYOUT_MORTON ? canvas_morton(x, y) : canvas_offset(x, y);
+}
+
+static inline char canvas_get(const struct canvas *canvas, int64_t x, int64_t y)
+{
+	char *tile = canvas_tile_at(canvas, x, y);
+	if (tile == NULL)
+		return CANVAS_BLANK;
+	return tile[canvas_layout_offset(canvas->layout, x, y)];
+}
+
+/*
+ * Set the pixel (x, y), or return -1 if its tile could not be allocated.
+ */
+static inline int canvas_set(struct canvas *canvas, int64_t x, int64_t y, char value)
+{
+	char *tile = canvas_tile_at(canvas, x, y);
+	if (tile == NULL)
+		tile = canvas_tile(canvas, x >> CANVAS_TILE_SHIFT, y >> CANVAS_TILE_SHIFT);
+	if (tile == NULL)
+		return -1;
+	tile[canvas_layout_offset(canvas->layout, x, y)] = value;
+	return 0;
+}
+
+/*
+ * Pointer to the len pixels from (x, y), in the same tile row, or NULL
+ * if the tile is blank. With the Morton layout, they are gathered into
+ * buf, of at least len bytes.
+ */
+static inline const char *canvas_row(const struct canvas *canvas, int64_t x, int64_t y,
+		int64_t len, char *buf)
+{
+	char *tile = canvas_tile_at(canvas, x, y);
+	if (tile == NULL)
+		return NULL;
+	if (canvas->layout == CANVAS_LAYOUT_MORTON)
+		return canvas_gather(tile, x, y, len, buf);
+	return tile + canvas_offset(x, y);
+}
+
+#endif /* CANVAS_H_ */
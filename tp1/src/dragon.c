@@ -12,9 +12,12 @@
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <string.h>
 
 #include "dragon.h"
 #include "color.h"
+#include "trace.h"
 
 const xy_t tiles_orientation[NB_TILES] = {
 		{1 ,1},
@@ -23,50 +26,130 @@ const xy_t tiles_orientation[NB_TILES] = {
 		{-1, 1}
 };
 
-xy_t compute_position(uint64_t tile, int64_t i)
+/*
+ * Start states of every tile for each of the count indexes. The factor
+ * of an index is shared by the tiles, and the powers of 1 - j by the
+ * indexes.
+ */
+void compute_states(const int64_t *indexes, size_t count, xy_t (*positions)[NB_TILES],
+		xy_t (*orientations)[NB_TILES])
 {
-	xy_t position;
-	position.x = 0;
-	position.y = 0;
-	if (i > 0) {
-		int64_t mask = 1;
-		int64_t position_y = tiles_orientation[tile].y;
-		position = tiles_orientation[tile];
-
-		while ((i ^ mask) > mask)  {
-			mask <<= 1;
-			position_y -= position.x;
-			position.x += position.y;
-			position.y  = position_y;
-		}
+	const xy_t one_minus_j = { 1, -1 };
+	xy_t powers[64];
+	size_t n;
+	int k, tile;
 
-		if (i ^ mask) {
-			xy_t delta = compute_position(tile, (mask << 1) - i);
-			position_y -= position.x - delta.x;
-			position.x += position.y - delta.y;
-			position.y = position_y;
+	powers[0] = jump_power(0);
+	for (k = 1; k < 64; k++)
+		powers[k] = xy_mul(powers[k - 1], one_minus_j);
+
+	for (n = 0; n < count; n++) {
+		int64_t i = indexes[n];
+		xy_t z = { 0, 0 };
+		int turns = jump_turns(i);
+
+		if (i > 0) {
+			int top = 63 - __builtin_clzll(i);
+			z = jump_descend(i, top, powers[top + 1]);
+		}
+		for (tile = 0; tile < NB_TILES; tile++) {
+			xy_t o = tiles_orientation[tile];
+			positions[n][tile] = xy_mul(z, o);
+			for (k = 0; k < turns; k++)
+				rotate_right(&o);
+			orientations[n][tile] = o;
 		}
 	}
-	return position;
 }
 
-xy_t compute_orientation(uint64_t tile, int64_t i)
+/*
+ * Index of a diagonal orientation in tiles_orientation[].
+ */
+static inline int walk_index(xy_t orientation)
+{
+	return (orientation.x < 0) | ((orientation.x != orientation.y) << 1);
+}
+
+static inline void walk_turn(uint64_t n, xy_t *orientation)
+{
+	if (((n & -n) << 1) & n)
+		rotate_left(orientation);
+	else
+		rotate_right(orientation);
+}
+
+/*
+ * Walk the blocks [0, WALK_BLOCK[ and [WALK_BLOCK, 2 * WALK_BLOCK[ one
+ * segment at a time from each orientation, as dragon_draw_raw() and
+ * piece_limit() would.
+ */
+void walk_table_init(struct walk_table *table)
 {
-	xy_t orientation = tiles_orientation[tile];
-	if (i > 0) {
-		int64_t mask = 1;
-		while ((i ^ mask) > mask) { mask <<= 1; }
-		orientation = compute_orientation(tile, (mask << 1) - (i + 1));
-		rotate_right(&orientation);
+	struct walk_block *block;
+	xy_t position, orientation;
+	int64_t j, i;
+	uint64_t n, first;
+	int p, o, k;
+
+	for (p = 0; p < 2; p++) {
+		for (o = 0; o < NB_TILES; o++) {
+			block = &table->blocks[p][o];
+			first = p * WALK_BLOCK;
+			position.x = 0;
+			position.y = 0;
+			orientation = tiles_orientation[o];
+			block->pmin_x = block->pmin_y = INT8_MAX;
+			block->pmax_x = block->pmax_y = INT8_MIN;
+			block->min_x = block->min_y = INT8_MAX;
+			block->max_x = block->max_y = INT8_MIN;
+
+			for (k = 0, n = first + 1; k < WALK_BLOCK; k++, n++) {
+				j = (position.x + (position.x + orientation.x)) >> 1;
+				i = (position.y + (position.y + orientation.y)) >> 1;
+				block->pixel_x[k] = j;
+				block->pixel_y[k] = i;
+				if (block->pmin_x > j) block->pmin_x = j;
+				if (block->pmin_y > i) block->pmin_y = i;
+				if (block->pmax_x < j) block->pmax_x = j;
+				if (block->pmax_y < i) block->pmax_y = i;
+
+				position.x += orientation.x;
+				position.y += orientation.y;
+				if (block->min_x > position.x) block->min_x = position.x;
+				if (block->min_y > position.y) block->min_y = position.y;
+				if (block->max_x < position.x) block->max_x = position.x;
+				if (block->max_y < position.y) block->max_y = position.y;
+
+				if (n != first + WALK_BLOCK)
+					walk_turn(n, &orientation);
+			}
+			block->dx = position.x;
+			block->dy = position.y;
+			block->ox = orientation.x;
+			block->oy = orientation.y;
+		}
 	}
-	return orientation;
+}
+
+static struct walk_table walk_table;
+static pthread_once_t walk_table_once = PTHREAD_ONCE_INIT;
+
+static void walk_table_build(void)
+{
+	walk_table_init(&walk_table);
+}
+
+const struct walk_table *walk_table_get(void)
+{
+	pthread_once(&walk_table_once, walk_table_build);
+	return &walk_table;
 }
 
 /* draw dragon in raw matrix
  *
  * The `tile` parameter controls the initial orientation of the dragon.
  * */
-int dragon_draw_raw(uint64_t tile, uint64_t start, uint64_t end, char *dragon, int width, int height, limits_t limits, char id)
+int dragon_draw_raw(uint64_t tile, uint64_t start, uint64_t end, struct canvas *dragon, limits_t limits, char id)
 {
 	if (end < start)
 		printf("error: start=%"PRId64" > end=%"PRId64"\n", start, end);
@@ -77,29 +160,190 @@ int dragon_draw_raw(uint64_t tile, uint64_t start, uint64_t end, char *dragon, i
 	if (end == start)
 		return 0;
 
+	const struct walk_table *table = walk_table_get();
+	enum canvas_layout layout = dragon->layout;
 	xy_t position;
 	xy_t orientation;
-	int i, j;
+	int64_t i, j;
 	uint64_t n;
+	int k;
 	position = compute_position(tile, start);
 	orientation = compute_orientation(tile, start);
 
 	// draw dragon
 	position.x -= limits.minimums.x;
 	position.y -= limits.minimums.y;
-	int area = width * height;
 	for (n = start + 1; n <= end; n++) {
+		/* Bloc aligné complet : pixels et déplacement tirés de la table. */
+		if (((n - 1) & (WALK_BLOCK - 1)) == 0 && end - (n - 1) >= WALK_BLOCK) {
+			const struct walk_block *block = &table->blocks[((n - 1) >> WALK_BLOCK_SHIFT) & 1]
+					[walk_index(orientation)];
+			int64_t x0 = position.x + block->pmin_x, x1 = position.x + block->pmax_x;
+			int64_t y0 = position.y + block->pmin_y, y1 = position.y + block->pmax_y;
+			if (y0 < 0 || y1 >= dragon->height || x0 < 0 || x1 >= dragon->width) {
+				printf("block (%"PRId64", %"PRId64") is out of range\n", x0, y0);
+				return -1;
+			}
+			if ((x0 >> CANVAS_TILE_SHIFT) == (x1 >> CANVAS_TILE_SHIFT) &&
+					(y0 >> CANVAS_TILE_SHIFT) == (y1 >> CANVAS_TILE_SHIFT)) {
+				char *dst = canvas_tile(dragon, x0 >> CANVAS_TILE_SHIFT, y0 >> CANVAS_TILE_SHIFT);
+				if (dst == NULL)
+					return -1;
+				for (k = 0; k < WALK_BLOCK; k++)
+					dst[canvas_layout_offset(layout, position.x + block->pixel_x[k],
+							position.y + block->pixel_y[k])] = id;
+			} else {
+				for (k = 0; k < WALK_BLOCK; k++)
+					if (canvas_set(dragon, position.x + block->pixel_x[k],
+							position.y + block->pixel_y[k], id) < 0)
+						return -1;
+			}
+			position.x += block->dx;
+			position.y += block->dy;
+			orientation.x = block->ox;
+			orientation.y = block->oy;
+			n += WALK_BLOCK - 1;
+			walk_turn(n, &orientation);
+			continue;
+		}
+
 		j = (position.x + (position.x + orientation.x)) >> 1;
 		i = (position.y + (position.y + orientation.y)) >> 1;
-		int index = i * width + j;
-		if (index < 0 || index > area) {
-			printf("index %d is out of range\n", i);
+		if (i < 0 || i >= dragon->height || j < 0 || j >= dragon->width) {
+			printf("pixel (%"PRId64", %"PRId64") is out of range\n", j, i);
 			return -1;
 		}
-		dragon[index] = id;
+		if (canvas_set(dragon, j, i, id) < 0)
+			return -1;
 		position.x += orientation.x;
 		position.y += orientation.y;
 
+		walk_turn(n, &orientation);
+	}
+	return 0;
+}
+
+/*
+ * Segments of blocks at or below this level are walked one by one
+ * instead of being culled further.
+ */
+#define CULL_LEAF_LEVEL 5
+
+struct cull_data {
+	const struct piece_table *table;
+	struct canvas *dragon;
+	int64_t width;
+	int64_t height;
+	char id;
+	int failed;		/* a tile was not allocated */
+};
+
+/*
+ * Draw the aligned block of 2^level segments starting at segment n. On
+ * return, position and orientation are at the end of the block, before
+ * its last turn. The bounding box of the block is obtained by merging the
+ * block summary from the piece table, and the block is skipped when the
+ * box does not intersect the canvas. A segment from p to p + o paints the
+ * pixel at the minimum of both ends, hence the exclusive upper bound.
+ */
+static void cull_block(struct cull_data *data, int level, uint64_t n,
+		xy_t *position, xy_t *orientation)
+{
+	piece_t m;
+	uint64_t k, half;
+	int64_t i, j;
+
+	m.position = *position;
+	m.orientation = *orientation;
+	m.limits.minimums = *position;
+	m.limits.maximums = *position;
+	piece_merge(&m, data->table->blocks[level][(n >> level) & 1], tiles_orientation[0]);
+
+	if (m.limits.minimums.x >= data->width || m.limits.maximums.x <= 0 ||
+	    m.limits.minimums.y >= data->height || m.limits.maximums.y <= 0) {
+		*position = m.position;
+		*orientation = m.orientation;
+		return;
+	}
+
+	if (level > CULL_LEAF_LEVEL) {
+		half = 1ULL << (level - 1);
+		cull_block(data, level - 1, n, position, orientation);
+		if ((((n + half) & -(n + half)) << 1) & (n + half))
+			rotate_left(orientation);
+		else
+			rotate_right(orientation);
+		cull_block(data, level - 1, n + half, position, orientation);
+		return;
+	}
+
+	for (k = n + 1; k <= n + (1ULL << level); k++) {
+		j = (position->x + (position->x + orientation->x)) >> 1;
+		i = (position->y + (position->y + orientation->y)) >> 1;
+		if (i >= 0 && i < data->height && j >= 0 && j < data->width &&
+				canvas_set(data->dragon, j, i, data->id) < 0)
+			data->failed = 1;
+		position->x += orientation->x;
+		position->y += orientation->y;
+
+		if (k == n + (1ULL << level))
+			break;
+		if (((k & -k) << 1) & k)
+			rotate_left(orientation);
+		else
+			rotate_right(orientation);
+	}
+}
+
+/*
+ * Same as dragon_draw_raw(), but only the pixels inside the viewport are
+ * drawn, and the canvas covers the viewport only. The viewport is given in
+ * dragon coordinates, that is relative to limits.minimums, with exclusive
+ * maximums. The range is split into aligned blocks like in piece_jump(),
+ * so the cost follows the number of visible segments.
+ */
+int dragon_draw_culled(uint64_t tile, uint64_t start, uint64_t end, struct canvas *dragon,
+		limits_t limits, limits_t viewport, char id)
+{
+	struct cull_data data;
+	xy_t position;
+	xy_t orientation;
+	uint64_t n = start;
+	int level;
+
+	if (end < start)
+		printf("error: start=%"PRId64" > end=%"PRId64"\n", start, end);
+
+	if (tile >= NB_TILES)
+		printf("error: tile=%"PRId64" not in the range [0,%d[\n", tile, NB_TILES);
+
+	if (end <= start)
+		return 0;
+
+	data.table = piece_table_get();
+	data.dragon = dragon;
+	data.width = viewport.maximums.x - viewport.minimums.x;
+	data.height = viewport.maximums.y - viewport.minimums.y;
+	data.id = id;
+	data.failed = 0;
+
+	position = compute_position(tile, start);
+	orientation = compute_orientation(tile, start);
+	position.x -= limits.minimums.x + viewport.minimums.x;
+	position.y -= limits.minimums.y + viewport.minimums.y;
+
+	while (n < end) {
+		level = n ? __builtin_ctzll(n) : PIECE_TABLE_LEVELS - 1;
+		if (level > PIECE_TABLE_LEVELS - 1)
+			level = PIECE_TABLE_LEVELS - 1;
+		while (end - n < (1ULL << level))
+			level--;
+
+		cull_block(&data, level, n, &position, &orientation);
+		if (data.failed)
+			return -1;
+		n += 1ULL << level;
+
 		if (((n & -n) << 1) & n)
 			rotate_left(&orientation);
 		else
@@ -108,22 +352,14 @@ int dragon_draw_raw(uint64_t tile, uint64_t start, uint64_t end, char *dragon, i
 	return 0;
 }
 
-void init_canvas(int start, int end, char *canvas, char value)
-{
-    int i;
-    for (i = start; i < end; i++) {
-        canvas[i] = value;
-    }
-}
-
-void dump_canvas(char *canvas, int width, int height)
+void dump_canvas(struct canvas *canvas)
 {
-	int i, j;
+	int64_t i, j;
 
-	printf("width=%d height=%d\n", width, height);
-	for (i = 0; i < width; i++) {
-		for (j = 0; j < height; j++) {
-			printf("%d ", canvas[j * width + i]);
+	printf("width=%"PRId64" height=%"PRId64"\n", canvas->width, canvas->height);
+	for (i = 0; i < canvas->width; i++) {
+		for (j = 0; j < canvas->height; j++) {
+			printf("%d ", canvas_get(canvas, i, j));
 		}
 		printf("\n");
 	}
@@ -143,65 +379,372 @@ void dump_canvas_rgb(struct rgb *canvas, int width, int height)
 	}
 }
 
-void scale_dragon(int start, int end, struct rgb *image, int image_width, int image_height,
-        char *dragon, int dragon_width, int dragon_height, struct palette *palette)
-{
-    int i, j, x, y;
-
-    int scale_x = dragon_width / image_width + 1;
-    int scale_y = dragon_height / image_height + 1;
-    int scale = (scale_x > scale_y ? scale_x : scale_y);
-
-    int deltaJ = (scale * image_width - dragon_width) / 2;
-    int deltaI = (scale * image_height - dragon_height) / 2;
-    struct rgb *colors = palette->colors;
-
-    for (y = start; y < end; y++) {
-        int i1 = y * scale - deltaI;
-        int i2 = i1 + scale;
-        if (i1 < 0) i1 = 0;
-        if (i2 > dragon_height) i2 = dragon_height;
-        for (x = 0; x < image_width; x++) {
-
-            int j1 = x * scale - deltaJ, j2 = j1 + scale;
-            int red = 0;
-            int green = 0;
-            int blue = 0;
-            int cnt = 0;
-            if (j1 < 0) j1 = 0;
-            if (j2 > dragon_width) j2 = dragon_width;
-
-            for (i = i1; i < i2; i++) {
-                for (j = j1; j < j2; j++) {
-                    int id = dragon[i * dragon_width + j];
-                    if (id >= 0) {
-                        red     += colors[id].r;
-                        green   += colors[id].g;
-                        blue    += colors[id].b;
-                    } else {
-                        red     += 255;
-                        green   += 255;
-                        blue    += 255;
-                    }
-                    cnt++;
-                }
-            }
-            int index = y * image_width + x;
-            if (cnt == 0) {
-                image[index] = white;
-            } else {
-                image[index].r = (unsigned char) (red   / cnt);
-                image[index].g = (unsigned char) (green / cnt);
-                image[index].b = (unsigned char) (blue  / cnt);
-            }
-        }
-    }
-}
-
-int dragon_draw_serial(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_colors)
+/*
+ * Same scale and centering as scale_dragon(), from the dimensions of
+ * the image and of the dragon.
+ */
+void scale_init(struct draw_data *data)
+{
+	int64_t scale_x = data->dragon_width / data->image_width + 1;
+	int64_t scale_y = data->dragon_height / data->image_height + 1;
+
+	data->scale = (scale_x > scale_y ? scale_x : scale_y);
+	data->deltaJ = (data->scale * data->image_width - data->dragon_width) / 2;
+	data->deltaI = (data->scale * data->image_height - data->dragon_height) / 2;
+}
+
+static int scale_first_row(const struct draw_data *data, int64_t ty)
+{
+	int64_t y;
+
+	if (ty <= 0)
+		return 0;
+	if (ty >= data->dragon->tiles_y)
+		return data->image_height;
+	y = ((ty << CANVAS_TILE_SHIFT) + data->deltaI + data->scale - 1) / data->scale;
+	return y < data->image_height ? y : data->image_height;
+}
+
+/*
+ * Image rows [*start, *end[ starting in the tile row ty of the dragon,
+ * so that the render of a tile row can run on the thread that painted
+ * it and read memory of its own node.
+ */
+void scale_rows(const struct draw_data *data, int64_t ty, int *start, int *end)
+{
+	*start = scale_first_row(data, ty);
+	*end = scale_first_row(data, ty + 1);
+}
+
+/*
+ * Colour of segment n when the dragon is split in nb_colors parts, as
+ * done by dragon_draw_serial().
+ */
+int segment_color(uint64_t n, uint64_t size, int nb_colors)
+{
+	int m = n * nb_colors / size;
+
+	while (m > 0 && m * size / nb_colors > n)
+		m--;
+	while (m < nb_colors - 1 && (m + 1) * size / nb_colors <= n)
+		m++;
+	return m;
+}
+
+/*
+ * Same walk as dragon_draw_raw(), but each pixel is accumulated in the
+ * bin of the image pixel it falls into. Every pixel of the dragon is
+ * drawn at most once, so the bins hold exactly what scale_dragon() would
+ * read from the canvas.
+ */
+int dragon_bin_raw(uint64_t tile, uint64_t start, uint64_t end, struct rgb_bin *bins,
+		const struct draw_data *data, char id)
+{
+	if (end < start)
+		printf("error: start=%"PRId64" > end=%"PRId64"\n", start, end);
+
+	if (tile >= NB_TILES)
+		printf("error: tile=%"PRId64" not in the range [0,%d[\n", tile, NB_TILES);
+
+	if (end == start)
+		return 0;
+
+	xy_t position;
+	xy_t orientation;
+	int64_t i, j, x, y;
+	uint64_t n;
+	struct rgb color = data->palette->colors[(int) id];
+	position = compute_position(tile, start);
+	orientation = compute_orientation(tile, start);
+
+	position.x -= data->limits.minimums.x;
+	position.y -= data->limits.minimums.y;
+	for (n = start + 1; n <= end; n++) {
+		j = (position.x + (position.x + orientation.x)) >> 1;
+		i = (position.y + (position.y + orientation.y)) >> 1;
+		x = (j + data->deltaJ) / data->scale;
+		y = (i + data->deltaI) / data->scale;
+		if (x < 0 || x >= data->image_width || y < 0 || y >= data->image_height) {
+			printf("pixel (%"PRId64", %"PRId64") is out of range\n", j, i);
+			return -1;
+		}
+		struct rgb_bin *bin = &bins[y * data->image_width + x];
+		bin->r += color.r;
+		bin->g += color.g;
+		bin->b += color.b;
+		bin->cnt++;
+		position.x += orientation.x;
+		position.y += orientation.y;
+
+		if (((n & -n) << 1) & n)
+			rotate_left(&orientation);
+		else
+			rotate_right(&orientation);
+	}
+	return 0;
+}
+
+/*
+ * Render the rows [start, end[ of the image from nb_bins partial bin
+ * arrays of image size, stored one after the other. The dragon pixels
+ * of each image pixel that were never drawn count as white, exactly like
+ * in scale_dragon().
+ */
+void render_bins(int start, int end, const struct rgb_bin *bins, int nb_bins, const struct draw_data *data)
+{
+	int x, y, k;
+	int64_t scale = data->scale;
+	int area = data->image_width * data->image_height;
+
+	for (y = start; y < end; y++) {
+		int64_t i1 = y * scale - data->deltaI;
+		int64_t i2 = i1 + scale;
+		if (i1 < 0) i1 = 0;
+		if (i2 > data->dragon_height) i2 = data->dragon_height;
+		for (x = 0; x < data->image_width; x++) {
+			int64_t j1 = x * scale - data->deltaJ, j2 = j1 + scale;
+			if (j1 < 0) j1 = 0;
+			if (j2 > data->dragon_width) j2 = data->dragon_width;
+
+			int index = y * data->image_width + x;
+			int64_t cnt = (i2 > i1 && j2 > j1) ? (i2 - i1) * (j2 - j1) : 0;
+			int64_t red = 0, green = 0, blue = 0, drawn = 0;
+			for (k = 0; k < nb_bins; k++) {
+				const struct rgb_bin *bin = &bins[k * area + index];
+				red   += bin->r;
+				green += bin->g;
+				blue  += bin->b;
+				drawn += bin->cnt;
+			}
+			if (cnt == 0) {
+				data->image[index] = white;
+			} else {
+				red   += 255 * (cnt - drawn);
+				green += 255 * (cnt - drawn);
+				blue  += 255 * (cnt - drawn);
+				data->image[index].r = (unsigned char) (red   / cnt);
+				data->image[index].g = (unsigned char) (green / cnt);
+				data->image[index].b = (unsigned char) (blue  / cnt);
+			}
+		}
+	}
+}
+
+/*
+ * Canvas tiles are owned by row of tiles, interleaved between owners so
+ * that the work is spread even if the dragon does not fill its box.
+ */
+int tile_owner(int64_t ty, int nb_owners)
+{
+	return ty % nb_owners;
+}
+
+static int run_list_push(struct run_list *list, const struct segment_run *run)
+{
+	if (list->len == list->cap) {
+		size_t cap = list->cap ? list->cap * 2 : 64;
+		struct segment_run *runs = realloc(list->runs, cap * sizeof(struct segment_run));
+		if (runs == NULL)
+			return -1;
+		list->runs = runs;
+		list->cap = cap;
+	}
+	list->runs[list->len++] = *run;
+	return 0;
+}
+
+void run_lists_free(struct run_list *lists, int nb)
+{
+	int i;
+
+	if (lists == NULL)
+		return;
+	for (i = 0; i < nb; i++)
+		FREE(lists[i].runs);
+	free(lists);
+}
+
+/*
+ * First phase of the binned draw: walk the segments [start, end[ and cut
+ * them into runs, each run going to the list of the owner of its tile
+ * (data->nb_owners lists). Colours are those of dragon_draw_serial(), so
+ * the result does not depend on how the range is split.
+ */
+int dragon_bin_runs(uint64_t tile, uint64_t start, uint64_t end, const struct draw_data *data,
+		struct run_list *lists)
+{
+	if (end <= start)
+		return 0;
+	return dragon_bin_runs_at(compute_position(tile, start), compute_orientation(tile, start),
+			start, end, data, lists);
+}
+
+/*
+ * Same as dragon_bin_runs(), from the state of segment start given by
+ * compute_states().
+ */
+int dragon_bin_runs_at(xy_t position, xy_t orientation, uint64_t start, uint64_t end,
+		const struct draw_data *data, struct run_list *lists)
+{
+	struct segment_run run;
+	int64_t i, j, tx, ty;
+	int64_t run_tx = -1, run_ty = -1;
+	uint64_t n, next_color = start;
+	char id = 0;
+
+	if (end <= start)
+		return 0;
+
+	position.x -= data->limits.minimums.x;
+	position.y -= data->limits.minimums.y;
+	run.len = 0;
+
+	for (n = start; n < end; n++) {
+		j = (position.x + (position.x + orientation.x)) >> 1;
+		i = (position.y + (position.y + orientation.y)) >> 1;
+		tx = j >> CANVAS_TILE_SHIFT;
+		ty = i >> CANVAS_TILE_SHIFT;
+
+		if (n == next_color) {
+			id = segment_color(n, data->size, data->nb_thread);
+			next_color = (id + 1) * data->size / data->nb_thread;
+			run_tx = -1;
+		}
+		if (tx != run_tx || ty != run_ty || run.len == UINT32_MAX) {
+			if (run.len > 0 && run_list_push(&lists[tile_owner(run_ty, data->nb_owners)], &run) < 0)
+				return -1;
+			run.n = n;
+			run.x = position.x;
+			run.y = position.y;
+			run.ox = orientation.x;
+			run.oy = orientation.y;
+			run.id = id;
+			run.len = 0;
+			run_tx = tx;
+			run_ty = ty;
+		}
+		run.len++;
+
+		position.x += orientation.x;
+		position.y += orientation.y;
+		if ((((n + 1) & -(n + 1)) << 1) & (n + 1))
+			rotate_left(&orientation);
+		else
+			rotate_right(&orientation);
+	}
+	if (run.len > 0 && run_list_push(&lists[tile_owner(run_ty, data->nb_owners)], &run) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Second phase of the binned draw: replay the runs of one list. Each run
+ * stays in one tile, which is looked up once. Returns -1 if a tile could
+ * not be allocated.
+ */
+int dragon_paint_runs(const struct run_list *list, struct canvas *dragon)
+{
+	enum canvas_layout layout = dragon->layout;
+	size_t r;
+	uint32_t k;
+
+	for (r = 0; r < list->len; r++) {
+		const struct segment_run *run = &list->runs[r];
+		xy_t position = { run->x, run->y };
+		xy_t orientation = { run->ox, run->oy };
+		int64_t j = (position.x + (position.x + orientation.x)) >> 1;
+		int64_t i = (position.y + (position.y + orientation.y)) >> 1;
+		char *tile = canvas_tile(dragon, j >> CANVAS_TILE_SHIFT, i >> CANVAS_TILE_SHIFT);
+		uint64_t n = run->n;
+
+		if (tile == NULL)
+			return -1;
+		for (k = 0; k < run->len; k++, n++) {
+			j = (position.x + (position.x + orientation.x)) >> 1;
+			i = (position.y + (position.y + orientation.y)) >> 1;
+			tile[canvas_layout_offset(layout, j, i)] = run->id;
+			position.x += orientation.x;
+			position.y += orientation.y;
+			if ((((n + 1) & -(n + 1)) << 1) & (n + 1))
+				rotate_left(&orientation);
+			else
+				rotate_right(&orientation);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Draw the dragon straight into the image bins. No canvas is allocated,
+ * so *canvas is set to NULL.
+ */
+int dragon_stream_serial(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_colors)
 {
 	int ret = 0;
-	char *dragon = NULL;
+	struct draw_data data;
+	limits_t limits;
+	limits.minimums.x = 0;
+	limits.minimums.y = 0;
+	limits.maximums = limits.minimums;
+	int m, tile;
+
+	memset(&data, 0, sizeof(data));
+	*canvas = NULL;
+
+	if (dragon_limits_serial(&limits, size, 0) < 0)
+		goto err;
+	trace_phase(PHASE_LIMITS);
+
+	data.image = image;
+	data.image_width = width;
+	data.image_height = height;
+	data.dragon_width = limits.maximums.x - limits.minimums.x;
+	data.dragon_height = limits.maximums.y - limits.minimums.y;
+	data.limits = limits;
+	data.size = size;
+	scale_init(&data);
+
+	data.bins = (struct rgb_bin *) calloc(width * height, sizeof(struct rgb_bin));
+	if (data.bins == NULL) {
+		printf("error: Bins not allocated\n");
+		goto err;
+	}
+
+	data.palette = init_palette(nb_colors);
+	if (data.palette == NULL) {
+		printf("error: Palette not initialized\n");
+		goto err;
+	}
+	trace_phase(PHASE_CANVAS);
+
+	for (m = 0; m < nb_colors; m++) {
+		uint64_t start = m * size / nb_colors;
+		uint64_t end = (m + 1) * size / nb_colors;
+
+		for (tile = 0; tile < NB_TILES; tile++)
+			if (dragon_bin_raw(tile, start, end, data.bins, &data, m) < 0)
+				goto err;
+	}
+
+	trace_phase(PHASE_DRAW);
+
+	render_bins(0, height, data.bins, 1, &data);
+	trace_phase(PHASE_RENDER);
+
+done:
+	free_palette(data.palette);
+	FREE(data.bins);
+	return ret;
+
+err:
+	ret = -1;
+	goto done;
+}
+
+int dragon_draw_serial(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_colors)
+{
+	int ret = 0;
+	struct canvas *dragon = NULL;
 	struct palette *palette = NULL;
 	limits_t limits;
 	limits.minimums.x = 0;
@@ -210,13 +753,14 @@ int dragon_draw_serial(char **canvas, struct rgb *image, int width, int height,
 
 	if (dragon_limits_serial(&limits, size, 0) < 0)
 		goto err;
+	trace_phase(PHASE_LIMITS);
 
-	int dragon_width = limits.maximums.x - limits.minimums.x;
-	int dragon_height = limits.maximums.y - limits.minimums.y;
-	int area = dragon_width * dragon_height;
+	int64_t dragon_width = limits.maximums.x - limits.minimums.x;
+	int64_t dragon_height = limits.maximums.y - limits.minimums.y;
 	int m;
 
-	dragon = (char*)malloc(sizeof(char) * area);
+	// La surface est vide, les tuiles sont allouées au besoin
+	dragon = canvas_create(dragon_width, dragon_height);
 	if (dragon == NULL) {
 		printf("error: Dragon not allocated\n");
 		goto err;
@@ -227,9 +771,7 @@ int dragon_draw_serial(char **canvas, struct rgb *image, int width, int height,
 		printf("error: Palette not initialized\n");
 		goto err;
 	}
-
-	// Initialiser la surface
-	init_canvas(0, area, dragon, -1);
+	trace_phase(PHASE_CANVAS);
 
 	// Dessiner les dragons dans les 4 directions
 	for (m = 0; m < nb_colors; m++) {
@@ -240,14 +782,199 @@ int dragon_draw_serial(char **canvas, struct rgb *image, int width, int height,
 		 * Le premier argument (tile) contrôle la direction vers laquelle
 		 * le dragon est dessiné.
 		 */
-		dragon_draw_raw(0, start, end, dragon, dragon_width, dragon_height, limits, m);
-		dragon_draw_raw(1, start, end, dragon, dragon_width, dragon_height, limits, m);
-		dragon_draw_raw(2, start, end, dragon, dragon_width, dragon_height, limits, m);
-		dragon_draw_raw(3, start, end, dragon, dragon_width, dragon_height, limits, m);
+		if (dragon_draw_raw(0, start, end, dragon, limits, m) < 0 ||
+				dragon_draw_raw(1, start, end, dragon, limits, m) < 0 ||
+				dragon_draw_raw(2, start, end, dragon, limits, m) < 0 ||
+				dragon_draw_raw(3, start, end, dragon, limits, m) < 0)
+			goto err;
 	}
 
+	trace_phase(PHASE_DRAW);
+
 	// Rendu final
-	scale_dragon(0, height, image, width, height, dragon, dragon_width, dragon_height, palette);
+	scale_dragon(0, height, image, width, height, dragon, palette);
+	trace_phase(PHASE_RENDER);
+
+done:
+	free_palette(palette);
+	*canvas = dragon;
+	return ret;
+
+err:
+	CANVAS_FREE(dragon);
+	ret = -1;
+	goto done;
+}
+
+int dragon_sweep_init(struct dragon_sweep *sweep, uint64_t final_size, int nb_colors)
+{
+	int i;
+
+	memset(sweep, 0, sizeof(*sweep));
+	sweep->final_size = final_size;
+	sweep->nb_colors = nb_colors;
+
+	for (i = 0; i < NB_TILES; i++) {
+		piece_init(&sweep->pieces[i]);
+		sweep->pieces[i].orientation = tiles_orientation[i];
+	}
+
+	sweep->palette = init_palette(nb_colors);
+	if (sweep->palette == NULL) {
+		printf("error: Palette not initialized\n");
+		return -1;
+	}
+	return 0;
+}
+
+void dragon_sweep_fini(struct dragon_sweep *sweep)
+{
+	CANVAS_FREE(sweep->dragon);
+	free_palette(sweep->palette);
+	sweep->palette = NULL;
+}
+
+/*
+ * Extend the pieces from sweep->size to size segments, then grow the
+ * canvas to the new limits. The limits only expand, and the old drawing
+ * moves by the distance the minimums went down.
+ */
+int dragon_sweep_grow(struct dragon_sweep *sweep, uint64_t size)
+{
+	limits_t limits;
+	int64_t width, height;
+	int i;
+
+	if (size < sweep->size || size > sweep->final_size)
+		return -1;
+
+	limits.minimums.x = 0;
+	limits.minimums.y = 0;
+	limits.maximums = limits.minimums;
+	for (i = 0; i < NB_TILES; i++) {
+		piece_jump(sweep->size, size, &sweep->pieces[i]);
+		merge_limits(&limits, &sweep->pieces[i].limits);
+	}
+
+	width = limits.maximums.x - limits.minimums.x;
+	height = limits.maximums.y - limits.minimums.y;
+
+	if (sweep->dragon == NULL) {
+		sweep->dragon = canvas_create(width, height);
+		if (sweep->dragon == NULL) {
+			printf("error: Dragon not allocated\n");
+			return -1;
+		}
+	} else if (canvas_grow(sweep->dragon, width, height,
+			sweep->limits.minimums.x - limits.minimums.x,
+			sweep->limits.minimums.y - limits.minimums.y) < 0) {
+		printf("error: Dragon not grown\n");
+		return -1;
+	}
+
+	sweep->limits = limits;
+	return 0;
+}
+
+/*
+ * Draw the segments [start, end[ of the four tiles, each with the colour
+ * it has in the dragon of final_size segments.
+ */
+int dragon_sweep_draw(const struct dragon_sweep *sweep, uint64_t start, uint64_t end)
+{
+	uint64_t n, next;
+	int m, tile;
+
+	for (n = start; n < end; n = next) {
+		m = segment_color(n, sweep->final_size, sweep->nb_colors);
+		next = (m + 1) * sweep->final_size / sweep->nb_colors;
+		if (next > end)
+			next = end;
+		for (tile = 0; tile < NB_TILES; tile++)
+			if (dragon_draw_raw(tile, n, next, sweep->dragon, sweep->limits, m) < 0)
+				return -1;
+	}
+	return 0;
+}
+
+/*
+ * One step of the sweep: grow to size segments, draw the new ones and
+ * render the whole canvas, unless image is NULL.
+ */
+int dragon_sweep_serial(struct dragon_sweep *sweep, struct rgb *image, int width, int height,
+		uint64_t size, __attribute__((unused)) int nb_thread)
+{
+	uint64_t start = sweep->size;
+
+	if (dragon_sweep_grow(sweep, size) < 0)
+		return -1;
+	if (dragon_sweep_draw(sweep, start, size) < 0)
+		return -1;
+	sweep->size = size;
+
+	if (image != NULL)
+		scale_dragon(0, height, image, width, height, sweep->dragon, sweep->palette);
+	return 0;
+}
+
+/*
+ * Draw only the part of the dragon inside the viewport. The returned
+ * canvas covers the viewport, which is scaled to the image.
+ */
+int dragon_draw_viewport_serial(struct canvas **canvas, struct rgb *image, int width, int height,
+		uint64_t size, int nb_colors, const limits_t *viewport)
+{
+	int ret = 0;
+	struct canvas *dragon = NULL;
+	struct palette *palette = NULL;
+	limits_t limits;
+	limits_t view = *viewport;
+	limits.minimums.x = 0;
+	limits.minimums.y = 0;
+	limits.maximums = limits.minimums;
+
+	if (dragon_limits_serial(&limits, size, 0) < 0)
+		goto err;
+
+	// Restreindre la fenêtre au dragon
+	if (view.minimums.x < 0) view.minimums.x = 0;
+	if (view.minimums.y < 0) view.minimums.y = 0;
+	if (view.maximums.x > limits.maximums.x - limits.minimums.x)
+		view.maximums.x = limits.maximums.x - limits.minimums.x;
+	if (view.maximums.y > limits.maximums.y - limits.minimums.y)
+		view.maximums.y = limits.maximums.y - limits.minimums.y;
+
+	int64_t view_width = view.maximums.x - view.minimums.x;
+	int64_t view_height = view.maximums.y - view.minimums.y;
+	if (view_width <= 0 || view_height <= 0) {
+		printf("error: viewport does not intersect the dragon\n");
+		goto err;
+	}
+	int m;
+
+	dragon = canvas_create(view_width, view_height);
+	if (dragon == NULL) {
+		printf("error: Dragon not allocated\n");
+		goto err;
+	}
+
+	palette = init_palette(nb_colors);
+	if (palette == NULL) {
+		printf("error: Palette not initialized\n");
+		goto err;
+	}
+
+	for (m = 0; m < nb_colors; m++) {
+		uint64_t start = m * size / nb_colors;
+		uint64_t end = (m + 1) * size / nb_colors;
+		int tile;
+
+		for (tile = 0; tile < NB_TILES; tile++)
+			if (dragon_draw_culled(tile, start, end, dragon, limits, view, m) < 0)
+				goto err;
+	}
+
+	scale_dragon(0, height, image, width, height, dragon, palette);
 
 done:
 	free_palette(palette);
@@ -255,7 +982,7 @@ done:
 	return ret;
 
 err:
-	FREE(dragon);
+	CANVAS_FREE(dragon);
 	ret = -1;
 	goto done;
 }
@@ -307,21 +1034,32 @@ int cmp_limits(limits_t *l1, limits_t *l2)
 /*
  * compare each position exp(i,j) with act(i,j)
  * return the number of pixels that doesn't match
+ *
+ * The canvases are compared tile by tile, a blank tile only matches
+ * blank pixels. Their layouts may differ.
  */
-int cmp_canvas(char *exp, char *act, int width, int height, int verbose)
+int64_t cmp_canvas(struct canvas *exp, struct canvas *act, int verbose)
 {
-	int i, j;
-	int sum = 0;
-	int index;
+	int64_t t, k;
+	int64_t sum = 0;
 	if (exp == NULL || act == NULL)
 		return -1;
-	#pragma omp parallel for reduction(+:sum) private(index, j)
-	for (i = 0; i < height; i++) {
-		for (j = 0; j < width; j++) {
-			index = i * width + j;
-			if (exp[index] != act[index]) {
+	if (exp->width != act->width || exp->height != act->height)
+		return -1;
+	#pragma omp parallel for reduction(+:sum) private(k) schedule(dynamic)
+	for (t = 0; t < exp->tiles_x * exp->tiles_y; t++) {
+		const char *e = exp->tiles[t];
+		const char *a = act->tiles[t];
+		if (e == NULL && a == NULL)
+			continue;
+		for (k = 0; k < CANVAS_TILE_AREA; k++) {
+			int64_t j = (t % exp->tiles_x) * CANVAS_TILE_SIZE + (k & CANVAS_TILE_MASK);
+			int64_t i = (t / exp->tiles_x) * CANVAS_TILE_SIZE + (k >> CANVAS_TILE_SHIFT);
+			char ev = e ? e[canvas_layout_offset(exp->layout, j, i)] : CANVAS_BLANK;
+			char av = a ? a[canvas_layout_offset(act->layout, j, i)] : CANVAS_BLANK;
+			if (ev != av) {
 				if (verbose)
-					printf("pix error (%5d, %5d) expected=%2d actual=%2d\n", j, i, exp[index], act[index]);
+					printf("pix error (%5"PRId64", %5"PRId64") expected=%2d actual=%2d\n", j, i, ev, av);
 				sum += 1;
 			}
 		}
@@ -354,7 +1092,54 @@ int dragon_limits_serial(limits_t *lim, uint64_t nbIterations, __attribute__((un
 		 */
 		piece_init(&pieces[i]);
 		pieces[i].orientation = tiles_orientation[i];
-		piece_limit(0, nbIterations, &pieces[i]);
+		piece_jump(0, nbIterations, &pieces[i]);
+
+		merge_limits(lim, &pieces[i].limits);
+	}
+
+	return 0;
+}
+
+/*
+ * Walk every segment, turn by turn, without the walk or piece tables:
+ * the reference against which the check command compares the limits of
+ * every backend.
+ */
+static void piece_walk(int64_t start, int64_t end, piece_t *m)
+{
+	int64_t n;
+	xy_t *position = &m->position;
+	xy_t *orientation = &m->orientation;
+	xy_t *minimums = &m->limits.minimums;
+	xy_t *maximums = &m->limits.maximums;
+	for (n = start + 1; n <= end; n++) {
+		position->x += orientation->x;
+		position->y += orientation->y;
+
+		if (((n & -n) << 1) & n)
+			rotate_left(orientation);
+		else
+			rotate_right(orientation);
+		if (minimums->x > position->x) minimums->x = position->x;
+		if (minimums->y > position->y) minimums->y = position->y;
+		if (maximums->x < position->x) maximums->x = position->x;
+		if (maximums->y < position->y) maximums->y = position->y;
+	}
+}
+
+/*
+ * Reference implementation of the limits, walking every segment.
+ * Only used by the check command.
+ */
+int dragon_limits_walk(limits_t *lim, uint64_t nbIterations, __attribute__((unused)) int nb_thread)
+{
+	int i;
+	piece_t pieces[NB_TILES];
+
+	for (i = 0; i < NB_TILES; i++) {
+		piece_init(&pieces[i]);
+		pieces[i].orientation = tiles_orientation[i];
+		piece_walk(0, nbIterations, &pieces[i]);
 
 		merge_limits(lim, &pieces[i].limits);
 	}
@@ -374,19 +1159,35 @@ struct rgb *make_canvas(int width, int height)
 
 void piece_limit(int64_t start, int64_t end, piece_t *m)
 {
+	const struct walk_table *table = walk_table_get();
+	const struct walk_block *block;
 	int64_t n;
 	xy_t *position = &m->position;
 	xy_t *orientation = &m->orientation;
 	xy_t *minimums = &m->limits.minimums;
 	xy_t *maximums = &m->limits.maximums;
+
 	for (n = start + 1; n <= end; n++) {
+		/* Bloc aligné complet : WALK_BLOCK segments d'un coup. */
+		if (((n - 1) & (WALK_BLOCK - 1)) == 0 && end - (n - 1) >= WALK_BLOCK) {
+			block = &table->blocks[((n - 1) >> WALK_BLOCK_SHIFT) & 1][walk_index(*orientation)];
+			if (minimums->x > position->x + block->min_x) minimums->x = position->x + block->min_x;
+			if (minimums->y > position->y + block->min_y) minimums->y = position->y + block->min_y;
+			if (maximums->x < position->x + block->max_x) maximums->x = position->x + block->max_x;
+			if (maximums->y < position->y + block->max_y) maximums->y = position->y + block->max_y;
+			position->x += block->dx;
+			position->y += block->dy;
+			orientation->x = block->ox;
+			orientation->y = block->oy;
+			n += WALK_BLOCK - 1;
+			walk_turn(n, orientation);
+			continue;
+		}
+
 		position->x += orientation->x;
 		position->y += orientation->y;
 
-		if (((n & -n) << 1) & n)
-			rotate_left(orientation);
-		else
-			rotate_right(orientation);
+		walk_turn(n, orientation);
 		if (minimums->x > position->x) minimums->x = position->x;
 		if (minimums->y > position->y) minimums->y = position->y;
 		if (maximums->x < position->x) maximums->x = position->x;
@@ -394,6 +1195,86 @@ void piece_limit(int64_t start, int64_t end, piece_t *m)
 	}
 }
 
+/*
+ * Build the summaries of aligned blocks, level by level. A block of
+ * level l + 1 and parity p is made of the two blocks of level l
+ * (parity 0, then parity 1) joined by the turn at its middle, which is
+ * a left turn if p is odd.
+ */
+void piece_table_init(struct piece_table *table)
+{
+	int l, p;
+	piece_t *block;
+	limits_t step;
+
+	for (p = 0; p < 2; p++) {
+		block = &table->blocks[0][p];
+		piece_init(block);
+		block->orientation = tiles_orientation[0];
+		block->position = block->orientation;
+		step.minimums = block->position;
+		step.maximums = block->position;
+		merge_limits(&block->limits, &step);
+	}
+
+	for (l = 1; l < PIECE_TABLE_LEVELS; l++) {
+		for (p = 0; p < 2; p++) {
+			block = &table->blocks[l][p];
+			*block = table->blocks[l - 1][0];
+			if (p)
+				rotate_left(&block->orientation);
+			else
+				rotate_right(&block->orientation);
+			piece_merge(block, table->blocks[l - 1][1], tiles_orientation[0]);
+		}
+	}
+}
+
+static struct piece_table piece_table;
+static pthread_once_t piece_table_once = PTHREAD_ONCE_INIT;
+
+static void piece_table_build(void)
+{
+	piece_table_init(&piece_table);
+}
+
+/*
+ * The table is shared by every thread and built on first use.
+ */
+const struct piece_table *piece_table_get(void)
+{
+	pthread_once(&piece_table_once, piece_table_build);
+	return &piece_table;
+}
+
+/*
+ * Same result as piece_limit(), but the range is split into the largest
+ * aligned blocks, which are merged from the piece table. Costs O(log n)
+ * merges instead of one step per segment.
+ */
+void piece_jump(int64_t start, int64_t end, piece_t *m)
+{
+	const struct piece_table *table = piece_table_get();
+	uint64_t n = start;
+	int level;
+
+	while (n < (uint64_t) end) {
+		level = n ? __builtin_ctzll(n) : PIECE_TABLE_LEVELS - 1;
+		if (level > PIECE_TABLE_LEVELS - 1)
+			level = PIECE_TABLE_LEVELS - 1;
+		while ((uint64_t) end - n < (1ULL << level))
+			level--;
+
+		piece_merge(m, table->blocks[level][(n >> level) & 1], tiles_orientation[0]);
+		n += 1ULL << level;
+
+		if (((n & -n) << 1) & n)
+			rotate_left(&m->orientation);
+		else
+			rotate_right(&m->orientation);
+	}
+}
+
 /*
  * merge m2 into m1
  * This operation is associative, but not commutative
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include "color.h"
+#include "canvas.h"
 
 /**
  * TODO:
@@ -48,23 +49,101 @@ typedef struct morceau_ {
 	limits_t	limits;
 } piece_t;
 
+/*
+ * Number of levels in the piece table. A block at level l covers 2^l
+ * segments, the last level is the largest that fits in an int64_t index.
+ */
+#define PIECE_TABLE_LEVELS 63
+
+/*
+ * Summaries of the aligned blocks [k * 2^l, (k + 1) * 2^l[ of the dragon,
+ * drawn from tiles_orientation[0]. Inside such a block, the turns only
+ * depend on the parity of k, except the last one which is left out and
+ * applied by piece_jump().
+ */
+struct piece_table {
+	piece_t blocks[PIECE_TABLE_LEVELS][2];
+};
+
+/*
+ * Number of segments consumed at once by the table-driven walker.
+ */
+#define WALK_BLOCK_SHIFT	4
+#define WALK_BLOCK			(1 << WALK_BLOCK_SHIFT)
+
+/*
+ * Walk of an aligned block of WALK_BLOCK segments from one of the four
+ * orientations. As for the piece table, only the parity of the block
+ * index matters and the last turn is left out. Every offset is relative
+ * to the position at the start of the block.
+ */
+struct walk_block {
+	int8_t pixel_x[WALK_BLOCK];		/* pixel painted by each segment */
+	int8_t pixel_y[WALK_BLOCK];
+	int8_t dx, dy;					/* position at the end */
+	int8_t ox, oy;					/* orientation at the end */
+	int8_t pmin_x, pmin_y;			/* bounding box of the pixels */
+	int8_t pmax_x, pmax_y;
+	int8_t min_x, min_y;			/* bounding box of the positions */
+	int8_t max_x, max_y;
+};
+
+struct walk_table {
+	struct walk_block blocks[2][NB_TILES];
+};
+
+/*
+ * Colour sums of the dragon pixels falling into one image pixel, used
+ * to render the image without allocating the dragon canvas.
+ */
+struct rgb_bin {
+	uint32_t r;
+	uint32_t g;
+	uint32_t b;
+	uint32_t cnt;
+};
+
+/*
+ * Consecutive segments drawn in the same canvas tile with the same
+ * colour. The position and orientation are those before segment n, in
+ * canvas coordinates.
+ */
+struct segment_run {
+	uint64_t n;
+	int64_t x;
+	int64_t y;
+	uint32_t len;
+	int8_t ox;
+	int8_t oy;
+	char id;
+};
+
+struct run_list {
+	struct segment_run *runs;
+	size_t len;
+	size_t cap;
+};
+
 struct draw_data {
 	int id;
-	int *tid;
 	int nb_thread;
-	int dragon_width;
-	int dragon_height;
+	int64_t dragon_width;
+	int64_t dragon_height;
 	int image_width;
 	int image_height;
-	int scale;
-	int deltaI;
-	int deltaJ;
+	int64_t scale;
+	int64_t deltaI;
+	int64_t deltaJ;
 	struct rgb *image;
 	struct palette *palette;
-	char *dragon;
+	struct canvas *dragon;
+	struct rgb_bin *bins;
+	struct run_list *runs;
+	int nb_owners;
 	uint64_t size;
 	limits_t limits;
 	pthread_barrier_t *barrier;
+	int failed;	/* set by a worker whose runs or tiles were not allocated */
 //};
 } __attribute__((aligned(128)));
 
@@ -76,12 +155,153 @@ struct limit_data {
 //};
 } __attribute__((aligned(128)));
 
+/*
+ * State of an incremental power sweep. The dragon of 2^(k+1) segments
+ * starts with the dragon of 2^k segments, so each power only draws the
+ * segments [size, 2 * size[ into the canvas kept from the previous one.
+ * Colours are those of the final size, which makes the last canvas the
+ * same as a direct draw of final_size segments.
+ */
+struct dragon_sweep {
+	struct canvas *dragon;
+	struct palette *palette;
+	piece_t pieces[NB_TILES];
+	limits_t limits;
+	uint64_t size;
+	uint64_t final_size;
+	int nb_colors;
+};
+
+/*
+ * Draw of size segments rendered at width x height and written to path,
+ * or not written if path is NULL. ret is set once the job is done.
+ */
+struct dragon_job {
+	uint64_t size;
+	int width;
+	int height;
+	const char *path;
+	int ret;
+};
+
 extern const xy_t tiles_orientation[NB_TILES];
 
+#ifdef __cplusplus
+#define DRAGON_CONSTEXPR constexpr
+#else
+#define DRAGON_CONSTEXPR
+#endif
+
+/*
+ * Start state of segment i, without walking or recursing. A vector
+ * (x, y) is the Gaussian integer x + y j, so that rotate_right() is a
+ * product by -j:
+ *
+ * - each turn before segment i flips one bit of the Gray code of i, to
+ *   the right when the bit is set, so the orientation has turned right
+ *   popcount(i ^ (i >> 1)) times;
+ * - with k the top bit of i, position(i) = (1 - j)^(k + 1) o + j
+ *   position(2^(k+1) - i) by symmetry, o being the first orientation,
+ *   and the index left has a lower top bit. The position is thus
+ *   jump_factor(i) o, each step handling one bit of i.
+ */
+static inline DRAGON_CONSTEXPR xy_t xy_mul(xy_t a, xy_t b)
+{
+	xy_t c = { a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x };
+	return c;
+}
+
+static inline DRAGON_CONSTEXPR xy_t tile_orientation(uint64_t tile)
+{
+	xy_t o = { (tile & 1) ? -1 : 1, ((tile ^ (tile >> 1)) & 1) ? -1 : 1 };
+	return o;
+}
+
+static inline DRAGON_CONSTEXPR xy_t jump_power(int k)
+{
+	xy_t power = { 1, 0 };
+	const xy_t one_minus_j = { 1, -1 };
+
+	for (; k > 0; k--)
+		power = xy_mul(power, one_minus_j);
+	return power;
+}
+
+/*
+ * Factor of the index left > 0 of top bit top, power being
+ * (1 - j)^(top + 1).
+ */
+static inline DRAGON_CONSTEXPR xy_t jump_descend(uint64_t left, int top, xy_t power)
+{
+	xy_t z = { 0, 0 };
+	xy_t turn = { 1, 0 };			/* j^t after t steps */
+	int b = 0;
+
+	for (b = top; b >= 0; b--) {
+		/* (1 - j)^b, la division par 1 - j est exacte */
+		xy_t lower = { (power.x - power.y) / 2, (power.x + power.y) / 2 };
+		if ((left >> b) == 1) {
+			if (left == 1ULL << b) {
+				xy_t last = xy_mul(turn, lower);
+				z.x += last.x;
+				z.y += last.y;
+				break;
+			}
+			xy_t step = xy_mul(turn, power);
+			z.x += step.x;
+			z.y += step.y;
+			xy_t next = { -turn.y, turn.x };
+			turn = next;
+			left = (2ULL << b) - left;
+		}
+		power = lower;
+	}
+	return z;
+}
+
+static inline DRAGON_CONSTEXPR xy_t jump_factor(int64_t i)
+{
+	xy_t z = { 0, 0 };
+	int top = 0;
+
+	if (i <= 0)
+		return z;
+	top = 63 - __builtin_clzll(i);
+	return jump_descend(i, top, jump_power(top + 1));
+}
+
+static inline DRAGON_CONSTEXPR int jump_turns(int64_t i)
+{
+	return i > 0 ? __builtin_popcountll(i ^ (i >> 1)) & 3 : 0;
+}
+
+static inline DRAGON_CONSTEXPR xy_t compute_position(uint64_t tile, int64_t i)
+{
+	return xy_mul(jump_factor(i), tile_orientation(tile));
+}
+
+static inline DRAGON_CONSTEXPR xy_t compute_orientation(uint64_t tile, int64_t i)
+{
+	xy_t o = tile_orientation(tile);
+	int turns = jump_turns(i);
+
+	for (; turns > 0; turns--) {
+		xy_t next = { o.y, -o.x };
+		o = next;
+	}
+	return o;
+}
+
 int dragon_limits_serial(limits_t *limits, uint64_t nbIterations, int nb_thread);
+int dragon_limits_walk(limits_t *limits, uint64_t nbIterations, int nb_thread);
 void dump_limits(limits_t *limits);
 int cmp_limits(limits_t *l1, limits_t *l2);
 void piece_limit(int64_t debut, int64_t fin, piece_t *m);
+void piece_table_init(struct piece_table *table);
+const struct piece_table *piece_table_get(void);
+void walk_table_init(struct walk_table *table);
+const struct walk_table *walk_table_get(void);
+void piece_jump(int64_t start, int64_t end, piece_t *m);
 void piece_merge(piece_t *m1, piece_t m2, xy_t orientation);
 //void piece_merge(piece_t *m1, piece_t m2);
 void merge_limits(limits_t *m1, const limits_t* m2);
@@ -89,17 +309,40 @@ void piece_init(piece_t *piece);
 void rotate_left(xy_t *xy);
 void rotate_right(xy_t *xy);
 void limits_invert(limits_t *limites);
-xy_t compute_position(uint64_t tile, int64_t i);
-xy_t compute_orientation(uint64_t tile, int64_t i);
-int dragon_draw_serial(char **dragon, struct rgb *image, int width, int height, uint64_t size, __attribute__((unused)) int nb_thread);
-void dump_canvas(char *canvas, int width, int height);
+void compute_states(const int64_t *indexes, size_t count, xy_t (*positions)[NB_TILES],
+		xy_t (*orientations)[NB_TILES]);
+int dragon_draw_serial(struct canvas **dragon, struct rgb *image, int width, int height, uint64_t size, __attribute__((unused)) int nb_thread);
+void dump_canvas(struct canvas *canvas);
 void dump_canvas_rgb(struct rgb *canvas, int width, int height);
 int write_img(struct rgb *image, char *file, int width, int height);
 struct rgb *make_canvas(int width, int height);
-int cmp_canvas(char *exp, char *act, int width, int height, int verbose);
-void init_canvas(int start, int end, char *canvas, char value);
+int64_t cmp_canvas(struct canvas *exp, struct canvas *act, int verbose);
 void scale_dragon(int start, int end, struct rgb *image, int image_width, int image_height,
-        char *dragon, int dragon_width, int dragon_height, struct palette *palette);
-int dragon_draw_raw(uint64_t tile, uint64_t start, uint64_t end, char *dragon, int width, int height, limits_t limits, char id);
+        struct canvas *dragon, struct palette *palette);
+int dragon_draw_raw(uint64_t tile, uint64_t start, uint64_t end, struct canvas *dragon, limits_t limits, char id);
+void scale_init(struct draw_data *data);
+void scale_rows(const struct draw_data *data, int64_t ty, int *start, int *end);
+int segment_color(uint64_t n, uint64_t size, int nb_colors);
+int dragon_bin_raw(uint64_t tile, uint64_t start, uint64_t end, struct rgb_bin *bins,
+		const struct draw_data *data, char id);
+void render_bins(int start, int end, const struct rgb_bin *bins, int nb_bins, const struct draw_data *data);
+int dragon_stream_serial(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
+int tile_owner(int64_t ty, int nb_owners);
+int dragon_bin_runs(uint64_t tile, uint64_t start, uint64_t end, const struct draw_data *data,
+		struct run_list *lists);
+int dragon_bin_runs_at(xy_t position, xy_t orientation, uint64_t start, uint64_t end,
+		const struct draw_data *data, struct run_list *lists);
+int dragon_paint_runs(const struct run_list *list, struct canvas *dragon);
+void run_lists_free(struct run_list *lists, int nb);
+int dragon_draw_culled(uint64_t tile, uint64_t start, uint64_t end, struct canvas *dragon,
+		limits_t limits, limits_t viewport, char id);
+int dragon_draw_viewport_serial(struct canvas **canvas, struct rgb *image, int width, int height,
+		uint64_t size, int nb_colors, const limits_t *viewport);
+int dragon_sweep_init(struct dragon_sweep *sweep, uint64_t final_size, int nb_colors);
+void dragon_sweep_fini(struct dragon_sweep *sweep);
+int dragon_sweep_grow(struct dragon_sweep *sweep, uint64_t size);
+int dragon_sweep_draw(const struct dragon_sweep *sweep, uint64_t start, uint64_t end);
+int dragon_sweep_serial(struct dragon_sweep *sweep, struct rgb *image, int width, int height,
+		uint64_t size, int nb_thread);
 
 #endif /* DRAGON_H_ */
@@ -0,0 +1,301 @@
+/*
+ * dragon_mpi.c
+ *
+ * Rank r draws the segments [r * size / P, (r + 1) * size / P[ of the
+ * four tiles, from compute_position() at the start of its range, and
+ * bins them into runs by tile row like the other backends. The tile
+ * rows are owned by contiguous blocks of ranks: the runs of a tile row
+ * are sent to every rank whose band of the image reads it, in a single
+ * MPI_Alltoallv. Each rank paints what it received, renders its band
+ * and the bands are gathered into the image of every rank.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <mpi.h>
+
+#include "dragon.h"
+#include "color.h"
+#include "trace.h"
+#include "dragon_mpi.h"
+
+static int mpi_rank = 0;
+static int mpi_size = 1;
+static MPI_Datatype run_type = MPI_DATATYPE_NULL;
+
+int dragon_mpi_init(int *argc, char ***argv)
+{
+	if (MPI_Init(argc, argv) != MPI_SUCCESS)
+		return -1;
+	MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+	MPI_Type_contiguous(sizeof(struct segment_run), MPI_BYTE, &run_type);
+	MPI_Type_commit(&run_type);
+
+	/* Seul le rang 0 écrit sur la sortie standard. */
+	if (mpi_rank != 0 && freopen("/dev/null", "w", stdout) == NULL)
+		return -1;
+	return 0;
+}
+
+/*
+ * A failing rank would leave the others blocked in a collective, so the
+ * whole job is aborted.
+ */
+void dragon_mpi_fini(int failed)
+{
+	if (failed && mpi_size > 1)
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	if (run_type != MPI_DATATYPE_NULL)
+		MPI_Type_free(&run_type);
+	MPI_Finalize();
+}
+
+int dragon_mpi_rank(void)
+{
+	return mpi_rank;
+}
+
+int dragon_mpi_size(void)
+{
+	return mpi_size;
+}
+
+int dragon_limits_mpi(limits_t *limits, uint64_t size, __attribute__((unused)) int nb_thread)
+{
+	uint64_t start = mpi_rank * size / mpi_size;
+	uint64_t end = (mpi_rank + 1) * size / mpi_size;
+	uint64_t begin = trace_begin();
+	int64_t local[4], global[4];
+	limits_t part;
+	piece_t piece;
+	int tile;
+
+	for (tile = 0; tile < NB_TILES; tile++) {
+		piece.position = compute_position(tile, start);
+		piece.orientation = compute_orientation(tile, start);
+		piece.limits.minimums = piece.position;
+		piece.limits.maximums = piece.position;
+		piece_jump(start, end, &piece);
+		if (tile == 0)
+			part = piece.limits;
+		else
+			merge_limits(&part, &piece.limits);
+	}
+	trace_end(0, "limits", start, end, begin);
+
+	/* Les minimums sont réduits en maximums de leur opposé. */
+	local[0] = -part.minimums.x;
+	local[1] = -part.minimums.y;
+	local[2] = part.maximums.x;
+	local[3] = part.maximums.y;
+	if (MPI_Allreduce(local, global, 4, MPI_INT64_T, MPI_MAX, MPI_COMM_WORLD) != MPI_SUCCESS)
+		return -1;
+	limits->minimums.x = -global[0];
+	limits->minimums.y = -global[1];
+	limits->maximums.x = global[2];
+	limits->maximums.y = global[3];
+	return 0;
+}
+
+/*
+ * Band of rank r: the image rows [*y0, *y1[ starting in the tile rows it
+ * owns, and the tile rows [*first, *last[ their boxes read, which may
+ * reach into the tile rows of the next rank.
+ */
+static void mpi_band(const struct draw_data *data, int r, int *y0, int *y1,
+		int64_t *first, int64_t *last)
+{
+	int64_t tiles_y = data->dragon->tiles_y;
+	int64_t i0, i1;
+	int next;
+
+	scale_rows(data, r * tiles_y / mpi_size, y0, &next);
+	scale_rows(data, (r + 1) * tiles_y / mpi_size, y1, &next);
+	i0 = *y0 * data->scale - data->deltaI;
+	i1 = *y1 * data->scale - data->deltaI;
+	if (i0 < 0) i0 = 0;
+	if (i1 > data->dragon_height) i1 = data->dragon_height;
+
+	*first = 0;
+	*last = 0;
+	if (*y0 < *y1 && i0 < i1) {
+		*first = i0 >> CANVAS_TILE_SHIFT;
+		*last = ((i1 - 1) >> CANVAS_TILE_SHIFT) + 1;
+	}
+}
+
+/*
+ * Runs of our tile rows sent to each rank, packed by destination. The
+ * counts are in runs and must fit in an int for MPI.
+ */
+static struct segment_run *mpi_pack(const struct draw_data *data, int *counts, int *displs)
+{
+	struct segment_run *buf;
+	int64_t first, last, ty;
+	size_t total = 0, len;
+	int q, y0, y1;
+
+	for (q = 0; q < mpi_size; q++) {
+		mpi_band(data, q, &y0, &y1, &first, &last);
+		len = 0;
+		for (ty = first; ty < last; ty++)
+			len += data->runs[ty].len;
+		if (len > INT_MAX || total + len > INT_MAX) {
+			fprintf(stderr, "rank %d: too many runs to send\n", mpi_rank);
+			return NULL;
+		}
+		counts[q] = len;
+		displs[q] = total;
+		total += len;
+	}
+
+	buf = (struct segment_run *) malloc((total + 1) * sizeof(struct segment_run));
+	if (buf == NULL)
+		return NULL;
+	for (q = 0; q < mpi_size; q++) {
+		struct segment_run *dst = buf + displs[q];
+		mpi_band(data, q, &y0, &y1, &first, &last);
+		for (ty = first; ty < last; ty++) {
+			memcpy(dst, data->runs[ty].runs, data->runs[ty].len * sizeof(struct segment_run));
+			dst += data->runs[ty].len;
+		}
+	}
+	return buf;
+}
+
+/*
+ * The canvas of a rank only holds the tile rows its band reads, so it is
+ * not returned: *canvas is always NULL and only the image is complete.
+ */
+int dragon_draw_mpi(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread)
+{
+	struct draw_data data;
+	struct canvas *dragon = NULL;
+	struct run_list received;
+	struct segment_run *sendbuf = NULL;
+	MPI_Datatype row_type = MPI_DATATYPE_NULL;
+	limits_t limits;
+	uint64_t start = mpi_rank * size / mpi_size;
+	uint64_t end = (mpi_rank + 1) * size / mpi_size;
+	uint64_t begin;
+	int64_t first, last;
+	int *counts = NULL, *send_counts, *send_displs, *recv_counts, *recv_displs;
+	int q, y0, y1, tile, ret = 0;
+
+	memset(&data, 0, sizeof(data));
+	memset(&received, 0, sizeof(received));
+	*canvas = NULL;
+
+	if ((data.palette = init_palette(nb_thread)) == NULL)
+		goto err;
+
+	/* 1. Calculer les limites du dragon */
+	if (dragon_limits_mpi(&limits, size, nb_thread) < 0)
+		goto err;
+	trace_phase(PHASE_LIMITS);
+
+	data.dragon_width = limits.maximums.x - limits.minimums.x;
+	data.dragon_height = limits.maximums.y - limits.minimums.y;
+	if ((dragon = canvas_create(data.dragon_width, data.dragon_height)) == NULL) {
+		fprintf(stderr, "rank %d: malloc error dragon\n", mpi_rank);
+		goto err;
+	}
+
+	data.nb_thread = nb_thread;
+	data.dragon = dragon;
+	data.image = image;
+	data.image_width = width;
+	data.image_height = height;
+	data.size = size;
+	data.limits = limits;
+	data.nb_owners = dragon->tiles_y;
+	scale_init(&data);
+
+	data.runs = (struct run_list *) calloc(data.nb_owners, sizeof(struct run_list));
+	counts = (int *) calloc(4 * mpi_size, sizeof(int));
+	if (data.runs == NULL || counts == NULL) {
+		fprintf(stderr, "rank %d: calloc error runs\n", mpi_rank);
+		goto err;
+	}
+	send_counts = counts;
+	send_displs = counts + mpi_size;
+	recv_counts = counts + 2 * mpi_size;
+	recv_displs = counts + 3 * mpi_size;
+	trace_phase(PHASE_CANVAS);
+
+	/* 2. Classer nos segments par rangée de tuiles */
+	begin = trace_begin();
+	for (tile = 0; tile < NB_TILES; tile++)
+		if (dragon_bin_runs(tile, start, end, &data, data.runs) < 0)
+			goto err;
+	trace_end(0, "bin", start, end, begin);
+
+	/* 3. Envoyer chaque rangée aux rangs dont la bande la lit */
+	begin = trace_begin();
+	if ((sendbuf = mpi_pack(&data, send_counts, send_displs)) == NULL)
+		goto err;
+	run_lists_free(data.runs, data.nb_owners);
+	data.runs = NULL;
+
+	if (MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, MPI_COMM_WORLD) != MPI_SUCCESS)
+		goto err;
+	for (q = 0; q < mpi_size; q++) {
+		if (received.len + recv_counts[q] > INT_MAX)
+			goto err;
+		recv_displs[q] = received.len;
+		received.len += recv_counts[q];
+	}
+	received.runs = (struct segment_run *) malloc((received.len + 1) * sizeof(struct segment_run));
+	if (received.runs == NULL)
+		goto err;
+	if (MPI_Alltoallv(sendbuf, send_counts, send_displs, run_type,
+			received.runs, recv_counts, recv_displs, run_type, MPI_COMM_WORLD) != MPI_SUCCESS)
+		goto err;
+	FREE(sendbuf);
+	trace_end(0, "exchange", 0, received.len, begin);
+
+	/* 4. Dessiner les rangées reçues */
+	begin = trace_begin();
+	if (dragon_paint_runs(&received, dragon) < 0)
+		goto err;
+	trace_end(0, "paint", 0, received.len, begin);
+	trace_phase(PHASE_DRAW);
+
+	/* 5. Effectuer le rendu de notre bande, puis rassembler l'image */
+	begin = trace_begin();
+	mpi_band(&data, mpi_rank, &y0, &y1, &first, &last);
+	if (y0 < y1)
+		scale_dragon(y0, y1, image, width, height, dragon, data.palette);
+	trace_end(0, "render", y0, y1, begin);
+
+	for (q = 0; q < mpi_size; q++) {
+		mpi_band(&data, q, &y0, &y1, &first, &last);
+		recv_counts[q] = y1 - y0;
+		recv_displs[q] = y0;
+	}
+	MPI_Type_contiguous(width * sizeof(struct rgb), MPI_BYTE, &row_type);
+	MPI_Type_commit(&row_type);
+	if (MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, image, recv_counts, recv_displs,
+			row_type, MPI_COMM_WORLD) != MPI_SUCCESS)
+		goto err;
+	trace_phase(PHASE_RENDER);
+
+done:
+	if (row_type != MPI_DATATYPE_NULL)
+		MPI_Type_free(&row_type);
+	run_lists_free(data.runs, data.nb_owners);
+	FREE(received.runs);
+	FREE(sendbuf);
+	FREE(counts);
+	CANVAS_FREE(dragon);
+	free_palette(data.palette);
+	return ret;
+
+err:
+	ret = -1;
+	goto done;
+}
@@ -0,0 +1,21 @@
+/*
+ * dragon_mpi.h
+ *
+ * MPI backend, one process per rank under mpirun. Every rank draws its
+ * share of the segments, and the tile rows of the canvas are exchanged
+ * so that each rank renders its own band of the image.
+ */
+
+#ifndef DRAGON_MPI_H_
+#define DRAGON_MPI_H_
+
+#include "dragon.h"
+
+int dragon_mpi_init(int *argc, char ***argv);
+void dragon_mpi_fini(int failed);
+int dragon_mpi_rank(void);
+int dragon_mpi_size(void);
+int dragon_draw_mpi(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
+int dragon_limits_mpi(limits_t *limits, uint64_t size, int nb_thread);
+
+#endif /* DRAGON_MPI_H_ */
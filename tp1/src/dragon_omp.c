@@ -0,0 +1,216 @@
+/*
+ * dragon_omp.c
+ *
+ * Same two phases as the pthread backend: the segments are binned into
+ * per-thread run lists, then each row of canvas tiles is painted by a
+ * single iteration.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+#include "dragon.h"
+#include "color.h"
+#include "trace.h"
+#include "golden.h"
+#include "dragon_omp.h"
+
+/* Iterations per thread of the parallel loops over segments. */
+#define OMP_CHUNKS_PER_THREAD	8
+
+/*
+ * The pieces of the reduction are walked in absolute coordinates, from
+ * compute_position() at the start of their range. Their limits can then
+ * be merged in any order, as a reduction requires, whereas piece_merge()
+ * is not commutative.
+ */
+#pragma omp declare reduction(merge_limits : piece_t : \
+		merge_limits(&omp_out.limits, &omp_in.limits)) \
+		initializer(omp_priv = omp_orig)
+
+/*
+ * Parse "static", "dynamic" or "guided", followed by an optional
+ * ",chunk", as in OMP_SCHEDULE.
+ */
+int dragon_omp_schedule(const char *spec)
+{
+	static const struct {
+		const char *name;
+		omp_sched_t kind;
+	} kinds[] = {
+		{ "static", omp_sched_static },
+		{ "dynamic", omp_sched_dynamic },
+		{ "guided", omp_sched_guided },
+		{ "auto", omp_sched_auto },
+	};
+	const char *comma = strchr(spec, ',');
+	size_t len = comma ? (size_t) (comma - spec) : strlen(spec);
+	int chunk = comma ? atoi(comma + 1) : 0;
+	size_t i;
+
+	for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+		if (strlen(kinds[i].name) == len && strncmp(kinds[i].name, spec, len) == 0) {
+			omp_set_schedule(kinds[i].kind, chunk);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int dragon_limits_omp(limits_t *lim, uint64_t size, int nb_thread)
+{
+	int64_t k, nb_chunks = (int64_t) nb_thread * OMP_CHUNKS_PER_THREAD;
+	piece_t piece;
+
+	piece_init(&piece);
+
+	#pragma omp parallel for num_threads(nb_thread) schedule(runtime) reduction(merge_limits : piece)
+	for (k = 0; k < nb_chunks * NB_TILES; k++) {
+		int tile = k % NB_TILES;
+		uint64_t start = (k / NB_TILES) * size / nb_chunks;
+		uint64_t end = (k / NB_TILES + 1) * size / nb_chunks;
+		uint64_t begin = trace_begin();
+		piece_t part;
+
+		part.position = compute_position(tile, start);
+		part.orientation = compute_orientation(tile, start);
+		part.limits.minimums = part.position;
+		part.limits.maximums = part.position;
+		piece_jump(start, end, &part);
+		merge_limits(&piece.limits, &part.limits);
+		trace_end(omp_get_thread_num(), "limits", start, end, begin);
+	}
+
+	*lim = piece.limits;
+	return 0;
+}
+
+int dragon_draw_omp(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread)
+{
+	struct draw_data data;
+	struct canvas *dragon = NULL;
+	limits_t limits;
+	int64_t k, row, nb_chunks = (int64_t) nb_thread * OMP_CHUNKS_PER_THREAD;
+	int64_t *starts = NULL;
+	xy_t (*positions)[NB_TILES] = NULL, (*orientations)[NB_TILES] = NULL;
+	int ret = 0, failed = 0;
+
+	memset(&data, 0, sizeof(data));
+	*canvas = NULL;
+
+	if ((data.palette = init_palette(nb_thread)) == NULL)
+		goto err;
+
+	/* 1. Calculer les limites du dragon */
+	if (dragon_limits_omp(&limits, size, nb_thread) < 0)
+		goto err;
+	trace_phase(PHASE_LIMITS);
+
+	data.dragon_width = limits.maximums.x - limits.minimums.x;
+	data.dragon_height = limits.maximums.y - limits.minimums.y;
+	if ((dragon = canvas_create(data.dragon_width, data.dragon_height)) == NULL) {
+		printf("malloc error dragon\n");
+		goto err;
+	}
+
+	data.nb_thread = nb_thread;
+	data.dragon = dragon;
+	data.image = image;
+	data.image_width = width;
+	data.image_height = height;
+	data.size = size;
+	data.limits = limits;
+	data.nb_owners = dragon->tiles_y;
+	scale_init(&data);
+
+	data.runs = (struct run_list *) calloc((size_t) nb_thread * data.nb_owners, sizeof(struct run_list));
+	if (data.runs == NULL) {
+		printf("calloc error runs\n");
+		goto err;
+	}
+
+	/* États de départ de tous les morceaux, en un seul lot. */
+	starts = (int64_t *) malloc(nb_chunks * sizeof(int64_t));
+	positions = malloc(nb_chunks * sizeof(*positions));
+	orientations = malloc(nb_chunks * sizeof(*orientations));
+	if (starts == NULL || positions == NULL || orientations == NULL) {
+		printf("malloc error states\n");
+		goto err;
+	}
+	for (k = 0; k < nb_chunks; k++)
+		starts[k] = k * size / nb_chunks;
+	compute_states(starts, nb_chunks, positions, orientations);
+	trace_phase(PHASE_CANVAS);
+
+	/* 2. Classer les segments par tuile, dans les listes du thread,
+	 * puis dessiner chaque rangée de tuiles. */
+	#pragma omp parallel num_threads(nb_thread)
+	{
+		int id = omp_get_thread_num();
+		struct run_list *lists = data.runs + (int64_t) id * data.nb_owners;
+
+		#pragma omp for schedule(runtime)
+		for (k = 0; k < nb_chunks; k++) {
+			uint64_t start = k * size / nb_chunks;
+			uint64_t end = (k + 1) * size / nb_chunks;
+			uint64_t begin = trace_begin();
+			for (int tile = 0; tile < NB_TILES; tile++)
+				if (dragon_bin_runs_at(positions[k][tile], orientations[k][tile], start, end, &data, lists) < 0) {
+					printf("Thread no: %d, runs not allocated\n", id);
+					#pragma omp atomic write
+					failed = 1;
+				}
+			trace_end(id, "bin", start, end, begin);
+		}
+
+		/* Le premier toucher des tuiles se fait ici : le schedule
+		 * static du dessin et du rendu donne les mêmes rangées au
+		 * même thread. */
+		#pragma omp for schedule(static)
+		for (row = 0; row < data.nb_owners; row++) {
+			uint64_t begin = trace_begin();
+			for (int i = 0; i < nb_thread; i++)
+				if (dragon_paint_runs(&data.runs[(int64_t) i * data.nb_owners + row], dragon) < 0) {
+					#pragma omp atomic write
+					failed = 1;
+				}
+			canvas_hash_row(dragon, row);
+			trace_end(id, "paint", row, row + 1, begin);
+		}
+	}
+	if (failed)
+		goto err;
+	trace_phase(PHASE_DRAW);
+
+	/* 3. Effectuer le rendu final, par rangée de tuiles comme le
+	 * dessin : avec le même schedule static et les mêmes bornes, chaque
+	 * rangée est relue par le thread qui l'a touchée en premier. */
+	#pragma omp parallel for num_threads(nb_thread) schedule(static)
+	for (row = 0; row < data.nb_owners; row++) {
+		uint64_t begin = trace_begin();
+		int start, end;
+
+		scale_rows(&data, row, &start, &end);
+		if (start < end)
+			scale_dragon(start, end, image, width, height, dragon, data.palette);
+		trace_end(omp_get_thread_num(), "render", row, row + 1, begin);
+	}
+	trace_phase(PHASE_RENDER);
+
+done:
+	FREE(starts);
+	FREE(positions);
+	FREE(orientations);
+	run_lists_free(data.runs, nb_thread * data.nb_owners);
+	free_palette(data.palette);
+	*canvas = dragon;
+	return ret;
+
+err:
+	CANVAS_FREE(dragon);
+	ret = -1;
+	goto done;
+}
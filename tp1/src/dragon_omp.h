@@ -0,0 +1,19 @@
+/*
+ * dragon_omp.h
+ *
+ * OpenMP backend. The limits loop and the binning loop of the draw use
+ * schedule(runtime), set by dragon_omp_schedule() or by OMP_SCHEDULE;
+ * the paint and render loops stay schedule(static), so that each row
+ * of tiles is read by the thread that first touched it.
+ */
+
+#ifndef DRAGON_OMP_H_
+#define DRAGON_OMP_H_
+
+#include "dragon.h"
+
+int dragon_omp_schedule(const char *spec);
+int dragon_draw_omp(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
+int dragon_limits_omp(limits_t *lim, uint64_t size, int nb_thread);
+
+#endif /* DRAGON_OMP_H_ */
@@ -16,11 +16,19 @@
 #include "dragon.h"
 #include "color.h"
 #include "dragon_pthread.h"
+#include "worker_pool.h"
+#include "trace.h"
+#include "golden.h"
 
 #define PRINT_PTHREAD_ERROR(err, msg) \
 	do { errno = err; perror(msg); } while(0)
 
-pthread_mutex_t mutex_stdout;
+static pthread_mutex_t mutex_stdout = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Pool kept between calls, see dragon_pthread_init().
+ */
+static struct worker_pool *pool = NULL;
 
 void printf_threadsafe(char *format, ...)
 {
@@ -40,149 +48,407 @@ void printf_threadsafe(char *format, ...)
 void* dragon_draw_worker(void *data)
 {
 	struct draw_data *drawData = (struct draw_data *) data;
-	
-	/* 1. Initialiser la surface */
-	int area = drawData->dragon_width * drawData->dragon_height;
-	
-	int step = area / drawData->nb_thread;
-	int start = drawData->id * step;
-	int end;
-
-	if (drawData->id == (drawData->nb_thread - 1))
-		end = area;
-	else
-		end = step * (drawData->id + 1);
-	
-	init_canvas(start, end, drawData->dragon, -1);
-	
-	pthread_barrier_wait(drawData->barrier);
+	struct run_list *lists = drawData->runs + drawData->id * drawData->nb_owners;
+	uint64_t start, end, begin;
+
+	/* 1. La surface est vide, les tuiles sont allouées au besoin */
 
-	/* 2. Dessiner les dragons dans les 4 directions
+	/* 2. Classer les segments des 4 dragons par tuile de destination
 	 *
-	 * Il est attendu que chaque threads dessine une partie
+	 * Il est attendu que chaque threads traite une partie
 	 * de chaque dragon.
 	 * */
 
 	start = drawData->id * drawData->size / drawData->nb_thread;
 	end = (drawData->id + 1) * drawData->size / drawData->nb_thread;
-	
-	printf_threadsafe("Thread no: %d, interval: (%d - %d), gettid(): %d \n", drawData->id, start, end, gettid());
-	
+
+	begin = trace_begin();
 	for(int i = 0; i < 4; i++){
-		dragon_draw_raw(i, start, end, drawData->dragon, drawData->dragon_width, drawData->dragon_height, drawData->limits, drawData->id);
+		if (dragon_bin_runs(i, start, end, drawData, lists) < 0) {
+			printf_threadsafe("Thread no: %d, runs not allocated\n", drawData->id);
+			drawData->failed = 1;
+		}
 	}
-	
+	trace_end(drawData->id, "bin", start, end, begin);
+
 	pthread_barrier_wait(drawData->barrier);
-	
-	/* 3. Effectuer le rendu final */
-	start = drawData->id * drawData->image_height / drawData->nb_thread;
-	end = (drawData->id + 1) * drawData->image_height / drawData->nb_thread;
-	
-	scale_dragon(start, end, drawData->image, drawData->image_width, drawData->image_height, drawData->dragon, drawData->dragon_width, drawData->dragon_height, drawData->palette);
+
+	/* 3. Dessiner les segments des tuiles possédées par le thread,
+	 * aucune autre thread n'écrit dans ces tuiles. */
+	begin = trace_begin();
+	for (int i = 0; i < drawData->nb_thread; i++)
+		if (dragon_paint_runs(&drawData->runs[i * drawData->nb_owners + drawData->id], drawData->dragon) < 0)
+			drawData->failed = 1;
+	for (int64_t ty = 0; ty < drawData->dragon->tiles_y; ty++)
+		if (tile_owner(ty, drawData->nb_owners) == drawData->id)
+			canvas_hash_row(drawData->dragon, ty);
+	trace_end(drawData->id, "paint", drawData->id, drawData->id + 1, begin);
+
+	return NULL;
+}
+
+/*
+ * Renders a part of the image from the canvas. Run as a job of its own,
+ * so that the render phase is timed apart from the draw. Each thread
+ * renders the image rows of the tile rows it painted, whose pages were
+ * first touched by it.
+ */
+void *dragon_render_worker(void *data)
+{
+	struct draw_data *drawData = (struct draw_data *) data;
+	uint64_t begin;
+	int64_t ty;
+	int start, end;
+
+	/* 4. Effectuer le rendu final */
+	begin = trace_begin();
+	for (ty = 0; ty < drawData->dragon->tiles_y; ty++) {
+		if (tile_owner(ty, drawData->nb_owners) != drawData->id)
+			continue;
+		scale_rows(drawData, ty, &start, &end);
+		if (start < end)
+			scale_dragon(start, end, drawData->image, drawData->image_width, drawData->image_height, drawData->dragon, drawData->palette);
+	}
+	trace_end(drawData->id, "render", drawData->id, drawData->id + 1, begin);
 
 	return NULL;
 }
 
-int dragon_draw_pthread(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread)
+/*
+ * Create the pool used by every following call with nb_thread threads,
+ * so that a --power/--max sweep does not pay for thread creation at each
+ * power.
+ */
+int dragon_pthread_init(int nb_thread)
+{
+	dragon_pthread_fini();
+	pool = worker_pool_create(nb_thread);
+	return pool == NULL ? -1 : 0;
+}
+
+void dragon_pthread_fini(void)
+{
+	worker_pool_destroy(pool);
+	pool = NULL;
+}
+
+/*
+ * Use the long-lived pool if it has the right number of threads,
+ * otherwise a pool for this call only.
+ */
+static struct worker_pool *pool_acquire(int nb_thread)
+{
+	if (pool != NULL && pool->nb_thread == nb_thread)
+		return pool;
+	return worker_pool_create(nb_thread);
+}
+
+static void pool_release(struct worker_pool *p)
+{
+	if (p != pool)
+		worker_pool_destroy(p);
+}
+
+int dragon_draw_pthread(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread)
 {
 	//TODO("dragon_draw_pthread");
 
-	pthread_t *threads = NULL;
-	pthread_barrier_t barrier;
+	struct worker_pool *workers = NULL;
 	limits_t lim;
 	struct draw_data info;
-	char *dragon = NULL;
-	int scale_x;
-	int scale_y;
+	struct canvas *dragon = NULL;
 	struct draw_data *data = NULL;
 	struct palette *palette = NULL;
 	int ret = 0;
 
+	memset(&info, 0, sizeof(info));
 	palette = init_palette(nb_thread);
 	if (palette == NULL)
 		goto err;
 
-	/* 1. Initialiser barrier. */
-	int s = pthread_barrier_init(&barrier, NULL, nb_thread);
-    if (s != 0){
-		printf("draw pthread_barrier_init error : " + s + '\n');
+	/* 1. Obtenir le bassin de threads et sa barrière. */
+	if ((workers = pool_acquire(nb_thread)) == NULL) {
+		printf("draw worker pool error\n");
 		goto err;
 	}
 
 	if (dragon_limits_pthread(&lim, size, nb_thread) < 0)
 		goto err;
+	trace_phase(PHASE_LIMITS);
 
 	info.dragon_width = lim.maximums.x - lim.minimums.x;
 	info.dragon_height = lim.maximums.y - lim.minimums.y;
 
-	if ((dragon = (char *) malloc(info.dragon_width * info.dragon_height)) == NULL) {
+	if ((dragon = canvas_create(info.dragon_width, info.dragon_height)) == NULL) {
 		printf("malloc error dragon\n");
 		goto err;
 	}
 
-	if ((data = malloc(sizeof(struct draw_data) * nb_thread)) == NULL) {
+	if ((data = worker_pool_slots(workers, sizeof(struct draw_data))) == NULL) {
 		printf("malloc error data\n");
 		goto err;
 	}
 
-	if ((threads = malloc(sizeof(pthread_t) * nb_thread)) == NULL) {
-		printf("malloc error threads\n");
-		goto err;
-	}
-
 	info.image_height = height;
 	info.image_width = width;
-	scale_x = info.dragon_width / width + 1;
-	scale_y = info.dragon_height / height + 1;
-	info.scale = (scale_x > scale_y ? scale_x : scale_y);
-	info.deltaJ = (info.scale * width - info.dragon_width) / 2;
-	info.deltaI = (info.scale * height - info.dragon_height) / 2;
+	scale_init(&info);
 	info.nb_thread = nb_thread;
 	info.dragon = dragon;
 	info.image = image;
 	info.size = size;
 	info.limits = lim;
-	info.barrier = &barrier;
+	info.barrier = &workers->barrier;
 	info.palette = palette;
-    
+	info.nb_owners = nb_thread;
+
+	if ((info.runs = calloc(nb_thread * nb_thread, sizeof(struct run_list))) == NULL) {
+		printf("calloc error runs\n");
+		goto err;
+	}
+	trace_phase(PHASE_CANVAS);
+
 	/* 2. Lancement du calcul parallèle principal avec dragon_draw_worker */
 	for (int i = 0; i < nb_thread; i++) {
-		memcpy(&data[i], &info, sizeof(struct draw_data));
-		//data[i] = info;
+		data[i] = info;
 		data[i].id = i;
-		if(pthread_create(&threads[i], NULL, dragon_draw_worker, &data[i]) != 0) {
-			printf("draw pthread_create error\n");
-			goto err;	
-		}
 	}
-	
+
 	/* 3. Attendre la fin du traitement */
-	void *res;
-	for (int i = 0; i < nb_thread; i++) {
-		int retVal = pthread_join(threads[i], &res);
-		if(retVal != 0){
-			printf("draw pthread_join error : " + retVal + '\n');
-			goto err;
-		}
+	if (worker_pool_run(workers, dragon_draw_worker, data, sizeof(struct draw_data)) < 0) {
+		printf("draw worker pool run error\n");
+		goto err;
 	}
-	
-	/* 4. Destruction des variables. */
-	int des = pthread_barrier_destroy(&barrier);
-	if(des != 0){
-		printf("draw pthread_barrier_destroy error : " + des + '\n');
+	/* Une surface incomplète n'est pas rendue */
+	for (int i = 0; i < nb_thread; i++)
+		if (data[i].failed)
+			goto err;
+	trace_phase(PHASE_DRAW);
+
+	if (worker_pool_run(workers, dragon_render_worker, data, sizeof(struct draw_data)) < 0) {
+		printf("render worker pool run error\n");
 		goto err;
 	}
-	
+	trace_phase(PHASE_RENDER);
+
 done:
-	FREE(data);
-	FREE(threads);
+	pool_release(workers);
+	run_lists_free(info.runs, nb_thread * nb_thread);
 	free_palette(palette);
 	*canvas = dragon;
 	//*canvas = NULL; // TODO: retourner le dragon calculé
 	return ret;
 
 err:
-	FREE(dragon);
+	CANVAS_FREE(dragon);
+	ret = -1;
+	goto done;
+}
+
+/**
+ * Accumulates a part of the dragon in the thread's own bins.
+ */
+void *dragon_stream_worker(void *data)
+{
+	struct draw_data *drawData = (struct draw_data *) data;
+	int area = drawData->image_width * drawData->image_height;
+	struct rgb_bin *bins = drawData->bins + drawData->id * area;
+	uint64_t start, end, begin;
+
+	/* 1. Accumuler les dragons dans les 4 directions */
+	start = drawData->id * drawData->size / drawData->nb_thread;
+	end = (drawData->id + 1) * drawData->size / drawData->nb_thread;
+
+	begin = trace_begin();
+	for (int i = 0; i < NB_TILES; i++)
+		dragon_bin_raw(i, start, end, bins, drawData, drawData->id);
+	trace_end(drawData->id, "stream", start, end, begin);
+
+	return NULL;
+}
+
+/**
+ * Renders a part of the image from the bins of every thread.
+ */
+void *dragon_render_bins_worker(void *data)
+{
+	struct draw_data *drawData = (struct draw_data *) data;
+	uint64_t start, end, begin;
+
+	/* 2. Effectuer le rendu final */
+	start = drawData->id * drawData->image_height / drawData->nb_thread;
+	end = (drawData->id + 1) * drawData->image_height / drawData->nb_thread;
+
+	begin = trace_begin();
+	render_bins(start, end, drawData->bins, drawData->nb_thread, drawData);
+	trace_end(drawData->id, "render", start, end, begin);
+
+	return NULL;
+}
+
+/*
+ * Draw the dragon without allocating the canvas, *canvas is set to NULL.
+ * Each thread has its own bins of image size.
+ */
+int dragon_stream_pthread(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread)
+{
+	struct worker_pool *workers = NULL;
+	limits_t lim;
+	struct draw_data info;
+	struct draw_data *data = NULL;
+	int ret = 0;
+	int i;
+
+	memset(&info, 0, sizeof(info));
+	*canvas = NULL;
+
+	if ((workers = pool_acquire(nb_thread)) == NULL) {
+		printf("stream worker pool error\n");
+		return -1;
+	}
+
+	if ((info.palette = init_palette(nb_thread)) == NULL)
+		goto err;
+
+	if (dragon_limits_pthread(&lim, size, nb_thread) < 0)
+		goto err;
+	trace_phase(PHASE_LIMITS);
+
+	info.dragon_width = lim.maximums.x - lim.minimums.x;
+	info.dragon_height = lim.maximums.y - lim.minimums.y;
+	info.image_width = width;
+	info.image_height = height;
+	info.nb_thread = nb_thread;
+	info.image = image;
+	info.size = size;
+	info.limits = lim;
+	info.barrier = &workers->barrier;
+	scale_init(&info);
+
+	if ((info.bins = calloc((size_t) nb_thread * width * height, sizeof(struct rgb_bin))) == NULL) {
+		printf("calloc error bins\n");
+		goto err;
+	}
+
+	if ((data = worker_pool_slots(workers, sizeof(struct draw_data))) == NULL) {
+		printf("malloc error data\n");
+		goto err;
+	}
+
+	for (i = 0; i < nb_thread; i++) {
+		data[i] = info;
+		data[i].id = i;
+	}
+	trace_phase(PHASE_CANVAS);
+
+	if (worker_pool_run(workers, dragon_stream_worker, data, sizeof(struct draw_data)) < 0) {
+		printf("stream worker pool run error\n");
+		goto err;
+	}
+	trace_phase(PHASE_DRAW);
+
+	if (worker_pool_run(workers, dragon_render_bins_worker, data, sizeof(struct draw_data)) < 0) {
+		printf("render worker pool run error\n");
+		goto err;
+	}
+	trace_phase(PHASE_RENDER);
+
+done:
+	pool_release(workers);
+	FREE(info.bins);
+	free_palette(info.palette);
+	return ret;
+
+err:
+	ret = -1;
+	goto done;
+}
+
+struct sweep_data {
+	int id;
+	int nb_thread;
+	struct dragon_sweep *sweep;
+	uint64_t start;
+	uint64_t end;
+	struct rgb *image;
+	int image_width;
+	int image_height;
+	pthread_barrier_t *barrier;
+} __attribute__((aligned(128)));
+
+/*
+ * Draws a part of the new segments of the sweep straight into the
+ * shared canvas, then renders a part of the image.
+ */
+void *dragon_sweep_worker(void *data)
+{
+	struct sweep_data *sweepData = (struct sweep_data *) data;
+	uint64_t len = sweepData->end - sweepData->start;
+	uint64_t start, end, begin;
+
+	start = sweepData->start + sweepData->id * len / sweepData->nb_thread;
+	end = sweepData->start + (sweepData->id + 1) * len / sweepData->nb_thread;
+	begin = trace_begin();
+	dragon_sweep_draw(sweepData->sweep, start, end);
+	trace_end(sweepData->id, "sweep", start, end, begin);
+
+	if (sweepData->image == NULL)
+		return NULL;
+	pthread_barrier_wait(sweepData->barrier);
+
+	start = sweepData->id * sweepData->image_height / sweepData->nb_thread;
+	end = (sweepData->id + 1) * sweepData->image_height / sweepData->nb_thread;
+	begin = trace_begin();
+	scale_dragon(start, end, sweepData->image, sweepData->image_width,
+			sweepData->image_height, sweepData->sweep->dragon, sweepData->sweep->palette);
+	trace_end(sweepData->id, "render", start, end, begin);
+
+	return NULL;
+}
+
+int dragon_sweep_pthread(struct dragon_sweep *sweep, struct rgb *image, int width, int height,
+		uint64_t size, int nb_thread)
+{
+	struct worker_pool *workers = NULL;
+	struct sweep_data *data = NULL;
+	int ret = 0;
+	int i;
+
+	if ((workers = pool_acquire(nb_thread)) == NULL) {
+		printf("sweep worker pool error\n");
+		return -1;
+	}
+
+	if (dragon_sweep_grow(sweep, size) < 0)
+		goto err;
+
+	if ((data = worker_pool_slots(workers, sizeof(struct sweep_data))) == NULL) {
+		printf("malloc error data\n");
+		goto err;
+	}
+
+	for (i = 0; i < nb_thread; i++) {
+		data[i].id = i;
+		data[i].nb_thread = nb_thread;
+		data[i].sweep = sweep;
+		data[i].start = sweep->size;
+		data[i].end = size;
+		data[i].image = image;
+		data[i].image_width = width;
+		data[i].image_height = height;
+		data[i].barrier = &workers->barrier;
+	}
+
+	if (worker_pool_run(workers, dragon_sweep_worker, data, sizeof(struct sweep_data)) < 0) {
+		printf("sweep worker pool run error\n");
+		goto err;
+	}
+	sweep->size = size;
+
+done:
+	pool_release(workers);
+	return ret;
+
+err:
 	ret = -1;
 	goto done;
 }
@@ -191,12 +457,14 @@ void *dragon_limit_worker(void *data)
 {
 	int i;
 	struct limit_data *lim = (struct limit_data *) data;
-	int start = lim->start;
-	int end = lim->end;
+	uint64_t start = lim->start;
+	uint64_t end = lim->end;
+	uint64_t begin = trace_begin();
 
 	for (i = 0; i < NB_TILES; i++) {
-		piece_limit(start, end, &lim->pieces[i]);
+		piece_jump(start, end, &lim->pieces[i]);
 	}
+	trace_end(lim->id, "limits", start, end, begin);
 
 	return NULL;
 }
@@ -211,7 +479,7 @@ int dragon_limits_pthread(limits_t *limits, uint64_t size, int nb_thread)
 
 	int ret = 0;
 	int i;
-	pthread_t *threads = NULL;
+	struct worker_pool *workers = NULL;
 	struct limit_data *thread_data = NULL;
 	piece_t masters[NB_TILES];
 
@@ -224,42 +492,33 @@ int dragon_limits_pthread(limits_t *limits, uint64_t size, int nb_thread)
 		masters[i].orientation = tiles_orientation[i];
 	}
 	
-	/* 1. Allouer de l'espace pour threads et threads_data. */
-	if((threads = malloc(sizeof(pthread_t) * nb_thread)) == NULL) {
-		printf("limits threads malloc error\n");
-		goto err;	
+	/* 1. Obtenir le bassin de threads et l'espace pour threads_data. */
+	if ((workers = pool_acquire(nb_thread)) == NULL) {
+		printf("limits worker pool error\n");
+		goto err;
 	}
-	
-	if((thread_data = malloc(sizeof(struct limit_data) * nb_thread)) == NULL) {
+
+	if ((thread_data = worker_pool_slots(workers, sizeof(struct limit_data))) == NULL) {
 		printf("limits thread_data malloc error\n");
-		goto err;	
+		goto err;
 	}
 
-	/* 2. Lancement du calcul en parallèle avec dragon_limit_worker. */	
+	/* 2. Lancement du calcul en parallèle avec dragon_limit_worker. */
 	for (int i = 0; i < nb_thread; i++) {
 		thread_data[i].id = i;
 		thread_data[i].start = i * size / nb_thread;
 		thread_data[i].end = (i + 1) * size / nb_thread;
-		
+
 		for (int j = 0; j < NB_TILES; j++)
 			thread_data[i].pieces[j] = masters[j];
-			
-		if(pthread_create(&threads[i], NULL, dragon_limit_worker, &thread_data[i]) != 0) {
-			printf("limits pthread_create error\n");
-			goto err;	
-		}
 	}
-	
+
 	/* 3. Attendre la fin du traitement. */
-	void *res;
-	for (int i = 0; i < nb_thread; i++) {
-		int retVal = pthread_join(threads[i], &res);
-		if(retVal != 0){
-			printf("limits pthread_join error : " + retVal + '\n');
-			goto err;
-		}
+	if (worker_pool_run(workers, dragon_limit_worker, thread_data, sizeof(struct limit_data)) < 0) {
+		printf("limits worker pool run error\n");
+		goto err;
 	}
-	
+
 	/* 4. Fusion des pièces.
 	 *
 	 * La fonction piece_merge est disponible afin d'accomplir ceci.
@@ -281,8 +540,7 @@ int dragon_limits_pthread(limits_t *limits, uint64_t size, int nb_thread)
 	merge_limits(&masters[0].limits, &masters[3].limits);
 
 done:
-	FREE(threads);
-	FREE(thread_data);
+	pool_release(workers);
 	*limits = masters[0].limits;
 	return ret;
 err:
@@ -10,7 +10,12 @@
 
 #include "dragon.h"
 
-int dragon_draw_pthread(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
+int dragon_pthread_init(int nb_thread);
+void dragon_pthread_fini(void);
+int dragon_draw_pthread(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
 int dragon_limits_pthread(limits_t *lim, uint64_t size, int nb_thread);
+int dragon_stream_pthread(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
+int dragon_sweep_pthread(struct dragon_sweep *sweep, struct rgb *image, int width, int height,
+		uint64_t size, int nb_thread);
 
 #endif /* DRAGON_PTHREAD_H_ */
@@ -0,0 +1,199 @@
+/*
+ * dragon_stdthread.cpp
+ *
+ * The work is cut in nb_thread * STD_CHUNKS_PER_THREAD chunks handed to
+ * std::for_each(std::execution::par), and every chunk bins its segments
+ * in its own run lists. The policy chooses its own number of threads:
+ * libstdc++ runs it on the TBB pool, which is bounded to nb_thread here.
+ * With another implementation, nb_thread only sets the grain. Without
+ * the parallel algorithms, the chunks are shared by nb_thread
+ * std::thread.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <thread>
+#include <vector>
+#include <string.h>
+#if __has_include(<execution>)
+#include <execution>
+#endif
+#if __has_include(<tbb/global_control.h>)
+#include <tbb/global_control.h>
+#endif
+
+extern "C" {
+#include "dragon.h"
+#include "color.h"
+#include "utils.h"
+#include "trace.h"
+#include "golden.h"
+}
+#include "dragon_stdthread.h"
+
+using namespace std;
+
+#define STD_CHUNKS_PER_THREAD	8
+
+#if defined(__cpp_lib_parallel_algorithm)
+/*
+ * Small number naming the calling thread in the trace, given on first
+ * use since the policy does not tell which worker runs a call. The
+ * workers of the policy live as long as the process, so they keep their
+ * number from one call to the next.
+ */
+static int thread_slot(void)
+{
+	static atomic<int> next(0);
+	thread_local int slot = next++;
+	return slot;
+}
+#endif
+
+/*
+ * Apply func(i, slot) to every index i of [0, n[, slot naming the
+ * calling thread in the trace.
+ */
+template <typename Func>
+static void for_each_index(int64_t n, int nb_thread, Func func)
+{
+#if defined(__cpp_lib_parallel_algorithm)
+	vector<int64_t> indices(n);
+	iota(indices.begin(), indices.end(), 0);
+#if __has_include(<tbb/global_control.h>)
+	tbb::global_control threads(tbb::global_control::max_allowed_parallelism, nb_thread);
+#endif
+	for_each(execution::par, indices.begin(), indices.end(), [&](int64_t i) {
+		func(i, thread_slot());
+	});
+#else
+	/* Les threads sont créés à chaque appel, le numéro t est réutilisé */
+	atomic<int64_t> next(0);
+	vector<thread> threads;
+	for (int t = 0; t < nb_thread; t++) {
+		threads.emplace_back([&, t]() {
+			for (int64_t i = next++; i < n; i = next++)
+				func(i, t);
+		});
+	}
+	for (auto &th : threads)
+		th.join();
+#endif
+}
+
+int dragon_limits_stdthread(limits_t *limits, uint64_t size, int nb_thread)
+{
+	int64_t nb_chunks = (int64_t) nb_thread * STD_CHUNKS_PER_THREAD;
+	vector<limits_t> parts(nb_chunks * NB_TILES);
+
+	/* Chaque morceau part de sa position absolue, les limites se
+	 * fusionnent ensuite dans n'importe quel ordre. */
+	for_each_index(nb_chunks * NB_TILES, nb_thread, [&](int64_t k, int slot) {
+		int tile = k % NB_TILES;
+		uint64_t start = (k / NB_TILES) * size / nb_chunks;
+		uint64_t end = (k / NB_TILES + 1) * size / nb_chunks;
+		uint64_t begin = trace_begin();
+		piece_t part;
+
+		part.position = compute_position(tile, start);
+		part.orientation = compute_orientation(tile, start);
+		part.limits.minimums = part.position;
+		part.limits.maximums = part.position;
+		piece_jump(start, end, &part);
+		parts[k] = part.limits;
+		trace_end(slot, "limits", start, end, begin);
+	});
+
+	*limits = parts[0];
+	for (size_t k = 1; k < parts.size(); k++)
+		merge_limits(limits, &parts[k]);
+	return 0;
+}
+
+int dragon_draw_stdthread(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread)
+{
+	struct draw_data data;
+	struct canvas *dragon = NULL;
+	limits_t limits;
+	int64_t nb_chunks = (int64_t) nb_thread * STD_CHUNKS_PER_THREAD;
+	atomic<int> failed(0);
+
+	memset(&data, 0, sizeof(data));
+	*canvas = NULL;
+
+	if ((data.palette = init_palette(nb_thread)) == NULL)
+		return -1;
+
+	/* 1. Calculer les limites du dragon */
+	dragon_limits_stdthread(&limits, size, nb_thread);
+	trace_phase(PHASE_LIMITS);
+
+	data.dragon_width = limits.maximums.x - limits.minimums.x;
+	data.dragon_height = limits.maximums.y - limits.minimums.y;
+	if ((dragon = canvas_create(data.dragon_width, data.dragon_height)) == NULL) {
+		free_palette(data.palette);
+		return -1;
+	}
+
+	data.nb_thread = nb_thread;
+	data.dragon = dragon;
+	data.image = image;
+	data.image_width = width;
+	data.image_height = height;
+	data.size = size;
+	data.limits = limits;
+	data.nb_owners = dragon->tiles_y;
+	scale_init(&data);
+
+	data.runs = (struct run_list *) calloc((size_t) nb_chunks * data.nb_owners, sizeof(struct run_list));
+	if (data.runs == NULL) {
+		free_palette(data.palette);
+		CANVAS_FREE(dragon);
+		return -1;
+	}
+	trace_phase(PHASE_CANVAS);
+
+	/* 2. Classer les segments par tuile, puis dessiner chaque rangée
+	 * de tuiles */
+	for_each_index(nb_chunks, nb_thread, [&](int64_t k, int slot) {
+		struct run_list *lists = data.runs + k * data.nb_owners;
+		uint64_t start = k * size / nb_chunks;
+		uint64_t end = (k + 1) * size / nb_chunks;
+		uint64_t begin = trace_begin();
+
+		for (int tile = 0; tile < NB_TILES; tile++)
+			if (dragon_bin_runs(tile, start, end, &data, lists) < 0)
+				failed = 1;
+		trace_end(slot, "bin", start, end, begin);
+	});
+
+	for_each_index(data.nb_owners, nb_thread, [&](int64_t row, int slot) {
+		uint64_t begin = trace_begin();
+
+		for (int64_t i = 0; i < nb_chunks; i++)
+			if (dragon_paint_runs(&data.runs[i * data.nb_owners + row], dragon) < 0)
+				failed = 1;
+		canvas_hash_row(dragon, row);
+		trace_end(slot, "paint", row, row + 1, begin);
+	});
+	run_lists_free(data.runs, nb_chunks * data.nb_owners);
+	trace_phase(PHASE_DRAW);
+
+	/* 3. Effectuer le rendu final */
+	for_each_index(height, nb_thread, [&](int64_t y, int slot) {
+		uint64_t begin = trace_begin();
+
+		scale_dragon(y, y + 1, image, width, height, dragon, data.palette);
+		trace_end(slot, "render", y, y + 1, begin);
+	});
+	trace_phase(PHASE_RENDER);
+
+	free_palette(data.palette);
+	if (failed) {
+		CANVAS_FREE(dragon);
+		return -1;
+	}
+	*canvas = dragon;
+	return 0;
+}
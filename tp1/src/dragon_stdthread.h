@@ -0,0 +1,21 @@
+/*
+ * dragon_stdthread.h
+ *
+ * Standard C++17 backend, on the parallel algorithms of the library.
+ */
+
+#ifndef DRAGON_STDTHREAD_H_
+#define DRAGON_STDTHREAD_H_
+
+#include "dragon.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+int dragon_draw_stdthread(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
+int dragon_limits_stdthread(limits_t *limits, uint64_t size, int nb_thread);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DRAGON_STDTHREAD_H_ */
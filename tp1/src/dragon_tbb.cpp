@@ -7,34 +7,24 @@
 
 #include <iostream>
 #include <atomic>
-#include <stdarg.h>
+#include <vector>
 #include <string.h>
 
 extern "C" {
 #include "dragon.h"
 #include "color.h"
 #include "utils.h"
+#include "trace.h"
+#include "golden.h"
 }
 #include "dragon_tbb.h"
 #include "tbb/tbb.h"
-#include "TidMap.h"
 
 using namespace std;
 using namespace tbb;
 
-std::atomic<int> interval;
-
-pthread_mutex_t mutex_stdout;
-void printf_threadsafe(const char *format, ...)
-{
-	va_list list;
-
-	va_start(list, format);
-	pthread_mutex_lock(&mutex_stdout);
-	vprintf(format, list);
-	pthread_mutex_unlock(&mutex_stdout);
-	va_end(list);
-}
+/* Morceaux de segments par thread du classement. */
+#define TBB_CHUNKS_PER_THREAD	8
 
 class DragonLimits {
 	public:
@@ -66,64 +56,173 @@ class DragonLimits {
 		
 		void operator()(const blocked_range<uint64_t> &range)
 		{
+			uint64_t begin = trace_begin();
+
 			for (size_t i = 0; i < NB_TILES; i++)
-				piece_limit(range.begin(), range.end(), &pieces[i]);
+				piece_jump(range.begin(), range.end(), &pieces[i]);
+			trace_end(this_task_arena::current_thread_index(), "limits", range.begin(), range.end(), begin);
 		}
 };
 
+/*
+ * Start states of the chunks of segments of DragonDraw, computed in a
+ * single batch before the loop.
+ */
+struct draw_states {
+	int64_t nb_chunks;
+	xy_t (*positions)[NB_TILES];
+	xy_t (*orientations)[NB_TILES];
+};
+
 class DragonDraw {
 	public:
-		DragonDraw(const DragonDraw &dragon, TidMap* tidMap) 
+		DragonDraw(const DragonDraw &dragon)
 		{
 			this->drawData = dragon.drawData;
-			this->tidMap = tidMap;
+			this->states = dragon.states;
+			this->failed = dragon.failed;
 		}
 		
-		DragonDraw(draw_data *drawData, TidMap* tidMap) 
+		DragonDraw(draw_data *drawData, const draw_states *states, atomic<int> *failed)
 		{ 
 			this->drawData = drawData;
-			this->tidMap = tidMap;
+			this->states = states;
+			this->failed = failed;
 		}
 		
-		void operator()(const blocked_range<uint64_t> &range) const
+		void operator()(const blocked_range<int64_t> &range) const
 		{
-			this->drawData->id = tidMap->getIdFromTid(gettid());
+			uint64_t begin = trace_begin();
+			uint64_t size = drawData->size;
+			int64_t nb_chunks = states->nb_chunks;
+
+			/* Classer les segments par tuile, dans les listes
+			 * propres au thread. */
+			int slot = this_task_arena::current_thread_index();
+			struct run_list *lists = drawData->runs + slot * drawData->nb_owners;
+
+			for (int64_t k = range.begin(); k < range.end(); k++) {
+				uint64_t start = k * size / nb_chunks;
+				uint64_t end = (k + 1) * size / nb_chunks;
+				for (size_t i = 0; i < NB_TILES; i++)
+					if (dragon_bin_runs_at(states->positions[k][i], states->orientations[k][i],
+							start, end, drawData, lists) < 0)
+						*failed = 1;
+			}
+			trace_end(slot, "bin", range.begin() * size / nb_chunks, range.end() * size / nb_chunks, begin);
+		}
+
+  private:
+		draw_data *drawData;
+		const draw_states *states;
+		atomic<int> *failed;
+};
 
-			string msg = "(TBB)Thread no: %d, interval : (%d - %d), gettid() : %d\n";
-			const char *array = msg.c_str();
-			printf_threadsafe(array, interval++, range.begin(), range.end(), gettid());
+/*
+ * Each row of canvas tiles is painted by a single task, from the runs
+ * binned by every thread, so the writes never contend.
+ */
+class DragonPaint {
+	public:
+		DragonPaint(const DragonPaint &dragon)
+		{
+			this->drawData = dragon.drawData;
+			this->slots = dragon.slots;
+			this->failed = dragon.failed;
+		}
 
-			xy_t position;
-			xy_t orientation;
-			uint64_t j;
-			for (size_t i = 0; i < NB_TILES; i++)
-			{
-				position = compute_position(i, range.begin());
-				orientation = compute_orientation(i, range.begin());
-				position.x -= this->drawData->limits.minimums.x;
-				position.y -= this->drawData->limits.minimums.y;
-
-				for (j = range.begin() + 1; j <= range.end(); j++)
-				{
-					int m = (position.x + (position.x + orientation.x)) >> 1;
-					int n = (position.y + (position.y + orientation.y)) >> 1;
-					int index = n * this->drawData->dragon_width + m;
-
-					this->drawData->dragon[index] = j * this->drawData->nb_thread / this->drawData->size;
-
-					position.x += orientation.x;
-					position.y += orientation.y;
-					if (((j & -j) << 1) & j)
-						rotate_left(&orientation);
-					else
-						rotate_right(&orientation);
-				}
+		DragonPaint(draw_data *drawData, int slots, atomic<int> *failed)
+		{
+			this->drawData = drawData;
+			this->slots = slots;
+			this->failed = failed;
+		}
+
+		void operator()(const blocked_range<int64_t> &range) const
+		{
+			uint64_t begin = trace_begin();
+
+			for (int64_t row = range.begin(); row < range.end(); row++) {
+				for (int slot = 0; slot < slots; slot++)
+					if (dragon_paint_runs(&drawData->runs[slot * drawData->nb_owners + row], drawData->dragon) < 0)
+						*failed = 1;
+				canvas_hash_row(drawData->dragon, row);
+			}
+			trace_end(this_task_arena::current_thread_index(), "paint", range.begin(), range.end(), begin);
+		}
+
+  private:
+		draw_data *drawData;
+		int slots;
+		atomic<int> *failed;
+};
+
+class DragonStream {
+	public:
+		DragonStream(const DragonStream &dragon)
+		{
+			this->drawData = dragon.drawData;
+		}
+
+		DragonStream(draw_data *drawData)
+		{
+			this->drawData = drawData;
+		}
+
+		/*
+		 * Each worker accumulates in the bins of its arena slot. The
+		 * range is cut on colour boundaries so that every segment gets
+		 * the same colour as in the serial version.
+		 */
+		void operator()(const blocked_range<uint64_t> &range) const
+		{
+			int area = drawData->image_width * drawData->image_height;
+			int slot = this_task_arena::current_thread_index();
+			struct rgb_bin *bins = drawData->bins + slot * area;
+			uint64_t start = range.begin();
+			uint64_t begin = trace_begin();
+
+			while (start < range.end()) {
+				int m = segment_color(start, drawData->size, drawData->nb_thread);
+				uint64_t end = (m + 1) * drawData->size / drawData->nb_thread;
+				if (end > range.end())
+					end = range.end();
+				for (size_t i = 0; i < NB_TILES; i++)
+					dragon_bin_raw(i, start, end, bins, drawData, m);
+				start = end;
 			}
+			trace_end(slot, "stream", range.begin(), range.end(), begin);
+		}
+
+  private:
+		draw_data *drawData;
+};
+
+class DragonRenderBins {
+	public:
+		DragonRenderBins(const DragonRenderBins &dragon)
+		{
+			this->drawData = dragon.drawData;
+			this->slots = dragon.slots;
+		}
+
+		DragonRenderBins(draw_data *drawData, int slots)
+		{
+			this->drawData = drawData;
+			this->slots = slots;
+		}
+
+		void operator()(const blocked_range<uint64_t> &range) const
+		{
+			uint64_t begin = trace_begin();
+
+			render_bins(range.begin(), range.end(), drawData->bins, slots, drawData);
+			trace_end(this_task_arena::current_thread_index(), "render", range.begin(), range.end(), begin);
 		}
 
   private:
 		draw_data *drawData;
-		TidMap *tidMap;
+		int slots;
 };
 
 class DragonRender {
@@ -140,126 +239,301 @@ class DragonRender {
 
 		void operator()(const blocked_range<uint64_t> &range) const
 		{
+			uint64_t begin = trace_begin();
+
 			scale_dragon(range.begin(), range.end(), this->drawData->image, this->drawData->image_width,this->drawData->image_height,
-				this->drawData->dragon, this->drawData->dragon_width, this->drawData->dragon_height,this->drawData->palette);
+				this->drawData->dragon, this->drawData->palette);
+			trace_end(this_task_arena::current_thread_index(), "render", range.begin(), range.end(), begin);
 		}
 
   private:
 		draw_data *drawData;
 };
 
-class DragonClear {
+/*
+ * Render of the image rows starting in a range of tile rows, see
+ * scale_rows().
+ */
+class DragonRenderRows {
 	public:
-		DragonClear(const DragonClear &dragon)
+		DragonRenderRows(const DragonRenderRows &dragon)
 		{
 			this->drawData = dragon.drawData;
 		}
-		
-		DragonClear(draw_data *drawData)
+
+		DragonRenderRows(draw_data *drawData)
 		{
 			this->drawData = drawData;
 		}
 
-		void operator()(const blocked_range<uint64_t> &range) const
+		void operator()(const blocked_range<int64_t> &range) const
 		{
-			init_canvas(range.begin(), range.end(), this->drawData->dragon, -1);
+			uint64_t begin = trace_begin();
+			int start, end;
+
+			for (int64_t row = range.begin(); row < range.end(); row++) {
+				scale_rows(drawData, row, &start, &end);
+				if (start < end)
+					scale_dragon(start, end, drawData->image, drawData->image_width, drawData->image_height,
+						drawData->dragon, drawData->palette);
+			}
+			trace_end(this_task_arena::current_thread_index(), "render", range.begin(), range.end(), begin);
 		}
 
   private:
 		draw_data *drawData;
 };
 
-int dragon_draw_tbb(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread)
+/*
+ * Canvas and run lists of a draw of size segments within limits. The
+ * palette is set by the caller.
+ */
+static int draw_prepare(struct draw_data *data, limits_t limits, struct rgb *image,
+		int width, int height, uint64_t size, int nb_thread)
+{
+	data->dragon_width = limits.maximums.x - limits.minimums.x;
+	data->dragon_height = limits.maximums.y - limits.minimums.y;
+
+	data->dragon = canvas_create(data->dragon_width, data->dragon_height);
+	if (data->dragon == NULL)
+		return -1;
+
+	data->nb_thread = nb_thread;
+	data->image = image;
+	data->size = size;
+	data->image_height = height;
+	data->image_width = width;
+	data->limits = limits;
+	scale_init(data);
+
+	/* La surface est vide, les tuiles sont allouées au besoin */
+	data->nb_owners = data->dragon->tiles_y;
+	data->runs = (struct run_list *) calloc((size_t) this_task_arena::max_concurrency() * data->nb_owners,
+			sizeof(struct run_list));
+	if (data->runs == NULL) {
+		CANVAS_FREE(data->dragon);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * DragonDraw classe les segments par tuile, puis DragonPaint dessine
+ * chaque rangée de tuiles. The run lists are freed. Returns -1 if some
+ * runs or tiles were not allocated, the canvas being then incomplete.
+ */
+static int draw_paint(struct draw_data *data, affinity_partitioner &affinity)
+{
+	int slots = this_task_arena::max_concurrency();
+	atomic<int> failed(0);
+	draw_states states;
+	vector<int64_t> starts;
+
+	/* États de départ de tous les morceaux, en un seul lot. */
+	states.nb_chunks = (int64_t) slots * TBB_CHUNKS_PER_THREAD;
+	states.positions = (xy_t (*)[NB_TILES]) malloc(states.nb_chunks * sizeof(*states.positions));
+	states.orientations = (xy_t (*)[NB_TILES]) malloc(states.nb_chunks * sizeof(*states.orientations));
+	if (states.positions == NULL || states.orientations == NULL) {
+		failed = 1;
+	} else {
+		starts.resize(states.nb_chunks);
+		for (int64_t k = 0; k < states.nb_chunks; k++)
+			starts[k] = k * data->size / states.nb_chunks;
+		compute_states(starts.data(), states.nb_chunks, states.positions, states.orientations);
+
+		DragonDraw dragon_draw(data, &states, &failed);
+		parallel_for(blocked_range<int64_t>(0, states.nb_chunks), dragon_draw);
+	}
+	FREE(states.positions);
+	FREE(states.orientations);
+
+	if (!failed) {
+		DragonPaint dragon_paint(data, slots, &failed);
+		parallel_for(blocked_range<int64_t>(0, data->nb_owners), dragon_paint, affinity);
+	}
+	run_lists_free(data->runs, slots * data->nb_owners);
+	data->runs = NULL;
+	return failed ? -1 : 0;
+}
+
+/*
+ * Le même affinity_partitioner que draw_paint() rejoue au rendu la
+ * répartition des rangées de tuiles du dessin : chaque rangée est relue
+ * par le thread qui l'a touchée en premier.
+ */
+static void draw_render(struct draw_data *data, affinity_partitioner &affinity)
+{
+	DragonRenderRows dragon_render(data);
+	parallel_for(blocked_range<int64_t>(0, data->nb_owners), dragon_render, affinity);
+}
+
+int dragon_draw_tbb(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread)
 {
 	//TODO("dragon_draw_tbb");
 	struct draw_data data;
 	limits_t limits;
-	char *dragon = NULL;
-	int dragon_width;
-	int dragon_height;
-	int dragon_surface;
-	int scale_x;
-	int scale_y;
-	int scale;
-	int deltaJ;
-	int deltaI;
-	struct palette *palette = init_palette(nb_thread);
-	if (palette == NULL)
+	affinity_partitioner affinity;
+
+	memset(&data, 0, sizeof(data));
+	data.palette = init_palette(nb_thread);
+	if (data.palette == NULL)
 		return -1;
 
 	/* 1. Calculer les limites du dragon */
 	dragon_limits_tbb(&limits, size, nb_thread);
+	trace_phase(PHASE_LIMITS);
 
 	task_scheduler_init init(nb_thread);
-	
-	dragon_width = limits.maximums.x - limits.minimums.x;
-	dragon_height = limits.maximums.y - limits.minimums.y;
-	dragon_surface = dragon_width * dragon_height;
-	scale_x = dragon_width / width + 1;
-	scale_y = dragon_height / height + 1;
-	scale = (scale_x > scale_y ? scale_x : scale_y);
-	deltaJ = (scale * width - dragon_width) / 2;
-	deltaI = (scale * height - dragon_height) / 2;
-
-	dragon = (char *) malloc(dragon_surface);
-	if (dragon == NULL) {
-		free_palette(palette);
+
+	/* 2. Allouer la surface et les listes de segments */
+	if (draw_prepare(&data, limits, image, width, height, size, nb_thread) < 0) {
+		free_palette(data.palette);
+		return -1;
+	}
+	trace_phase(PHASE_CANVAS);
+
+	/* 3. Dessiner le dragon */
+	if (draw_paint(&data, affinity) < 0) {
+		init.terminate();
+		free_palette(data.palette);
+		CANVAS_FREE(data.dragon);
 		return -1;
 	}
+	trace_phase(PHASE_DRAW);
+
+	/* 4. Effectuer le rendu final */
+	draw_render(&data, affinity);
+	trace_phase(PHASE_RENDER);
+	
+	init.terminate();
+	
+	free_palette(data.palette);
+	*canvas = data.dragon;
+	//*canvas = NULL; // TODO: Retourner le dragon calculé
+	return 0;
+}
+
+/*
+ * Draw the dragon without allocating the canvas, *canvas is set to NULL.
+ */
+int dragon_stream_tbb(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread)
+{
+	struct draw_data data;
+	limits_t limits;
+
+	*canvas = NULL;
+	memset(&data, 0, sizeof(data));
+	data.palette = init_palette(nb_thread);
+	if (data.palette == NULL)
+		return -1;
+
+	/* 1. Calculer les limites du dragon */
+	dragon_limits_tbb(&limits, size, nb_thread);
+	trace_phase(PHASE_LIMITS);
+
+	task_scheduler_init init(nb_thread);
 
 	data.nb_thread = nb_thread;
-	data.dragon = dragon;
 	data.image = image;
 	data.size = size;
 	data.image_height = height;
 	data.image_width = width;
-	data.dragon_width = dragon_width;
-	data.dragon_height = dragon_height;
+	data.dragon_width = limits.maximums.x - limits.minimums.x;
+	data.dragon_height = limits.maximums.y - limits.minimums.y;
 	data.limits = limits;
-	data.scale = scale;
-	data.deltaI = deltaI;
-	data.deltaJ = deltaJ;
-	data.palette = palette;
-	data.tid = (int *) calloc(nb_thread, sizeof(int));
-
-	/* 2. Initialiser la surface : DragonClear */
-	DragonClear dragon_clear(&data);
-	parallel_for(blocked_range<uint64_t>(0, dragon_surface), dragon_clear);
-
-	/* 3. Dessiner le dragon : DragonDraw */
-	TidMap* tidMap = new TidMap(nb_thread);
-	interval = 0;
-	DragonDraw dragon_draw(&data, tidMap);
-	parallel_for(blocked_range<uint64_t>(0, data.size), dragon_draw);
+	scale_init(&data);
 
-	/* 4. Effectuer le rendu final */
-	DragonRender dragon_render(&data);
+	int slots = this_task_arena::max_concurrency();
+	data.bins = (struct rgb_bin *) calloc((size_t) slots * width * height, sizeof(struct rgb_bin));
+	if (data.bins == NULL) {
+		free_palette(data.palette);
+		return -1;
+	}
+
+	trace_phase(PHASE_CANVAS);
+
+	/* 2. Accumuler le dragon : DragonStream */
+	DragonStream dragon_stream(&data);
+	parallel_for(blocked_range<uint64_t>(0, data.size), dragon_stream);
+	trace_phase(PHASE_DRAW);
+
+	/* 3. Effectuer le rendu final : DragonRenderBins */
+	DragonRenderBins dragon_render(&data, slots);
 	parallel_for(blocked_range<uint64_t>(0, data.image_height), dragon_render);
-	
+	trace_phase(PHASE_RENDER);
+
 	init.terminate();
-	
-	free_palette(palette);
-	FREE(data.tid);
-	tidMap->dump();
-	FREE(tidMap);
-	*canvas = dragon;
-	//*canvas = NULL; // TODO: Retourner le dragon calculé
+
+	free_palette(data.palette);
+	FREE(data.bins);
 	return 0;
 }
 
+class DragonSweep {
+	public:
+		DragonSweep(const DragonSweep &dragon)
+		{
+			this->sweep = dragon.sweep;
+		}
+
+		DragonSweep(struct dragon_sweep *sweep)
+		{
+			this->sweep = sweep;
+		}
+
+		void operator()(const blocked_range<uint64_t> &range) const
+		{
+			uint64_t begin = trace_begin();
+
+			dragon_sweep_draw(this->sweep, range.begin(), range.end());
+			trace_end(this_task_arena::current_thread_index(), "sweep", range.begin(), range.end(), begin);
+		}
+
+  private:
+		struct dragon_sweep *sweep;
+};
+
 /*
- * Calcule les limites en terme de largeur et de hauteur de
- * la forme du dragon. Requis pour allouer la matrice de dessin.
+ * One step of the incremental sweep, only the new segments are drawn.
  */
-int dragon_limits_tbb(limits_t *limits, uint64_t size, int nb_thread)
+int dragon_sweep_tbb(struct dragon_sweep *sweep, struct rgb *image, int width, int height,
+		uint64_t size, int nb_thread)
 {
-	//TODO("dragon_limits_tbb");
-	DragonLimits lim;
+	struct draw_data data;
+
+	if (dragon_sweep_grow(sweep, size) < 0)
+		return -1;
 
-	/* 1. Calculer les limites */
 	task_scheduler_init init(nb_thread);
+
+	DragonSweep dragon_sweep(sweep);
+	parallel_for(blocked_range<uint64_t>(sweep->size, size), dragon_sweep);
+	sweep->size = size;
+
+	if (image == NULL) {
+		init.terminate();
+		return 0;
+	}
+
+	memset(&data, 0, sizeof(data));
+	data.image = image;
+	data.image_width = width;
+	data.image_height = height;
+	data.dragon = sweep->dragon;
+	data.palette = sweep->palette;
+	DragonRender dragon_render(&data);
+	parallel_for(blocked_range<uint64_t>(0, height), dragon_render);
+
+	init.terminate();
+	return 0;
+}
+
+static void limits_reduce(limits_t *limits, uint64_t size)
+{
+	DragonLimits lim;
+
 	parallel_reduce(blocked_range<uint64_t>(0, size), lim);
-	
+
 	/* La limite globale est calculée à partir des limites
 	 * de chaque dragon.
 	 */
@@ -268,5 +542,126 @@ int dragon_limits_tbb(limits_t *limits, uint64_t size, int nb_thread)
 	merge_limits(&lim.pieces[0].limits, &lim.pieces[3].limits);
 
 	*limits = lim.pieces[0].limits;
+}
+
+/*
+ * Calcule les limites en terme de largeur et de hauteur de
+ * la forme du dragon. Requis pour allouer la matrice de dessin.
+ */
+int dragon_limits_tbb(limits_t *limits, uint64_t size, int nb_thread)
+{
+	//TODO("dragon_limits_tbb");
+
+	/* 1. Calculer les limites */
+	task_scheduler_init init(nb_thread);
+	limits_reduce(limits, size);
 	return 0;
 }
+
+/*
+ * Jobs in the pipeline at once, each holding a canvas and an image.
+ */
+#define PIPELINE_IN_FLIGHT	3
+
+struct pipeline_job {
+	struct dragon_job *job;
+	struct draw_data data;
+	affinity_partitioner affinity;
+	int index;
+};
+
+/*
+ * Draw the jobs through a flow graph of four stages: limits and canvas,
+ * draw, render, write. Each stage takes one job at a time and runs it
+ * in parallel, so a job's limits and draw overlap with the render and
+ * the write of the previous ones. The limiter bounds the memory held by
+ * the jobs in flight.
+ */
+int dragon_pipeline_tbb(struct dragon_job *jobs, int nb_jobs, int nb_thread)
+{
+	pipeline_job *pending = new pipeline_job[nb_jobs];
+	int next = 0, failed = 0;
+
+	task_scheduler_init init(nb_thread);
+	flow::graph g;
+
+	flow::input_node<pipeline_job *> source(g, [&](flow_control &fc) -> pipeline_job * {
+		if (next == nb_jobs) {
+			fc.stop();
+			return NULL;
+		}
+		pending[next].job = &jobs[next];
+		pending[next].index = next;
+		return &pending[next++];
+	});
+
+	flow::limiter_node<pipeline_job *> limiter(g, PIPELINE_IN_FLIGHT);
+
+	/* 1. Limites, surface et image */
+	flow::function_node<pipeline_job *, pipeline_job *> prepare(g, flow::serial, [&](pipeline_job *p) {
+		struct dragon_job *job = p->job;
+		limits_t limits;
+
+		memset(&p->data, 0, sizeof(p->data));
+		job->ret = -1;
+		if ((p->data.palette = init_palette(nb_thread)) == NULL)
+			return p;
+		if ((p->data.image = make_canvas(job->width, job->height)) == NULL)
+			return p;
+
+		uint64_t begin = trace_begin();
+		limits_reduce(&limits, job->size);
+		trace_end(this_task_arena::current_thread_index(), "prepare", p->index, p->index + 1, begin);
+		if (draw_prepare(&p->data, limits, p->data.image, job->width, job->height, job->size, nb_thread) < 0)
+			return p;
+		job->ret = 0;
+		return p;
+	});
+
+	/* 2. Dessiner le dragon */
+	flow::function_node<pipeline_job *, pipeline_job *> draw(g, flow::serial, [](pipeline_job *p) {
+		if (p->job->ret == 0 && draw_paint(&p->data, p->affinity) < 0)
+			p->job->ret = -1;
+		return p;
+	});
+
+	/* 3. Effectuer le rendu, puis libérer la surface */
+	flow::function_node<pipeline_job *, pipeline_job *> render(g, flow::serial, [](pipeline_job *p) {
+		if (p->job->ret == 0)
+			draw_render(&p->data, p->affinity);
+		CANVAS_FREE(p->data.dragon);
+		return p;
+	});
+
+	/* 4. Écrire l'image, sans bloquer les étapes précédentes */
+	flow::function_node<pipeline_job *, flow::continue_msg> write(g, flow::serial, [&](pipeline_job *p) {
+		struct dragon_job *job = p->job;
+		uint64_t begin = trace_begin();
+
+		if (job->ret == 0 && job->path != NULL)
+			job->ret = write_img(p->data.image, (char *) job->path, job->width, job->height);
+		if (job->ret < 0)
+			failed++;
+		trace_end(this_task_arena::current_thread_index(), "write", p->index, p->index + 1, begin);
+
+		if (p->data.runs != NULL)
+			run_lists_free(p->data.runs, this_task_arena::max_concurrency() * p->data.nb_owners);
+		free_palette(p->data.palette);
+		FREE(p->data.image);
+		return flow::continue_msg();
+	});
+
+	flow::make_edge(source, limiter);
+	flow::make_edge(limiter, prepare);
+	flow::make_edge(prepare, draw);
+	flow::make_edge(draw, render);
+	flow::make_edge(render, write);
+	flow::make_edge(write, limiter.decrementer());
+
+	source.activate();
+	g.wait_for_all();
+
+	init.terminate();
+	delete[] pending;
+	return failed > 0 ? -1 : 0;
+}
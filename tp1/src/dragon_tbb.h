@@ -13,8 +13,12 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
-int dragon_draw_tbb(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
+int dragon_draw_tbb(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
 int dragon_limits_tbb(limits_t *limits, uint64_t size, int nb_thread);
+int dragon_stream_tbb(struct canvas **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
+int dragon_sweep_tbb(struct dragon_sweep *sweep, struct rgb *image, int width, int height,
+		uint64_t size, int nb_thread);
+int dragon_pipeline_tbb(struct dragon_job *jobs, int nb_jobs, int nb_thread);
 #ifdef __cplusplus
 }
 #endif
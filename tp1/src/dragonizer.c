@@ -24,6 +24,16 @@
 #include "dragon.h"
 #include "dragon_pthread.h"
 #include "dragon_tbb.h"
+#include "dragon_omp.h"
+#include "dragon_stdthread.h"
+#include "trace.h"
+#include "scale.h"
+#include "worker_pool.h"
+#include "pyramid.h"
+#include "golden.h"
+#ifdef HAVE_MPI
+#include "dragon_mpi.h"
+#endif
 
 /* Globals and defaults */
 #define PROGNAME "dragonizer"
@@ -33,15 +43,24 @@
 #define DEFAULT_NB_THREAD 2
 #define DEFAULT_LIB_NAME "serial"
 #define DEFAULT_IMG_PATH "dragon.ppm"
-#define POWER_MAX 		30
+#define DEFAULT_TILES_PATH "tiles"
+#define DEFAULT_TRACE_PATH "dragon.trace"
+#define POWER_MAX 		35
 #define CHECK_POWER 	20
 #define CHECK_NB_THREAD	8
+#define REGRESS_MAX_TILES	10
+#define DEFAULT_WARMUP	1
+#define DEFAULT_REPEAT	5
+#define BATCH_LINE_MAX	4096
+#define BATCH_KEEP_SLABS	((size_t) 256 << 20)
 static const struct command_def * const commands[];
+static const struct lib_def *lookup_lib(const char *name);
 int verbose = 0;
 
 /*
- * Over POWER_MAX = 30, the types used in array indexes overflows
- * and memory usage is very high, limiting power to 2^29
+ * The canvas uses 64-bit indexes and only allocates the tiles that are
+ * drawn. Over POWER_MAX = 35, the memory usage is still very high,
+ * limiting power to 2^34
  * */
 
 enum thread_lib {
@@ -49,44 +68,93 @@ enum thread_lib {
 	THREAD_LIB_SERIAL,
 	THREAD_LIB_PTHREAD,
 	THREAD_LIB_TBB,
+	THREAD_LIB_OMP,
+	THREAD_LIB_STDTHREAD,
+	THREAD_LIB_MPI,
 };
 
 struct command_opts {
 	const struct command_def *cmd;
 	const struct lib_def *lib;
 	char *pgm_path;
+	char *trace_path;
+	char *jobs_path;
+	char *golden_path;
 	int nb_thread;
 	int height;
 	int width;
 	int power;
 	int power_max;
 	int verbose;
+	int viewport;
+	int stream;
+	int incremental;
+	int pipeline;
+	int update;
+	int warmup;
+	int repeat;
+	limits_t view;
 	uint64_t size;
 };
 
-typedef int (*draw_handler)(char **, struct rgb *, int, int, uint64_t, int);
+typedef int (*draw_handler)(struct canvas **, struct rgb *, int, int, uint64_t, int);
 typedef int (*limits_handler)(limits_t *, uint64_t, int);
+typedef int (*viewport_handler)(struct canvas **, struct rgb *, int, int, uint64_t, int, const limits_t *);
+typedef int (*sweep_handler)(struct dragon_sweep *, struct rgb *, int, int, uint64_t, int);
+typedef int (*init_handler)(int);
+typedef void (*fini_handler)(void);
+typedef int (*pipeline_handler)(struct dragon_job *, int, int);
 
 struct lib_def {
 	const char *name;
 	enum thread_lib lib;
 	draw_handler draw_handler;
 	limits_handler limits_handler;
+	viewport_handler viewport_handler;
+	draw_handler stream_handler;
+	sweep_handler sweep_handler;
+	init_handler init_handler;
+	fini_handler fini_handler;
+	pipeline_handler pipeline_handler;
 };
 
 static const struct lib_def libs[] = {
 		{ .name = "serial",
 				.lib = THREAD_LIB_SERIAL,
 				.draw_handler = dragon_draw_serial,
-				.limits_handler = dragon_limits_serial },
+				.limits_handler = dragon_limits_serial,
+				.viewport_handler = dragon_draw_viewport_serial,
+				.stream_handler = dragon_stream_serial,
+				.sweep_handler = dragon_sweep_serial },
 		{ .name = "pthread",
 				.lib = THREAD_LIB_PTHREAD,
 				.draw_handler = dragon_draw_pthread,
-				.limits_handler = dragon_limits_pthread },
+				.limits_handler = dragon_limits_pthread,
+				.stream_handler = dragon_stream_pthread,
+				.sweep_handler = dragon_sweep_pthread,
+				.init_handler = dragon_pthread_init,
+				.fini_handler = dragon_pthread_fini },
 		{ .name = "tbb",
 				.lib = THREAD_LIB_TBB,
 				.draw_handler = dragon_draw_tbb,
-				.limits_handler = dragon_limits_tbb },
+				.limits_handler = dragon_limits_tbb,
+				.stream_handler = dragon_stream_tbb,
+				.sweep_handler = dragon_sweep_tbb,
+				.pipeline_handler = dragon_pipeline_tbb },
+		{ .name = "omp",
+				.lib = THREAD_LIB_OMP,
+				.draw_handler = dragon_draw_omp,
+				.limits_handler = dragon_limits_omp },
+		{ .name = "stdthread",
+				.lib = THREAD_LIB_STDTHREAD,
+				.draw_handler = dragon_draw_stdthread,
+				.limits_handler = dragon_limits_stdthread },
+#ifdef HAVE_MPI
+		{ .name = "mpi",
+				.lib = THREAD_LIB_MPI,
+				.draw_handler = dragon_draw_mpi,
+				.limits_handler = dragon_limits_mpi },
+#endif
 		{ .name = NULL,
 				.lib = THREAD_LIB_NONE,
 				.draw_handler = NULL,
@@ -98,8 +166,22 @@ typedef int (*cmd_handler)(struct command_opts*);
 struct command_def {
 	const char 			*name;
 	cmd_handler 		handler;
+	int					mpi;	/* runs on every rank under mpirun */
 };
 
+/*
+ * Under mpirun, every rank runs the command but only rank 0 writes the
+ * files.
+ */
+static int is_root(void)
+{
+#ifdef HAVE_MPI
+	return dragon_mpi_rank() == 0;
+#else
+	return 1;
+#endif
+}
+
 __attribute__((noreturn))
 static void usage(void)
 {
@@ -107,51 +189,167 @@ static void usage(void)
 	fprintf(stderr, "Usage: " PROGNAME " [OPTIONS] [COMMAND]\n");
 	fprintf(stderr, "\nOptions:\n");
 	fprintf(stderr, "  --help	this help\n");
-	fprintf(stderr, "  --cmd		command [ draw | limits | check ]\n");
+	fprintf(stderr, "  --cmd		command [ draw | limits | check | bench | batch | tiles | regress ]\n");
 	fprintf(stderr, "  --thread	set number of threads\n");
 	fprintf(stderr, "  --lib		set the threading library to use "\
-			"[ serial | pthread | tbb ]\n");
-	fprintf(stderr, "  --output set image path output\n");
+			"[ serial | pthread | tbb | omp | stdthread | mpi ]\n");
+	fprintf(stderr, "  --jobs	batch file, one \"lib size width height output\" per line\n");
+	fprintf(stderr, "  --golden	table of expected hashes of regress\n");
+	fprintf(stderr, "  --update	regress sets the table from the serial draw\n");
+	fprintf(stderr, "  --pages	canvas memory [ malloc | thp | hugetlb ] (default thp)\n");
+	fprintf(stderr, "  --layout	pixels of a canvas tile [ rows | morton ] (default rows)\n");
+	fprintf(stderr, "  --schedule static|dynamic|guided[,chunk] schedule of the omp limits and bin loops\n");
+	fprintf(stderr, "  --output set image path output, or the directory of tiles\n");
 	fprintf(stderr, "  --height	set dragon height\n");
 	fprintf(stderr, "  --width	set dragon width\n");
 	fprintf(stderr, "  --size	set dragon size\n");
 	fprintf(stderr, "  --power  set dragon size by power\n");
 	fprintf(stderr, "  --max    compute all dragon to max power\n");
+	fprintf(stderr, "  --viewport x0,y0,x1,y1 draw only this part of the dragon\n");
+	fprintf(stderr, "  --stream render the image without allocating the dragon\n");
+	fprintf(stderr, "  --trace[=path] record the ranges of each thread, written at exit\n");
+	fprintf(stderr, "  --warmup	bench runs not measured (default %d)\n", DEFAULT_WARMUP);
+	fprintf(stderr, "  --repeat	bench runs measured (default %d)\n", DEFAULT_REPEAT);
+	fprintf(stderr, "  --incremental with --max, draw only the new half at each power\n");
+	fprintf(stderr, "  --pipeline with --max or batch, overlap the stages of successive draws (tbb)\n");
 	fprintf(stderr, "\n");
 	exit(EXIT_FAILURE);
 }
 
+/*
+ * Draw the powers [power, power_max] of the dragon, each step keeping the
+ * canvas of the previous one. Only the last step is rendered, as it is
+ * the only image written. The canvas of the last step is returned.
+ */
+static int draw_sweep(const struct lib_def *lib, struct command_opts *opts, struct rgb *img,
+		int power, int power_max, struct canvas **canvas)
+{
+	struct dragon_sweep sweep;
+	int ret = 0;
+	int i;
+
+	*canvas = NULL;
+	if (dragon_sweep_init(&sweep, 1LL << power_max, opts->nb_thread) < 0)
+		goto err;
+
+	for (i = power; i <= power_max; i++) {
+		uint64_t size = 1LL << i;
+		if (opts->verbose)
+			printf("draw size=%"PRId64" incremental\n", size);
+		if (lib->sweep_handler(&sweep, i == power_max ? img : NULL,
+				opts->width, opts->height, size, opts->nb_thread) < 0)
+			goto err;
+	}
+
+	*canvas = sweep.dragon;
+	sweep.dragon = NULL;
+done:
+	dragon_sweep_fini(&sweep);
+	return ret;
+err:
+	ret = -1;
+	goto done;
+}
+
+/*
+ * Draw the powers [power, power_max] as jobs of the library pipeline,
+ * the last one being written to opts->pgm_path.
+ */
+static int draw_pipeline(const struct lib_def *lib, struct command_opts *opts,
+		int power, int power_max)
+{
+	struct dragon_job *jobs;
+	int nb_jobs = power_max - power + 1;
+	int i, ret;
+
+	jobs = (struct dragon_job *) calloc(nb_jobs, sizeof(struct dragon_job));
+	if (jobs == NULL)
+		return -1;
+
+	for (i = 0; i < nb_jobs; i++) {
+		jobs[i].size = 1LL << (power + i);
+		jobs[i].width = opts->width;
+		jobs[i].height = opts->height;
+		jobs[i].path = i == nb_jobs - 1 ? opts->pgm_path : NULL;
+	}
+	if (opts->verbose)
+		printf("draw size=%"PRId64"..%"PRId64" pipeline\n", jobs[0].size, jobs[nb_jobs - 1].size);
+	ret = lib->pipeline_handler(jobs, nb_jobs, opts->nb_thread);
+	FREE(jobs);
+	return ret;
+}
+
 static int cmd_draw(struct command_opts *opts)
 {
-	char *dragon = NULL;
+	struct canvas *dragon = NULL;
 	struct rgb *img;
 	int ret = 0;
+	draw_handler handler = opts->lib->draw_handler;
+
+	if (opts->stream)
+		handler = opts->lib->stream_handler;
+	if (handler == NULL) {
+		printf("Error: stream is not supported by lib %s\n", opts->lib->name);
+		return -1;
+	}
 
 	img = make_canvas(opts->width, opts->height);
 	if (img == NULL)
 		goto err;
 
+	if (opts->viewport) {
+		if (opts->lib->viewport_handler == NULL) {
+			printf("Error: viewport is not supported by lib %s\n", opts->lib->name);
+			goto err;
+		}
+		if (opts->verbose)
+			printf("draw size=%"PRId64" viewport\n", opts->size);
+		ret = opts->lib->viewport_handler(&dragon, img, opts->width, opts->height,
+				opts->size, opts->nb_thread, &opts->view);
+		if (ret < 0)
+			goto err;
+		goto write;
+	}
+
 	switch (opts->lib->lib) {
 	case THREAD_LIB_SERIAL:
 	case THREAD_LIB_PTHREAD:
 	case THREAD_LIB_TBB:
-		if (opts->power > 0 && opts->power_max > 0) {
+	case THREAD_LIB_OMP:
+	case THREAD_LIB_STDTHREAD:
+	case THREAD_LIB_MPI:
+		if (opts->power > 0 && opts->power_max > 0 && opts->incremental) {
+			if (opts->lib->sweep_handler == NULL) {
+				printf("Error: incremental is not supported by lib %s\n", opts->lib->name);
+				goto err;
+			}
+			ret = draw_sweep(opts->lib, opts, img, opts->power, opts->power_max, &dragon);
+		} else if (opts->power > 0 && opts->power_max > 0 && opts->pipeline) {
+			if (opts->lib->pipeline_handler == NULL) {
+				printf("Error: pipeline is not supported by lib %s\n", opts->lib->name);
+				goto err;
+			}
+			/* L'image est écrite par la dernière étape du pipeline. */
+			if (draw_pipeline(opts->lib, opts, opts->power, opts->power_max) < 0)
+				goto err;
+			goto done;
+		} else if (opts->power > 0 && opts->power_max > 0) {
 			int i;
 			for (i = opts->power; i <= opts->power_max; i++) {
 				uint64_t size = 1LL << i;
 				if (opts->verbose)
 					printf("draw size=%"PRId64"\n", size);
-				ret = opts->lib->draw_handler(&dragon, img, opts->width, opts->height,
+				ret = handler(&dragon, img, opts->width, opts->height,
 						size, opts->nb_thread);
 				if (i != opts->power_max)
-					FREE(dragon);
+					CANVAS_FREE(dragon);
 				if (ret < 0)
 					break;
 			}
 		} else {
 			if (opts->verbose)
 				printf("draw size=%"PRId64"\n", opts->size);
-			ret = opts->lib->draw_handler(&dragon, img, opts->width, opts->height, opts->size,
+			ret = handler(&dragon, img, opts->width, opts->height, opts->size,
 				opts->nb_thread);
 		}
 		break;
@@ -163,9 +361,11 @@ static int cmd_draw(struct command_opts *opts)
 	if (ret < 0)
 		goto err;
 
-	write_img(img, opts->pgm_path, opts->width, opts->height);
+write:
+	if (is_root())
+		write_img(img, opts->pgm_path, opts->width, opts->height);
 done:
-	FREE(dragon);
+	CANVAS_FREE(dragon);
 	FREE(img);
 	return ret;
 err:
@@ -174,7 +374,7 @@ err:
 }
 
 static const struct command_def cmd_draw_def =
-{ .name = "draw", .handler = cmd_draw };
+{ .name = "draw", .handler = cmd_draw, .mpi = 1 };
 
 static int cmd_limits(struct command_opts *opts)
 {
@@ -186,6 +386,9 @@ static int cmd_limits(struct command_opts *opts)
 	case THREAD_LIB_SERIAL:
 	case THREAD_LIB_PTHREAD:
 	case THREAD_LIB_TBB:
+	case THREAD_LIB_OMP:
+	case THREAD_LIB_STDTHREAD:
+	case THREAD_LIB_MPI:
 		if (opts->power > 0 && opts->power_max > 0) {
 			int i;
 			for (i = opts->power; i <= opts->power_max; i++) {
@@ -219,7 +422,404 @@ err:
 }
 
 static const struct command_def cmd_limit_def =
-{ .name = "limits", .handler = cmd_limits };
+{ .name = "limits", .handler = cmd_limits, .mpi = 1 };
+
+static int cmp_uint64(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *) a;
+	uint64_t vb = *(const uint64_t *) b;
+	return (va > vb) - (va < vb);
+}
+
+/*
+ * Draw opts->size segments with one library and thread count, then write
+ * the image. The time of each phase of the measured runs is stored in
+ * samples[phase * opts->repeat + run], the total being the last phase.
+ */
+static int bench_lib(const struct lib_def *lib, struct command_opts *opts, struct rgb *img,
+		int nb_thread, uint64_t *samples)
+{
+	draw_handler handler = opts->stream ? lib->stream_handler : lib->draw_handler;
+	struct canvas *dragon = NULL;
+	uint64_t total;
+	int run, p;
+
+	if (lib->init_handler != NULL && lib->init_handler(nb_thread) < 0)
+		return -1;
+
+	for (run = -opts->warmup; run < opts->repeat; run++) {
+		trace_phase_reset();
+		if (handler(&dragon, img, opts->width, opts->height, opts->size, nb_thread) < 0)
+			return -1;
+		CANVAS_FREE(dragon);
+		trace_phase(PHASE_CANVAS);
+		write_img(img, opts->pgm_path, opts->width, opts->height);
+		trace_phase(PHASE_WRITE);
+
+		if (run < 0)
+			continue;
+		total = 0;
+		for (p = 0; p < PHASE_COUNT; p++) {
+			samples[p * opts->repeat + run] = trace_phases[p];
+			total += trace_phases[p];
+		}
+		samples[PHASE_COUNT * opts->repeat + run] = total;
+	}
+	return 0;
+}
+
+/*
+ * Time every phase of the draw for each library and each thread count up
+ * to opts->nb_thread, and print min, median and max as CSV, in seconds.
+ */
+static int cmd_bench(struct command_opts *opts)
+{
+	int ret = 0;
+	int i, p, thd, max_thread;
+	struct rgb *img = NULL;
+	uint64_t *samples = NULL;
+
+	if (opts->repeat <= 0) {
+		printf("Error: repeat must be greater than 0\n");
+		return -1;
+	}
+
+	img = make_canvas(opts->width, opts->height);
+	samples = (uint64_t *) malloc((PHASE_COUNT + 1) * opts->repeat * sizeof(uint64_t));
+	if (img == NULL || samples == NULL)
+		goto err;
+
+	printf("lib,thread,size,phase,min,median,max\n");
+	for (i = 0; libs[i].lib != THREAD_LIB_NONE; i++) {
+		if ((opts->stream ? libs[i].stream_handler : libs[i].draw_handler) == NULL)
+			continue;
+		max_thread = libs[i].lib == THREAD_LIB_SERIAL ? 1 : opts->nb_thread;
+		for (thd = 1; thd <= max_thread; thd++) {
+			if (bench_lib(&libs[i], opts, img, thd, samples) < 0) {
+				printf("Error executing bench with %s\n", libs[i].name);
+				goto err;
+			}
+			for (p = 0; p <= PHASE_COUNT; p++) {
+				uint64_t *v = samples + p * opts->repeat;
+				qsort(v, opts->repeat, sizeof(uint64_t), cmp_uint64);
+				printf("%s,%d,%"PRIu64",%s,%.6f,%.6f,%.6f\n", libs[i].name, thd, opts->size,
+						p < PHASE_COUNT ? trace_phase_names[p] : "total",
+						v[0] * 1e-9, v[opts->repeat / 2] * 1e-9, v[opts->repeat - 1] * 1e-9);
+			}
+		}
+	}
+
+	/* Remettre le bassin de threads demandé pour la fin de la commande. */
+	if (opts->lib->init_handler != NULL && opts->lib->init_handler(opts->nb_thread) < 0)
+		goto err;
+
+done:
+	FREE(img);
+	FREE(samples);
+	return ret;
+err:
+	ret = -1;
+	goto done;
+}
+
+static const struct command_def cmd_bench_def =
+{ .name = "bench", .handler = cmd_bench };
+
+struct batch_job {
+	const struct lib_def *lib;
+	uint64_t size;
+	int width;
+	int height;
+	char *path;
+	int ret;
+};
+
+struct batch {
+	struct batch_job *jobs;
+	int nb_jobs;
+	int next;
+	int nb_thread;
+};
+
+static void batch_free(struct batch *batch)
+{
+	int i;
+
+	for (i = 0; i < batch->nb_jobs; i++)
+		FREE(batch->jobs[i].path);
+	FREE(batch->jobs);
+	batch->nb_jobs = 0;
+}
+
+/*
+ * Read the jobs of the file path, one per line as
+ * "lib size width height output". Empty lines and lines starting with #
+ * are skipped.
+ */
+static int batch_read(const char *path, struct batch *batch)
+{
+	FILE *f;
+	char line[BATCH_LINE_MAX];
+	char name[32];
+	char out[BATCH_LINE_MAX];
+	struct batch_job job, *jobs;
+	int cap = 0, lineno = 0;
+	char *p;
+
+	memset(batch, 0, sizeof(struct batch));
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		memset(&job, 0, sizeof(job));
+		if (sscanf(p, "%31s %"SCNu64" %d %d %4095s", name, &job.size,
+				&job.width, &job.height, out) != 5) {
+			printf("%s:%d: expected lib size width height output\n", path, lineno);
+			goto err;
+		}
+		if ((job.lib = lookup_lib(name)) == NULL || job.lib->draw_handler == NULL) {
+			printf("%s:%d: unknown threading lib %s\n", path, lineno, name);
+			goto err;
+		}
+		if (job.size == 0 || job.size > (1LL << POWER_MAX) || job.width <= 0 || job.height <= 0) {
+			printf("%s:%d: size, width or height out of range\n", path, lineno);
+			goto err;
+		}
+
+		if (batch->nb_jobs == cap) {
+			cap = cap ? cap * 2 : 64;
+			jobs = (struct batch_job *) realloc(batch->jobs, cap * sizeof(struct batch_job));
+			if (jobs == NULL)
+				goto err;
+			batch->jobs = jobs;
+		}
+		if ((job.path = strdup(out)) == NULL)
+			goto err;
+		batch->jobs[batch->nb_jobs++] = job;
+	}
+
+	fclose(f);
+	return 0;
+err:
+	fclose(f);
+	batch_free(batch);
+	return -1;
+}
+
+/*
+ * Draw one job into *img, grown if the job needs a larger image, and
+ * write it.
+ */
+static int batch_run(struct batch_job *job, struct rgb **img, int *area, int nb_thread)
+{
+	struct canvas *dragon = NULL;
+	struct rgb *grown;
+	int ret;
+
+	if (job->width * job->height > *area) {
+		grown = (struct rgb *) realloc(*img, sizeof(struct rgb) * job->width * job->height);
+		if (grown == NULL)
+			return -1;
+		*img = grown;
+		*area = job->width * job->height;
+	}
+
+	ret = job->lib->draw_handler(&dragon, *img, job->width, job->height, job->size, nb_thread);
+	CANVAS_FREE(dragon);
+	if (ret == 0)
+		ret = write_img(*img, job->path, job->width, job->height);
+	if (ret < 0)
+		printf("Error: job %s with %s failed\n", job->path, job->lib->name);
+	return ret;
+}
+
+/*
+ * Serial jobs are independent, each worker takes the next one with its
+ * own image. nb_thread is still passed as the number of colours, as
+ * for cmd_draw.
+ */
+static void *batch_worker(void *data)
+{
+	struct batch *batch = (struct batch *) data;
+	struct rgb *img = NULL;
+	int area = 0;
+	int i;
+
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->nb_jobs) {
+		if (batch->jobs[i].lib->lib == THREAD_LIB_SERIAL)
+			batch->jobs[i].ret = batch_run(&batch->jobs[i], &img, &area, batch->nb_thread);
+	}
+	FREE(img);
+	return NULL;
+}
+
+/*
+ * Run the jobs of lib through its pipeline, in the order of the file.
+ */
+static int batch_pipeline(struct batch *batch, const struct lib_def *lib, int nb_thread)
+{
+	struct dragon_job *jobs;
+	int i, n = 0;
+
+	jobs = (struct dragon_job *) calloc(batch->nb_jobs, sizeof(struct dragon_job));
+	if (jobs == NULL)
+		return -1;
+
+	for (i = 0; i < batch->nb_jobs; i++) {
+		if (batch->jobs[i].lib != lib)
+			continue;
+		jobs[n].size = batch->jobs[i].size;
+		jobs[n].width = batch->jobs[i].width;
+		jobs[n].height = batch->jobs[i].height;
+		jobs[n].path = batch->jobs[i].path;
+		n++;
+	}
+
+	if (n > 0)
+		lib->pipeline_handler(jobs, n, nb_thread);
+
+	for (i = 0, n = 0; i < batch->nb_jobs; i++) {
+		if (batch->jobs[i].lib != lib)
+			continue;
+		batch->jobs[i].ret = jobs[n++].ret;
+		if (batch->jobs[i].ret < 0)
+			printf("Error: job %s with %s failed\n", batch->jobs[i].path, lib->name);
+	}
+	FREE(jobs);
+	return 0;
+}
+
+/*
+ * Run the jobs of opts->jobs_path. The serial jobs run concurrently, one
+ * per thread, then the other jobs run one after the other with every
+ * thread. With --pipeline, the jobs of a library having a pipeline go
+ * through it instead. The threads of the libraries, the image and the canvas slabs
+ * are kept from one job to the next.
+ */
+static int cmd_batch(struct command_opts *opts)
+{
+	struct batch batch;
+	struct worker_pool *workers = NULL;
+	const struct lib_def *used[sizeof(libs) / sizeof(libs[0])];
+	struct rgb *img = NULL;
+	int area = 0, nb_used = 0, failed = 0;
+	int i, k, ret = 0;
+	uint64_t start;
+
+	if (opts->jobs_path == NULL) {
+		printf("Error: batch needs --jobs\n");
+		return -1;
+	}
+	if (batch_read(opts->jobs_path, &batch) < 0)
+		return -1;
+	batch.nb_thread = opts->nb_thread;
+
+	start = trace_now();
+	canvas_keep_slabs(BATCH_KEEP_SLABS);
+
+	if ((workers = worker_pool_create(opts->nb_thread)) == NULL)
+		goto err;
+	worker_pool_run(workers, batch_worker, &batch, 0);
+
+	for (i = 0; i < batch.nb_jobs; i++) {
+		struct batch_job *job = &batch.jobs[i];
+
+		if (job->lib->lib == THREAD_LIB_SERIAL)
+			continue;
+		if (opts->pipeline && job->lib->pipeline_handler != NULL)
+			continue;
+
+		/* Les threads d'une librairie sont créés à son premier job. */
+		for (k = 0; k < nb_used && used[k] != job->lib; k++)
+			;
+		if (k == nb_used && job->lib != opts->lib) {
+			if (job->lib->init_handler != NULL && job->lib->init_handler(opts->nb_thread) < 0)
+				goto err;
+			used[nb_used++] = job->lib;
+		}
+		job->ret = batch_run(job, &img, &area, opts->nb_thread);
+	}
+
+	for (i = 0; opts->pipeline && libs[i].lib != THREAD_LIB_NONE; i++)
+		if (libs[i].pipeline_handler != NULL && batch_pipeline(&batch, &libs[i], opts->nb_thread) < 0)
+			goto err;
+
+	for (i = 0; i < batch.nb_jobs; i++)
+		if (batch.jobs[i].ret < 0)
+			failed++;
+	printf("batch %d jobs, %d failed, %.3f s\n", batch.nb_jobs, failed,
+			(trace_now() - start) * 1e-9);
+	if (failed > 0)
+		ret = -1;
+
+done:
+	for (k = 0; k < nb_used; k++)
+		if (used[k]->fini_handler != NULL)
+			used[k]->fini_handler();
+	worker_pool_destroy(workers);
+	canvas_keep_slabs(0);
+	batch_free(&batch);
+	FREE(img);
+	return ret;
+err:
+	ret = -1;
+	goto done;
+}
+
+static const struct command_def cmd_batch_def =
+{ .name = "batch", .handler = cmd_batch };
+
+/*
+ * Draw the dragon with opts->lib, then write its zoom pyramid under the
+ * directory opts->pgm_path, to be browsed as z/x/y.png tiles.
+ */
+static int cmd_tiles(struct command_opts *opts)
+{
+	struct canvas *dragon = NULL;
+	struct palette *palette = NULL;
+	struct pyramid pyramid;
+	struct rgb *img;
+	int ret = 0;
+
+	img = make_canvas(opts->width, opts->height);
+	palette = init_palette(opts->nb_thread);
+	if (img == NULL || palette == NULL)
+		goto err;
+
+	if (opts->verbose)
+		printf("draw size=%"PRId64"\n", opts->size);
+	if (opts->lib->draw_handler(&dragon, img, opts->width, opts->height, opts->size, opts->nb_thread) < 0)
+		goto err;
+	if (dragon == NULL) {
+		printf("Error: lib %s does not keep the canvas\n", opts->lib->name);
+		goto err;
+	}
+
+	/* Le canevas est le niveau le plus fin, les autres en sont réduits. */
+	ret = pyramid_write(&pyramid, dragon, palette, opts->pgm_path, opts->nb_thread);
+	printf("tiles zoom 0..%d, %"PRId64" tiles written to %s\n", pyramid.zoom, pyramid.tiles, opts->pgm_path);
+	if (ret < 0)
+		goto err;
+
+done:
+	CANVAS_FREE(dragon);
+	free_palette(palette);
+	FREE(img);
+	return ret;
+err:
+	ret = -1;
+	goto done;
+}
+
+static const struct command_def cmd_tiles_def =
+{ .name = "tiles", .handler = cmd_tiles };
 
 static int check_limits(struct command_opts *opts)
 {
@@ -228,12 +828,12 @@ static int check_limits(struct command_opts *opts)
 	limits_t lim_expected, lim_actual;
 	memset(&lim_expected, 0, sizeof(limits_t));
 
-	if (dragon_limits_serial(&lim_expected, opts->size, opts->nb_thread) < 0) {
-		printf("Error: limits serial failed\n");
+	if (dragon_limits_walk(&lim_expected, opts->size, opts->nb_thread) < 0) {
+		printf("Error: limits walk failed\n");
 		return -1;
 	}
 
-	for (i = 1; libs[i].lib != THREAD_LIB_NONE; i++) {
+	for (i = 0; libs[i].lib != THREAD_LIB_NONE; i++) {
 		memset(&lim_actual, 0, sizeof(limits_t));
 		const char *name = libs[i].name;
 		ret = libs[i].limits_handler(&lim_actual, opts->size, opts->nb_thread);
@@ -253,17 +853,31 @@ static int check_limits(struct command_opts *opts)
 	return ret;
 }
 
+/*
+ * Number of pixels that differ between two images.
+ */
+static int64_t image_gap(const struct rgb *exp, const struct rgb *act, int area)
+{
+	int64_t gap = 0;
+	int i;
+
+	for (i = 0; i < area; i++)
+		if (memcmp(&exp[i], &act[i], sizeof(struct rgb)) != 0)
+			gap++;
+	return gap;
+}
+
 static int check_draw(struct command_opts *opts)
 {
 	int ret = 0;
 	int errors = 0;
 	int i;
 	limits_t limits;
-	int area;
-	int dragon_width;
-	int dragon_height;
+	int64_t area;
+	int64_t dragon_width;
+	int64_t dragon_height;
 	int threshold;
-	char *drg_exp = NULL, *drg_act = NULL;
+	struct canvas *drg_exp = NULL, *drg_act = NULL;
 	struct rgb *img_exp = NULL, *img_act = NULL;
 	char *f1 = NULL, *f2 = NULL;
 
@@ -280,7 +894,8 @@ static int check_draw(struct command_opts *opts)
 	dragon_width = limits.maximums.x - limits.minimums.x;
 	dragon_height = limits.maximums.y - limits.minimums.y;
 	area = dragon_width * dragon_height;
-	threshold = opts->nb_thread * 2 * 4;
+	/* The draw is deterministic, every pixel must match */
+	threshold = 0;
 
 	img_exp = make_canvas(opts->width, opts->height);
 	img_act = make_canvas(opts->width, opts->height);
@@ -292,7 +907,7 @@ static int check_draw(struct command_opts *opts)
 		goto err;
 	}
 
-	char *fmt = "%s %10s %10s threshold=%d gap=%d (%.3f%%)\n";
+	char *fmt = "%s %10s %10s threshold=%d gap=%"PRId64" (%.3f%%)\n";
 	for (i = 1; libs[i].lib != THREAD_LIB_NONE; i++) {
 		const char *name = libs[i].name;
 		ret = libs[i].draw_handler(&drg_act, img_act, opts->width, opts->height, opts->size, opts->nb_thread);
@@ -300,13 +915,17 @@ static int check_draw(struct command_opts *opts)
 			printf("Error executing draw with %s\n", name);
 			goto err;
 		}
-		int gap = cmp_canvas(drg_exp, drg_act, dragon_width, dragon_height, opts->verbose);
+		/* Sans canevas, comme pour mpi, seule l'image est comparée. */
+		int64_t gap = drg_act != NULL ? cmp_canvas(drg_exp, drg_act, opts->verbose) :
+				image_gap(img_exp, img_act, opts->width * opts->height);
 		float gap_f = gap * 100 / ((float) area);
-		if (gap < threshold && gap >= 0) {
+		if (gap <= threshold && gap >= 0) {
 			printf(fmt, "PASS", "draw", name, threshold, gap, gap_f);
 		} else {
 			errors++;
 			printf(fmt, "FAIL", "draw", name, threshold, gap, gap_f);
+			if (!is_root())
+				goto next;
 			if (asprintf(&f1, "dragon_check_failed_serial.ppm") < 0)
 				goto err;
 			if (asprintf(&f2, "dragon_check_failed_%s.ppm", name) < 0)
@@ -320,14 +939,15 @@ static int check_draw(struct command_opts *opts)
 			FREE(f1);
 			FREE(f2);
 		}
-		FREE(drg_act);
+next:
+		CANVAS_FREE(drg_act);
 	}
 
 done:
 	FREE(img_exp);
 	FREE(img_act);
-	FREE(drg_exp);
-	FREE(drg_act);
+	CANVAS_FREE(drg_exp);
+	CANVAS_FREE(drg_act);
 	FREE(f1);
 	FREE(f2);
 	if (errors != 0)
@@ -338,18 +958,469 @@ err:
 	goto done;
 }
 
+/*
+ * The streaming render must give the same image as the serial draw.
+ */
+static int check_stream(struct command_opts *opts)
+{
+	int ret = 0;
+	int errors = 0;
+	int i;
+	struct canvas *drg_exp = NULL, *drg_act = NULL;
+	struct rgb *img_exp = NULL, *img_act = NULL;
+	int area = opts->width * opts->height;
+
+	img_exp = make_canvas(opts->width, opts->height);
+	img_act = make_canvas(opts->width, opts->height);
+	if (img_exp == NULL || img_act == NULL)
+		goto err;
+
+	if (dragon_draw_serial(&drg_exp, img_exp, opts->width, opts->height, opts->size, opts->nb_thread) < 0) {
+		printf("Error: draw serial failed\n");
+		goto err;
+	}
+
+	for (i = 0; libs[i].lib != THREAD_LIB_NONE; i++) {
+		const char *name = libs[i].name;
+		if (libs[i].stream_handler == NULL)
+			continue;
+		if (libs[i].stream_handler(&drg_act, img_act, opts->width, opts->height, opts->size, opts->nb_thread) < 0) {
+			printf("Error executing stream with %s\n", name);
+			goto err;
+		}
+		if (memcmp(img_exp, img_act, sizeof(struct rgb) * area) == 0) {
+			printf("PASS %10s %10s\n", "stream", name);
+		} else {
+			errors++;
+			printf("FAIL %10s %10s\n", "stream", name);
+		}
+		CANVAS_FREE(drg_act);
+	}
+
+done:
+	FREE(img_exp);
+	FREE(img_act);
+	CANVAS_FREE(drg_exp);
+	CANVAS_FREE(drg_act);
+	if (errors != 0)
+		ret = -1;
+	return ret;
+err:
+	ret = -1;
+	goto done;
+}
+
+/*
+ * A sweep from 2^1 up to the power of opts->size must end with the same
+ * canvas and image as the serial draw of that power.
+ */
+static int check_sweep(struct command_opts *opts)
+{
+	int ret = 0;
+	int errors = 0;
+	int i, power;
+	int64_t gap;
+	struct canvas *drg_exp = NULL, *drg_act = NULL;
+	struct rgb *img_exp = NULL, *img_act = NULL;
+	int area = opts->width * opts->height;
+
+	if (opts->size < 2 || (opts->size & (opts->size - 1)) != 0)
+		return 0;
+	power = __builtin_ctzll(opts->size);
+
+	img_exp = make_canvas(opts->width, opts->height);
+	img_act = make_canvas(opts->width, opts->height);
+	if (img_exp == NULL || img_act == NULL)
+		goto err;
+
+	if (dragon_draw_serial(&drg_exp, img_exp, opts->width, opts->height, opts->size, opts->nb_thread) < 0) {
+		printf("Error: draw serial failed\n");
+		goto err;
+	}
+
+	for (i = 0; libs[i].lib != THREAD_LIB_NONE; i++) {
+		const char *name = libs[i].name;
+		if (libs[i].sweep_handler == NULL)
+			continue;
+		if (draw_sweep(&libs[i], opts, img_act, 1, power, &drg_act) < 0) {
+			printf("Error executing sweep with %s\n", name);
+			goto err;
+		}
+		gap = cmp_canvas(drg_exp, drg_act, 0);
+		if (gap == 0 && memcmp(img_exp, img_act, sizeof(struct rgb) * area) == 0) {
+			printf("PASS %10s %10s\n", "sweep", name);
+		} else {
+			errors++;
+			printf("FAIL %10s %10s gap=%"PRId64"\n", "sweep", name, gap);
+		}
+		CANVAS_FREE(drg_act);
+	}
+
+done:
+	FREE(img_exp);
+	FREE(img_act);
+	CANVAS_FREE(drg_exp);
+	CANVAS_FREE(drg_act);
+	if (errors != 0)
+		ret = -1;
+	return ret;
+err:
+	ret = -1;
+	goto done;
+}
+
+/*
+ * Number of segments walked one by one by check_jump().
+ */
+#define CHECK_JUMP_WALK		(1 << 16)
+#define CHECK_JUMP_BATCH	4096
+
+/*
+ * The closed forms of compute_position() and compute_orientation() must
+ * follow the walk of the first segments, and compute_states() must agree
+ * with them at indexes spread up to 2^62.
+ */
+static int check_jump(struct command_opts *opts)
+{
+	int64_t indexes[CHECK_JUMP_BATCH];
+	xy_t (*positions)[NB_TILES] = NULL, (*orientations)[NB_TILES] = NULL;
+	uint64_t seed = 88172645463325252ULL;
+	int errors = 0;
+	int64_t n;
+	int tile, k;
+
+	for (tile = 0; tile < NB_TILES; tile++) {
+		xy_t position = { 0, 0 };
+		xy_t orientation = tiles_orientation[tile];
+		for (n = 0; n < CHECK_JUMP_WALK; n++) {
+			xy_t p = compute_position(tile, n);
+			xy_t o = compute_orientation(tile, n);
+			if (p.x != position.x || p.y != position.y || o.x != orientation.x || o.y != orientation.y) {
+				errors++;
+				if (opts->verbose)
+					printf("tile %d segment %"PRId64" differs from the walk\n", tile, n);
+			}
+			position.x += orientation.x;
+			position.y += orientation.y;
+			if ((((n + 1) & -(n + 1)) << 1) & (n + 1))
+				rotate_left(&orientation);
+			else
+				rotate_right(&orientation);
+		}
+	}
+
+	positions = malloc(CHECK_JUMP_BATCH * sizeof(*positions));
+	orientations = malloc(CHECK_JUMP_BATCH * sizeof(*orientations));
+	if (positions == NULL || orientations == NULL) {
+		FREE(positions);
+		FREE(orientations);
+		return -1;
+	}
+	for (k = 0; k < CHECK_JUMP_BATCH; k++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		indexes[k] = seed >> (1 + k % 62);
+	}
+	compute_states(indexes, CHECK_JUMP_BATCH, positions, orientations);
+	for (k = 0; k < CHECK_JUMP_BATCH; k++) {
+		for (tile = 0; tile < NB_TILES; tile++) {
+			xy_t p = compute_position(tile, indexes[k]);
+			xy_t o = compute_orientation(tile, indexes[k]);
+			if (p.x != positions[k][tile].x || p.y != positions[k][tile].y ||
+					o.x != orientations[k][tile].x || o.y != orientations[k][tile].y)
+				errors++;
+		}
+	}
+	FREE(positions);
+	FREE(orientations);
+
+	printf("%s %10s %10s\n", errors ? "FAIL" : "PASS", "jump", "states");
+	return errors ? -1 : 0;
+}
+
+/*
+ * Every lib drawing in Morton tiles must give the canvas and the image of
+ * the serial draw in rows, as must a sweep whose canvas grows by shifts
+ * that are not whole tiles.
+ */
+static int check_layout(struct command_opts *opts)
+{
+	int ret = 0;
+	int errors = 0;
+	int i, power;
+	int64_t gap;
+	struct canvas *drg_exp = NULL, *drg_act = NULL;
+	struct rgb *img_exp = NULL, *img_act = NULL;
+	int area = opts->width * opts->height;
+
+	img_exp = make_canvas(opts->width, opts->height);
+	img_act = make_canvas(opts->width, opts->height);
+	if (img_exp == NULL || img_act == NULL)
+		goto err;
+
+	canvas_set_layout(CANVAS_LAYOUT_ROWS);
+	if (dragon_draw_serial(&drg_exp, img_exp, opts->width, opts->height, opts->size, opts->nb_thread) < 0) {
+		printf("Error: draw serial failed\n");
+		goto err;
+	}
+
+	canvas_set_layout(CANVAS_LAYOUT_MORTON);
+	for (i = 0; libs[i].lib != THREAD_LIB_NONE; i++) {
+		const char *name = libs[i].name;
+		if (libs[i].draw_handler(&drg_act, img_act, opts->width, opts->height, opts->size, opts->nb_thread) < 0) {
+			printf("Error executing draw with %s\n", name);
+			goto err;
+		}
+		gap = drg_act != NULL ? cmp_canvas(drg_exp, drg_act, 0) : 0;
+		if (gap == 0 && memcmp(img_exp, img_act, sizeof(struct rgb) * area) == 0) {
+			printf("PASS %10s %10s\n", "morton", name);
+		} else {
+			errors++;
+			printf("FAIL %10s %10s gap=%"PRId64"\n", "morton", name, gap);
+		}
+		CANVAS_FREE(drg_act);
+	}
+
+	if (opts->size >= 2 && (opts->size & (opts->size - 1)) == 0) {
+		power = __builtin_ctzll(opts->size);
+		if (draw_sweep(&libs[0], opts, img_act, 1, power, &drg_act) < 0) {
+			printf("Error executing sweep with %s\n", libs[0].name);
+			goto err;
+		}
+		gap = cmp_canvas(drg_exp, drg_act, 0);
+		if (gap == 0 && memcmp(img_exp, img_act, sizeof(struct rgb) * area) == 0) {
+			printf("PASS %10s %10s\n", "morton", "sweep");
+		} else {
+			errors++;
+			printf("FAIL %10s %10s gap=%"PRId64"\n", "morton", "sweep", gap);
+		}
+	}
+
+done:
+	canvas_set_layout(CANVAS_LAYOUT_ROWS);
+	FREE(img_exp);
+	FREE(img_act);
+	CANVAS_FREE(drg_exp);
+	CANVAS_FREE(drg_act);
+	if (errors != 0)
+		ret = -1;
+	return ret;
+err:
+	ret = -1;
+	goto done;
+}
+
+/*
+ * Every scaling kernel supported by the processor must give the image of
+ * the reference box filter.
+ */
+static int check_scale(struct command_opts *opts)
+{
+	int ret = 0;
+	int errors = 0;
+	int isa;
+	struct canvas *dragon = NULL;
+	struct palette *palette = NULL;
+	struct rgb *img_exp = NULL, *img_act = NULL;
+	int area = opts->width * opts->height;
+
+	img_exp = make_canvas(opts->width, opts->height);
+	img_act = make_canvas(opts->width, opts->height);
+	palette = init_palette(opts->nb_thread);
+	if (img_exp == NULL || img_act == NULL || palette == NULL)
+		goto err;
+
+	if (dragon_draw_serial(&dragon, img_exp, opts->width, opts->height, opts->size, opts->nb_thread) < 0) {
+		printf("Error: draw serial failed\n");
+		goto err;
+	}
+	scale_dragon_ref(0, opts->height, img_exp, opts->width, opts->height, dragon, palette);
+
+	for (isa = 0; isa < SCALE_ISA_COUNT; isa++) {
+		if (!scale_isa_supported(isa))
+			continue;
+		scale_dragon_isa(isa, 0, opts->height, img_act, opts->width, opts->height, dragon, palette);
+		if (memcmp(img_exp, img_act, sizeof(struct rgb) * area) == 0) {
+			printf("PASS %10s %10s\n", "scale", scale_isa_names[isa]);
+		} else {
+			errors++;
+			printf("FAIL %10s %10s\n", "scale", scale_isa_names[isa]);
+		}
+	}
+
+done:
+	FREE(img_exp);
+	FREE(img_act);
+	free_palette(palette);
+	CANVAS_FREE(dragon);
+	if (errors != 0)
+		ret = -1;
+	return ret;
+err:
+	ret = -1;
+	goto done;
+}
+
 static int cmd_check(struct command_opts *opts)
 {
 	int ret = 0;
+	if (check_jump(opts) < 0)
+		ret = -1;
 	if (check_limits(opts) < 0)
 		ret = -1;
 	if (check_draw(opts) < 0)
 		ret = -1;
+	if (check_stream(opts) < 0)
+		ret = -1;
+	if (check_sweep(opts) < 0)
+		ret = -1;
+	if (check_scale(opts) < 0)
+		ret = -1;
+	if (check_layout(opts) < 0)
+		ret = -1;
 	return ret;
 }
 
 static const struct command_def cmd_check_def =
-{ .name = "check", .handler = cmd_check };
+{ .name = "check", .handler = cmd_check, .mpi = 1 };
+
+/*
+ * Compare the draw of one size by every lib to its entry of the table:
+ * the hash of the image, then that of the canvas and, when it differs,
+ * the hash of each tile. The libs that paint by tile row hash the rows
+ * during the draw, the rest is hashed after it.
+ */
+static int regress_size(struct command_opts *opts, struct golden *golden, uint64_t size,
+		struct rgb *img)
+{
+	struct golden_entry *entry;
+	struct canvas_hash hash;
+	struct canvas *dragon = NULL;
+	uint64_t image, begin, draw_ns, hash_ns;
+	int64_t failed;
+	int errors = 0;
+	int i;
+
+	entry = golden_find(golden, size, opts->width, opts->height, opts->nb_thread);
+	if (entry == NULL) {
+		printf("FAIL %10s size=%"PRIu64" %dx%d colors=%d has no entry in %s\n", "regress",
+				size, opts->width, opts->height, opts->nb_thread, opts->golden_path);
+		return -1;
+	}
+
+	for (i = 0; libs[i].lib != THREAD_LIB_NONE; i++) {
+		const char *name = libs[i].name;
+
+		begin = trace_now();
+		if (libs[i].draw_handler(&dragon, img, opts->width, opts->height, size, opts->nb_thread) < 0) {
+			printf("Error executing draw with %s\n", name);
+			return -1;
+		}
+		draw_ns = trace_now() - begin;
+
+		begin = trace_now();
+		image = image_hash(img, opts->width, opts->height);
+		memset(&hash, 0, sizeof(hash));
+		if (dragon != NULL && canvas_hash(dragon, &hash) < 0) {
+			CANVAS_FREE(dragon);
+			return -1;
+		}
+		hash_ns = trace_now() - begin;
+		CANVAS_FREE(dragon);
+
+		failed = 0;
+		if (hash.tiles != NULL && hash.canvas != entry->canvas)
+			failed = golden_cmp_tiles(entry, &hash, REGRESS_MAX_TILES);
+		if (image == entry->image && failed == 0) {
+			printf("PASS %10s %10s size=%"PRIu64" hash=%.1f%% of draw\n", "regress", name, size,
+					draw_ns ? hash_ns * 100.0 / draw_ns : 0.0);
+		} else {
+			errors++;
+			printf("FAIL %10s %10s size=%"PRIu64" image=%s", "regress", name, size,
+					image == entry->image ? "same" : "differs");
+			if (failed < 0)
+				printf(" canvas has %"PRId64"x%"PRId64" tiles, expected %"PRId64"x%"PRId64"\n",
+						hash.tiles_x, hash.tiles_y, entry->tiles_x, entry->tiles_y);
+			else
+				printf(" tiles=%"PRId64"\n", failed);
+		}
+		canvas_hash_free(&hash);
+	}
+	return errors ? -1 : 0;
+}
+
+/*
+ * Compare every lib to the table of --golden, for each power from
+ * --power to --max. The key of an entry is the size, the dimensions of
+ * the image and the number of colours, which is --thread. With --update,
+ * the entries are set from the serial draw instead.
+ */
+static int cmd_regress(struct command_opts *opts)
+{
+	struct golden golden;
+	struct canvas *dragon = NULL;
+	struct canvas_hash hash;
+	struct rgb *img = NULL;
+	uint64_t size, last;
+	int ret = 0;
+
+	if (opts->golden_path == NULL) {
+		printf("Error: regress needs --golden\n");
+		return -1;
+	}
+	if (golden_read(&golden, opts->golden_path) < 0) {
+		printf("Error: cannot read %s\n", opts->golden_path);
+		return -1;
+	}
+
+	img = make_canvas(opts->width, opts->height);
+	if (img == NULL)
+		goto err;
+	/* Les tuiles sont hachées par leur propriétaire, à la fin du dessin */
+	canvas_set_hashes(1);
+
+	size = opts->size;
+	last = opts->power > 0 && opts->power_max > 0 ? 1ULL << opts->power_max : opts->size;
+	for (; size <= last; size <<= 1) {
+		if (!opts->update) {
+			if (regress_size(opts, &golden, size, img) < 0)
+				ret = -1;
+			continue;
+		}
+
+		if (dragon_draw_serial(&dragon, img, opts->width, opts->height, size, opts->nb_thread) < 0 ||
+				canvas_hash(dragon, &hash) < 0)
+			goto err;
+		CANVAS_FREE(dragon);
+		if (golden_set(&golden, size, opts->width, opts->height, opts->nb_thread,
+				image_hash(img, opts->width, opts->height), &hash) < 0) {
+			canvas_hash_free(&hash);
+			goto err;
+		}
+		printf("UPDATE %8s size=%"PRIu64" %dx%d colors=%d\n", "regress",
+				size, opts->width, opts->height, opts->nb_thread);
+		canvas_hash_free(&hash);
+	}
+
+	if (opts->update && is_root() && golden_write(&golden, opts->golden_path) < 0) {
+		printf("Error: cannot write %s\n", opts->golden_path);
+		goto err;
+	}
+
+done:
+	canvas_set_hashes(0);
+	CANVAS_FREE(dragon);
+	FREE(img);
+	golden_free(&golden);
+	return ret;
+err:
+	ret = -1;
+	goto done;
+}
+
+static const struct command_def cmd_regress_def =
+{ .name = "regress", .handler = cmd_regress, .mpi = 1 };
 
 static const struct command_def cmd_def_last =
 { .name = NULL, .handler = NULL };
@@ -358,6 +1429,10 @@ static const struct command_def * const commands[] = {
 		&cmd_draw_def,
 		&cmd_limit_def,
 		&cmd_check_def,
+		&cmd_bench_def,
+		&cmd_batch_def,
+		&cmd_tiles_def,
+		&cmd_regress_def,
 		&cmd_def_last
 };
 
@@ -381,6 +1456,26 @@ static const struct lib_def *lookup_lib(const char *name)
 	return NULL;
 }
 
+static int lookup_pages(const char *name)
+{
+	int i;
+	for (i = 0; i < CANVAS_PAGES_COUNT; i++) {
+		if (strcmp(canvas_pages_names[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int lookup_layout(const char *name)
+{
+	int i;
+	for (i = 0; i < CANVAS_LAYOUT_COUNT; i++) {
+		if (strcmp(canvas_layout_names[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
 static void dump_opts(struct command_opts *opts)
 {
 	printf("%10s %s\n", "option", "value");
@@ -393,6 +1488,19 @@ static void dump_opts(struct command_opts *opts)
 	printf("%10s %" PRId64 "\n", "size", opts->size);
 	printf("%10s %d\n", "power", opts->power);
 	printf("%10s %d\n", "max", opts->power_max);
+	printf("%10s %d\n", "stream", opts->stream);
+	printf("%10s %d\n", "incremental", opts->incremental);
+	printf("%10s %d\n", "pipeline", opts->pipeline);
+	if (opts->trace_path)
+		printf("%10s %s\n", "trace", opts->trace_path);
+	if (opts->jobs_path)
+		printf("%10s %s\n", "jobs", opts->jobs_path);
+	if (opts->golden_path)
+		printf("%10s %s\n", "golden", opts->golden_path);
+	if (opts->viewport)
+		printf("%10s %"PRId64",%"PRId64",%"PRId64",%"PRId64"\n", "viewport",
+				opts->view.minimums.x, opts->view.minimums.y,
+				opts->view.maximums.x, opts->view.maximums.y);
 }
 
 void default_int_value(int *value, int def)
@@ -405,6 +1513,8 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 {
 	int idx;
 	int opt;
+	int pages;
+	int layout;
 	int ret = 0;
 
 	struct option options[] = {
@@ -419,12 +1529,26 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 			{ "power",	 1, 0, 'p' },
 			{ "max",	 1, 0, 'm' },
 			{ "verbose", 0, 0, 'v' },
+			{ "viewport", 1, 0, 'w' },
+			{ "stream",	 0, 0, 'S' },
+			{ "incremental", 0, 0, 'i' },
+			{ "pipeline", 0, 0, 'L' },
+			{ "trace",	 2, 0, 'T' },
+			{ "warmup",	 1, 0, 'W' },
+			{ "repeat",	 1, 0, 'r' },
+			{ "schedule", 1, 0, 'd' },
+			{ "pages",	 1, 0, 'P' },
+			{ "layout",	 1, 0, 'Y' },
+			{ "jobs",	 1, 0, 'j' },
+			{ "golden",	 1, 0, 'G' },
+			{ "update",	 0, 0, 'U' },
 			{ 0, 0, 0, 0}
 	};
 
 	memset(opts, 0, sizeof(struct command_opts));
+	opts->warmup = -1;
 
-	while ((opt = getopt_long(argc, argv, "hvx:y:s:c:t:l:p:o:m:", options, &idx)) != -1) {
+	while ((opt = getopt_long(argc, argv, "hviLSUT::W:r:d:P:Y:j:G:x:y:s:c:t:l:p:o:m:w:", options, &idx)) != -1) {
 		switch(opt) {
 		case 'c':
 			opts->cmd = lookup_cmd(optarg);
@@ -450,7 +1574,7 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 			opts->width = atoi(optarg);
 			break;
 		case 's':
-			opts->size = atoi(optarg);
+			opts->size = strtoull(optarg, NULL, 10);
 			break;
 		case 'p':
 			opts->power = atoi(optarg);
@@ -464,6 +1588,68 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 		case 'v':
 			opts->verbose = 1;
 			break;
+		case 'S':
+			opts->stream = 1;
+			break;
+		case 'i':
+			opts->incremental = 1;
+			break;
+		case 'L':
+			opts->pipeline = 1;
+			break;
+		case 'W':
+			opts->warmup = atoi(optarg);
+			break;
+		case 'r':
+			opts->repeat = atoi(optarg);
+			break;
+		case 'd':
+			if (dragon_omp_schedule(optarg) < 0) {
+				printf("unknown schedule %s\n", optarg);
+				ret = -1;
+			}
+			break;
+		case 'j':
+			opts->jobs_path = optarg;
+			break;
+		case 'G':
+			opts->golden_path = optarg;
+			break;
+		case 'U':
+			opts->update = 1;
+			break;
+		case 'P':
+			pages = lookup_pages(optarg);
+			if (pages < 0) {
+				printf("unknown pages %s\n", optarg);
+				ret = -1;
+			} else {
+				canvas_set_pages(pages);
+			}
+			break;
+		case 'Y':
+			layout = lookup_layout(optarg);
+			if (layout < 0) {
+				printf("unknown layout %s\n", optarg);
+				ret = -1;
+			} else {
+				canvas_set_layout(layout);
+			}
+			break;
+		case 'T':
+			opts->trace_path = optarg != NULL ? optarg : DEFAULT_TRACE_PATH;
+			break;
+		case 'w':
+			if (sscanf(optarg, "%"SCNd64",%"SCNd64",%"SCNd64",%"SCNd64,
+					&opts->view.minimums.x, &opts->view.minimums.y,
+					&opts->view.maximums.x, &opts->view.maximums.y) != 4 ||
+					opts->view.minimums.x >= opts->view.maximums.x ||
+					opts->view.minimums.y >= opts->view.maximums.y) {
+				printf("invalid viewport %s\n", optarg);
+				ret = -1;
+			}
+			opts->viewport = 1;
+			break;
 		default:
 			printf("unknown option %c\n", opt);
 			ret = -1;
@@ -476,7 +1662,7 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 		opts->lib = lookup_lib(DEFAULT_LIB_NAME);
 
 	if (opts->pgm_path == NULL)
-		opts->pgm_path = DEFAULT_IMG_PATH;
+		opts->pgm_path = opts->cmd == &cmd_tiles_def ? DEFAULT_TILES_PATH : DEFAULT_IMG_PATH;
 
 	if (opts->size > (1LL << POWER_MAX)) {
 		printf("Error: size must be lower or equals to %"PRId64"\n", opts->size);
@@ -487,7 +1673,7 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 		ret = -1;
 	}
 
-	if (opts->power_max < 0 || opts->power >= POWER_MAX) {
+	if (opts->power_max < 0 || opts->power_max >= POWER_MAX) {
 		printf("Error: max argument out of range [0,%d]\n", POWER_MAX);
 		ret = -1;
 	}
@@ -508,6 +1694,9 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 	default_int_value(&opts->height, DEFAULT_HEIGHT);
 	default_int_value(&opts->width, DEFAULT_WIDTH);
 	default_int_value(&opts->nb_thread, DEFAULT_NB_THREAD);
+	default_int_value(&opts->repeat, DEFAULT_REPEAT);
+	if (opts->warmup < 0)
+		opts->warmup = DEFAULT_WARMUP;
 
 	if (opts->width == 0 || opts->height == 0) {
 		fprintf(stderr, "argument error: height and width must be greater than 0\n");
@@ -527,6 +1716,13 @@ err:
 int main(int argc, char **argv)
 {
 	struct command_opts opts;
+
+#ifdef HAVE_MPI
+	if (dragon_mpi_init(&argc, &argv) < 0) {
+		printf("Error while initializing MPI\n");
+		exit(EXIT_FAILURE);
+	}
+#endif
 	if (parse_opts(argc, argv, &opts) < 0) {
 		printf("Error while parsing arguments\n");
 		usage();
@@ -537,14 +1733,51 @@ int main(int argc, char **argv)
 		usage();
 	}
 
+#ifdef HAVE_MPI
+	if (dragon_mpi_size() > 1 && !opts.cmd->mpi) {
+		printf("Error: command %s does not run under mpirun\n", opts.cmd->name);
+		goto err;
+	}
+#endif
+
+	if (opts.trace_path != NULL && trace_init() < 0) {
+		printf("Error while initializing trace\n");
+		goto err;
+	}
+
+	/* Les threads de la librairie sont gardés pour toute la commande. */
+	if (opts.lib->init_handler != NULL && opts.lib->init_handler(opts.nb_thread) < 0) {
+		printf("Error while initializing library %s\n", opts.lib->name);
+		goto err;
+	}
+
 	if ((opts.cmd->handler(&opts)) < 0) {
 		printf("Error while executing command %s\n", opts.cmd->name);
 		goto err;
 	}
 
+	if (opts.lib->fini_handler != NULL)
+		opts.lib->fini_handler();
+
+	if (opts.trace_path != NULL && is_root()) {
+		FILE *out = fopen(opts.trace_path, "w");
+		if (out == NULL || trace_dump(out) < 0) {
+			printf("Error while writing trace %s\n", opts.trace_path);
+			goto err;
+		}
+		fclose(out);
+		trace_fini();
+	}
+
+#ifdef HAVE_MPI
+	dragon_mpi_fini(0);
+#endif
 	return EXIT_SUCCESS;
 
 	err:
+#ifdef HAVE_MPI
+	dragon_mpi_fini(1);
+#endif
 	exit(EXIT_FAILURE);
 }
 
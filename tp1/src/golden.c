@@ -0,0 +1,377 @@
+/*
+ * golden.c
+ *
+ * The hash reads 32 bytes per step on four independent lanes, in the
+ * manner of xxHash64, so that hashing a tile costs much less than
+ * drawing it.
+ *
+ * The table is a text file, one "draw" line per entry followed by one
+ * "tile" line per tile drawn:
+ *
+ *   draw size width height colors image canvas tiles_x tiles_y
+ *   tile size width height colors tx ty hash
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "golden.h"
+
+#define HASH_PRIME1	0x9E3779B185EBCA87ULL
+#define HASH_PRIME2	0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3	0x165667B19E3779F9ULL
+
+#define GOLDEN_LINE_MAX	256
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_round(uint64_t h, uint64_t w)
+{
+	h += w * HASH_PRIME2;
+	return rotl64(h, 31) * HASH_PRIME1;
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+	uint64_t w;
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+uint64_t hash64(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	const unsigned char *end = p + len;
+	uint64_t h, w, lanes[4] = {
+		seed + HASH_PRIME1 + HASH_PRIME2,
+		seed + HASH_PRIME2,
+		seed,
+		seed - HASH_PRIME1,
+	};
+	int i;
+
+	while (end - p >= 32) {
+		for (i = 0; i < 4; i++)
+			lanes[i] = hash_round(lanes[i], read64(p + 8 * i));
+		p += 32;
+	}
+
+	h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+	h += len;
+	while (end - p >= 8) {
+		h ^= hash_round(0, read64(p));
+		h = rotl64(h, 27) * HASH_PRIME1 + HASH_PRIME3;
+		p += 8;
+	}
+	if (p < end) {
+		w = 0;
+		memcpy(&w, p, end - p);
+		h ^= hash_round(0, w);
+		h = rotl64(h, 27) * HASH_PRIME1 + HASH_PRIME3;
+	}
+
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	h *= HASH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t image_hash(const struct rgb *image, int width, int height)
+{
+	return hash64(image, (size_t) width * height * sizeof(struct rgb), 0);
+}
+
+/*
+ * Hash of the tile t, in rows whatever the layout (rows is a buffer of
+ * CANVAS_TILE_AREA bytes for the Morton layout), or 0 if it is blank. A
+ * drawn tile never hashes to 0.
+ */
+static uint64_t tile_hash(const struct canvas *canvas, int64_t t, char *rows)
+{
+	const char *tile = __atomic_load_n(&canvas->tiles[t], __ATOMIC_ACQUIRE);
+	int64_t x = (t % canvas->tiles_x) << CANVAS_TILE_SHIFT;
+	int64_t y = (t / canvas->tiles_x) << CANVAS_TILE_SHIFT;
+	int64_t i;
+
+	if (tile == NULL)
+		return 0;
+	if (canvas->layout != CANVAS_LAYOUT_ROWS) {
+		for (i = 0; i < CANVAS_TILE_SIZE; i++)
+			canvas_row(canvas, x, y + i, CANVAS_TILE_SIZE, rows + (i << CANVAS_TILE_SHIFT));
+		tile = rows;
+	}
+	return hash64(tile, CANVAS_TILE_AREA, 0) | 1;
+}
+
+/*
+ * Hash the tiles of the row ty into canvas->hashes, if the canvas keeps
+ * them. Called by the owner of the row once it has painted it, while
+ * the tiles are still in its cache; a tile left at 0 is hashed by
+ * canvas_hash().
+ */
+void canvas_hash_row(struct canvas *canvas, int64_t ty)
+{
+	char *rows = NULL;
+	int64_t t;
+
+	if (canvas->hashes == NULL)
+		return;
+	if (canvas->layout != CANVAS_LAYOUT_ROWS && (rows = (char *) malloc(CANVAS_TILE_AREA)) == NULL)
+		return;
+	for (t = ty * canvas->tiles_x; t < (ty + 1) * canvas->tiles_x; t++)
+		canvas->hashes[t] = tile_hash(canvas, t, rows);
+	free(rows);
+}
+
+/*
+ * The tiles are hashed in rows, so that a Morton canvas has the hashes
+ * of the same canvas in rows. Those already hashed by their owner are
+ * taken from canvas->hashes.
+ */
+int canvas_hash(const struct canvas *canvas, struct canvas_hash *hash)
+{
+	int64_t t, nb_tiles = canvas->tiles_x * canvas->tiles_y;
+	int failed = 0;
+
+	hash->tiles_x = canvas->tiles_x;
+	hash->tiles_y = canvas->tiles_y;
+	hash->canvas = 0;
+	hash->tiles = (uint64_t *) calloc(nb_tiles, sizeof(uint64_t));
+	if (hash->tiles == NULL)
+		return -1;
+
+	#pragma omp parallel reduction(|:failed)
+	{
+		char *rows = NULL;
+
+		if (canvas->layout != CANVAS_LAYOUT_ROWS)
+			rows = (char *) malloc(CANVAS_TILE_AREA);
+
+		#pragma omp for schedule(dynamic)
+		for (t = 0; t < nb_tiles; t++) {
+			if (canvas->hashes != NULL && canvas->hashes[t] != 0) {
+				hash->tiles[t] = canvas->hashes[t];
+				continue;
+			}
+			if (canvas->tiles[t] == NULL)
+				continue;
+			if (canvas->layout != CANVAS_LAYOUT_ROWS && rows == NULL) {
+				failed = 1;
+				continue;
+			}
+			hash->tiles[t] = tile_hash(canvas, t, rows);
+		}
+		free(rows);
+	}
+	if (failed) {
+		canvas_hash_free(hash);
+		return -1;
+	}
+
+	hash->canvas = hash64(hash->tiles, nb_tiles * sizeof(uint64_t), 0);
+	return 0;
+}
+
+void canvas_hash_free(struct canvas_hash *hash)
+{
+	free(hash->tiles);
+	hash->tiles = NULL;
+}
+
+void golden_free(struct golden *golden)
+{
+	int i;
+
+	for (i = 0; i < golden->nb_entries; i++)
+		free(golden->entries[i].tiles);
+	free(golden->entries);
+	golden->entries = NULL;
+	golden->nb_entries = 0;
+}
+
+struct golden_entry *golden_find(struct golden *golden, uint64_t size, int width, int height, int nb_colors)
+{
+	int i;
+
+	for (i = 0; i < golden->nb_entries; i++) {
+		struct golden_entry *e = &golden->entries[i];
+		if (e->size == size && e->width == width && e->height == height && e->nb_colors == nb_colors)
+			return e;
+	}
+	return NULL;
+}
+
+static struct golden_entry *golden_add(struct golden *golden, uint64_t size, int width, int height, int nb_colors)
+{
+	struct golden_entry *entries, *e;
+
+	e = golden_find(golden, size, width, height, nb_colors);
+	if (e != NULL)
+		return e;
+
+	entries = (struct golden_entry *) realloc(golden->entries,
+			(golden->nb_entries + 1) * sizeof(struct golden_entry));
+	if (entries == NULL)
+		return NULL;
+	golden->entries = entries;
+	e = &entries[golden->nb_entries++];
+	memset(e, 0, sizeof(*e));
+	e->size = size;
+	e->width = width;
+	e->height = height;
+	e->nb_colors = nb_colors;
+	return e;
+}
+
+/*
+ * Set the entry of the key to image and hash, which may be NULL when the
+ * canvas was not kept.
+ */
+int golden_set(struct golden *golden, uint64_t size, int width, int height, int nb_colors,
+		uint64_t image, const struct canvas_hash *hash)
+{
+	struct golden_entry *e = golden_add(golden, size, width, height, nb_colors);
+
+	if (e == NULL)
+		return -1;
+	free(e->tiles);
+	e->tiles = NULL;
+	e->image = image;
+	e->canvas = 0;
+	e->tiles_x = 0;
+	e->tiles_y = 0;
+	if (hash == NULL)
+		return 0;
+
+	e->tiles = (uint64_t *) malloc(hash->tiles_x * hash->tiles_y * sizeof(uint64_t));
+	if (e->tiles == NULL)
+		return -1;
+	memcpy(e->tiles, hash->tiles, hash->tiles_x * hash->tiles_y * sizeof(uint64_t));
+	e->canvas = hash->canvas;
+	e->tiles_x = hash->tiles_x;
+	e->tiles_y = hash->tiles_y;
+	return 0;
+}
+
+/*
+ * A missing file is an empty table.
+ */
+int golden_read(struct golden *golden, const char *path)
+{
+	char line[GOLDEN_LINE_MAX];
+	struct golden_entry key, *e = NULL;
+	int64_t tx, ty;
+	uint64_t value;
+	int lineno = 0;
+	FILE *file;
+
+	memset(golden, 0, sizeof(*golden));
+	if ((file = fopen(path, "r")) == NULL)
+		return errno == ENOENT ? 0 : -1;
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (sscanf(line, "draw %"SCNu64" %d %d %d %"SCNx64" %"SCNx64" %"SCNd64" %"SCNd64,
+				&key.size, &key.width, &key.height, &key.nb_colors, &key.image,
+				&key.canvas, &key.tiles_x, &key.tiles_y) == 8) {
+			if (key.tiles_x < 0 || key.tiles_y < 0 ||
+					(e = golden_add(golden, key.size, key.width, key.height, key.nb_colors)) == NULL)
+				goto err;
+			free(e->tiles);
+			e->tiles = NULL;
+			e->image = key.image;
+			e->canvas = key.canvas;
+			e->tiles_x = key.tiles_x;
+			e->tiles_y = key.tiles_y;
+			if (key.tiles_x * key.tiles_y > 0) {
+				e->tiles = (uint64_t *) calloc(key.tiles_x * key.tiles_y, sizeof(uint64_t));
+				if (e->tiles == NULL)
+					goto err;
+			}
+			continue;
+		}
+
+		/* Une tuile suit la ligne draw de son entrée. */
+		if (sscanf(line, "tile %"SCNu64" %d %d %d %"SCNd64" %"SCNd64" %"SCNx64,
+				&key.size, &key.width, &key.height, &key.nb_colors, &tx, &ty, &value) == 7 &&
+				e != NULL && e->tiles != NULL && e->size == key.size && e->width == key.width &&
+				e->height == key.height && e->nb_colors == key.nb_colors &&
+				tx >= 0 && tx < e->tiles_x && ty >= 0 && ty < e->tiles_y) {
+			e->tiles[ty * e->tiles_x + tx] = value;
+			continue;
+		}
+
+		fprintf(stderr, "%s:%d: invalid line\n", path, lineno);
+		goto err;
+	}
+	fclose(file);
+	return 0;
+
+err:
+	fclose(file);
+	golden_free(golden);
+	return -1;
+}
+
+int golden_write(const struct golden *golden, const char *path)
+{
+	FILE *file;
+	int64_t t;
+	int i;
+
+	if ((file = fopen(path, "w")) == NULL)
+		return -1;
+
+	fprintf(file, "# draw size width height colors image canvas tiles_x tiles_y\n");
+	fprintf(file, "# tile size width height colors tx ty hash\n");
+	for (i = 0; i < golden->nb_entries; i++) {
+		const struct golden_entry *e = &golden->entries[i];
+		fprintf(file, "draw %"PRIu64" %d %d %d %016"PRIx64" %016"PRIx64" %"PRId64" %"PRId64"\n",
+				e->size, e->width, e->height, e->nb_colors, e->image, e->canvas,
+				e->tiles_x, e->tiles_y);
+		for (t = 0; e->tiles != NULL && t < e->tiles_x * e->tiles_y; t++) {
+			if (e->tiles[t] == 0)
+				continue;
+			fprintf(file, "tile %"PRIu64" %d %d %d %"PRId64" %"PRId64" %016"PRIx64"\n",
+					e->size, e->width, e->height, e->nb_colors,
+					t % e->tiles_x, t / e->tiles_x, e->tiles[t]);
+		}
+	}
+	if (fclose(file) != 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Number of tiles whose hash differs from the entry, the first max_print
+ * of them being printed, or -1 if the canvases do not have the same
+ * tiles.
+ */
+int64_t golden_cmp_tiles(const struct golden_entry *entry, const struct canvas_hash *hash, int max_print)
+{
+	int64_t t, failed = 0;
+
+	if (entry->tiles == NULL || entry->tiles_x != hash->tiles_x || entry->tiles_y != hash->tiles_y)
+		return -1;
+
+	for (t = 0; t < hash->tiles_x * hash->tiles_y; t++) {
+		if (entry->tiles[t] == hash->tiles[t])
+			continue;
+		if (failed++ < max_print)
+			printf("  tile (%"PRId64", %"PRId64") expected=%016"PRIx64" actual=%016"PRIx64"\n",
+					t % hash->tiles_x, t / hash->tiles_x, entry->tiles[t], hash->tiles[t]);
+	}
+	return failed;
+}
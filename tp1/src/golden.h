@@ -0,0 +1,65 @@
+/*
+ * golden.h
+ *
+ * 64-bit hashes of the canvas tiles and of the image of a draw, and the
+ * table of expected hashes kept in a text file. Comparing a draw to the
+ * table costs a hash of the tiles instead of a second draw.
+ */
+
+#ifndef GOLDEN_H_
+#define GOLDEN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "canvas.h"
+#include "color.h"
+
+/*
+ * Hash of each tile, in rows whatever the layout, and 0 for a blank
+ * tile. The hash of the canvas is that of the array of tile hashes.
+ */
+struct canvas_hash {
+	int64_t tiles_x;
+	int64_t tiles_y;
+	uint64_t *tiles;
+	uint64_t canvas;
+};
+
+/*
+ * Expected hashes of the draw of size segments in nb_colors colours,
+ * rendered at width x height. tiles is NULL when the canvas was not
+ * kept.
+ */
+struct golden_entry {
+	uint64_t size;
+	int width;
+	int height;
+	int nb_colors;
+	uint64_t image;
+	uint64_t canvas;
+	int64_t tiles_x;
+	int64_t tiles_y;
+	uint64_t *tiles;
+};
+
+struct golden {
+	struct golden_entry *entries;
+	int nb_entries;
+};
+
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+uint64_t image_hash(const struct rgb *image, int width, int height);
+void canvas_hash_row(struct canvas *canvas, int64_t ty);
+int canvas_hash(const struct canvas *canvas, struct canvas_hash *hash);
+void canvas_hash_free(struct canvas_hash *hash);
+
+int golden_read(struct golden *golden, const char *path);
+int golden_write(const struct golden *golden, const char *path);
+void golden_free(struct golden *golden);
+struct golden_entry *golden_find(struct golden *golden, uint64_t size, int width, int height, int nb_colors);
+int golden_set(struct golden *golden, uint64_t size, int width, int height, int nb_colors,
+		uint64_t image, const struct canvas_hash *hash);
+int64_t golden_cmp_tiles(const struct golden_entry *entry, const struct canvas_hash *hash, int max_print);
+
+#endif /* GOLDEN_H_ */
@@ -0,0 +1,473 @@
+/*
+ * pyramid.c
+ *
+ * The finest zoom is the canvas itself: its tiles have the size of the
+ * pyramid tiles, so the curve is walked once, by the draw. Each coarser
+ * tile sums its four children two by two, without going back to the
+ * canvas. The tiles are built depth first from the tiles of a middle
+ * zoom shared among the threads, then the few tiles above are reduced
+ * from the sums kept for that zoom.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "dragon.h"
+#include "pyramid.h"
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#include <zlib.h>
+#define PYRAMID_ZLIB 1
+#endif
+
+#define PYRAMID_TILE		CANVAS_TILE_SIZE
+#define PYRAMID_HALF		(PYRAMID_TILE / 2)
+#define PYRAMID_AREA		CANVAS_TILE_AREA
+
+/* Tiles per thread at the zoom shared among the threads. */
+#define PYRAMID_TILES_PER_THREAD	4
+
+static int64_t tiles_x(const struct pyramid *p, int z)
+{
+	int64_t span = (int64_t) PYRAMID_TILE << (p->zoom - z);
+	return (p->dragon->width + span - 1) / span;
+}
+
+static int64_t tiles_y(const struct pyramid *p, int z)
+{
+	int64_t span = (int64_t) PYRAMID_TILE << (p->zoom - z);
+	return (p->dragon->height + span - 1) / span;
+}
+
+/*
+ * Finest zoom, in which the whole dragon fits in one tile at zoom 0.
+ */
+int pyramid_zoom(const struct canvas *dragon)
+{
+	int64_t size = dragon->width > dragon->height ? dragon->width : dragon->height;
+	int zoom = 0;
+
+	while (((int64_t) PYRAMID_TILE << zoom) < size)
+		zoom++;
+	return zoom;
+}
+
+#ifdef PYRAMID_ZLIB
+static void crc_init(void)
+{
+}
+
+static uint32_t crc_update(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	/* crc32() prend la valeur finale et rend la valeur initiale si
+	 * buf est NULL. */
+	if (len == 0)
+		return crc;
+	return ~crc32(~crc, buf, len);
+}
+#else
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+	uint32_t c;
+	int n, k;
+
+	for (n = 0; n < 256; n++) {
+		c = (uint32_t) n;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		crc_table[n] = c;
+	}
+}
+
+static uint32_t crc_update(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+#endif
+
+static void put_be32(unsigned char *buf, uint32_t v)
+{
+	buf[0] = v >> 24;
+	buf[1] = v >> 16;
+	buf[2] = v >> 8;
+	buf[3] = v;
+}
+
+static void png_chunk(FILE *f, const char *type, const unsigned char *data, uint32_t len)
+{
+	unsigned char head[8], tail[4];
+	uint32_t crc;
+
+	put_be32(head, len);
+	memcpy(head + 4, type, 4);
+	crc = crc_update(0xffffffffu, head + 4, 4);
+	crc = crc_update(crc, data, len);
+	put_be32(tail, crc ^ 0xffffffffu);
+	fwrite(head, 1, 8, f);
+	fwrite(data, 1, len, f);
+	fwrite(tail, 1, 4, f);
+}
+
+#ifdef PYRAMID_ZLIB
+/*
+ * zlib stream of raw, compressed at the fastest level: the tiles are
+ * made of runs of a few colours.
+ */
+static unsigned char *png_deflate(const unsigned char *raw, size_t raw_len, size_t *len)
+{
+	uLongf out_len = compressBound(raw_len);
+	unsigned char *out = (unsigned char *) malloc(out_len);
+
+	if (out == NULL)
+		return NULL;
+	if (compress2(out, &out_len, raw, raw_len, 1) != Z_OK) {
+		free(out);
+		return NULL;
+	}
+	*len = out_len;
+	return out;
+}
+#else
+/*
+ * zlib stream of raw made of stored blocks, not compressed, which any
+ * viewer reads.
+ */
+static unsigned char *png_deflate(const unsigned char *raw, size_t raw_len, size_t *len)
+{
+	size_t nb_blocks = (raw_len + 65534) / 65535;
+	size_t i, n, k;
+	uint32_t a = 1, b = 0;
+	unsigned char *out, *p;
+
+	*len = 2 + raw_len + 5 * nb_blocks + 4;
+	if ((out = (unsigned char *) malloc(*len)) == NULL)
+		return NULL;
+
+	/* Adler-32, réduit modulo 65521 tous les 5552 octets comme zlib. */
+	for (i = 0; i < raw_len; i += n) {
+		n = raw_len - i < 5552 ? raw_len - i : 5552;
+		for (k = 0; k < n; k++) {
+			a += raw[i + k];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+
+	p = out;
+	*p++ = 0x78;
+	*p++ = 0x01;
+	for (i = 0; i < raw_len; i += n) {
+		n = raw_len - i < 65535 ? raw_len - i : 65535;
+		*p++ = i + n == raw_len;
+		*p++ = n & 0xff;
+		*p++ = n >> 8;
+		*p++ = ~n & 0xff;
+		*p++ = (~n >> 8) & 0xff;
+		memcpy(p, raw + i, n);
+		p += n;
+	}
+	put_be32(p, (b << 16) | a);
+	return out;
+}
+#endif
+
+/*
+ * Write a PNG of width x height pixels, compressed with zlib when it is
+ * available.
+ */
+static int png_write(const char *path, const struct rgb *image, int width, int height)
+{
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	size_t row = 1 + 3 * (size_t) width;
+	size_t raw_len = row * height;
+	size_t idat_len;
+	unsigned char ihdr[13] = { 0 };
+	unsigned char *raw = NULL, *idat = NULL;
+	FILE *f = NULL;
+	int y;
+
+	raw = (unsigned char *) malloc(raw_len);
+	if (raw == NULL)
+		goto err;
+
+	/* Chaque rangée commence par le filtre 0, aucun filtre. */
+	for (y = 0; y < height; y++) {
+		raw[y * row] = 0;
+		memcpy(raw + y * row + 1, image + (size_t) y * width, 3 * (size_t) width);
+	}
+	if ((idat = png_deflate(raw, raw_len, &idat_len)) == NULL)
+		goto err;
+
+	put_be32(ihdr, width);
+	put_be32(ihdr + 4, height);
+	ihdr[8] = 8;		/* 8 bits par composante */
+	ihdr[9] = 2;		/* RGB */
+
+	if ((f = fopen(path, "wb")) == NULL) {
+		perror(path);
+		goto err;
+	}
+	fwrite(signature, 1, sizeof(signature), f);
+	png_chunk(f, "IHDR", ihdr, sizeof(ihdr));
+	png_chunk(f, "IDAT", idat, idat_len);
+	png_chunk(f, "IEND", NULL, 0);
+	if (fclose(f) != 0)
+		goto err;
+
+	free(raw);
+	free(idat);
+	return 0;
+err:
+	free(raw);
+	free(idat);
+	return -1;
+}
+
+static int make_dir(const char *path)
+{
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Render the sums of the tile (tx, ty) at zoom z and write it. A pixel
+ * covers 4^(zoom - z) canvas pixels, those never drawn count as white
+ * as in render_bins().
+ */
+static int tile_write(struct pyramid *p, int z, int64_t tx, int64_t ty, const struct rgb_bin *sums)
+{
+	int shift = 2 * (p->zoom - z);
+	uint64_t area = UINT64_C(1) << shift;
+	struct rgb *image;
+	char *path = NULL;
+	int i, ret = -1;
+
+	if ((image = (struct rgb *) malloc(PYRAMID_AREA * sizeof(struct rgb))) == NULL)
+		return -1;
+
+	for (i = 0; i < PYRAMID_AREA; i++) {
+		uint64_t blank = 255 * (area - sums[i].cnt);
+		image[i].r = (sums[i].r + blank) >> shift;
+		image[i].g = (sums[i].g + blank) >> shift;
+		image[i].b = (sums[i].b + blank) >> shift;
+	}
+
+	if (asprintf(&path, "%s/%d/%"PRId64, p->dir, z, tx) < 0)
+		goto done;
+	if (make_dir(path) < 0)
+		goto done;
+	free(path);
+	if (asprintf(&path, "%s/%d/%"PRId64"/%"PRId64".png", p->dir, z, tx, ty) < 0) {
+		path = NULL;
+		goto done;
+	}
+	ret = png_write(path, image, PYRAMID_TILE, PYRAMID_TILE);
+	if (ret == 0)
+		__atomic_fetch_add(&p->tiles, 1, __ATOMIC_RELAXED);
+
+done:
+	free(path);
+	free(image);
+	return ret;
+}
+
+/*
+ * Add the child tile to the quadrant (qx, qy) of its parent, each
+ * parent pixel summing 2x2 child pixels. Returns the pixels drawn.
+ */
+static int64_t tile_reduce(struct rgb_bin *parent, const struct rgb_bin *child, int qx, int qy)
+{
+	int64_t drawn = 0;
+	int i, j;
+
+	for (i = 0; i < PYRAMID_TILE; i++) {
+		struct rgb_bin *dst = parent + (qy * PYRAMID_HALF + i / 2) * PYRAMID_TILE + qx * PYRAMID_HALF;
+		const struct rgb_bin *src = child + i * PYRAMID_TILE;
+
+		for (j = 0; j < PYRAMID_TILE; j++) {
+			dst[j / 2].r += src[j].r;
+			dst[j / 2].g += src[j].g;
+			dst[j / 2].b += src[j].b;
+			dst[j / 2].cnt += src[j].cnt;
+			drawn += src[j].cnt;
+		}
+	}
+	return drawn;
+}
+
+/*
+ * Sums of the canvas tile (tx, ty), the finest zoom.
+ */
+static int64_t tile_leaf(const struct pyramid *p, int64_t tx, int64_t ty, struct rgb_bin *sums)
+{
+	const char *tile = p->dragon->tiles[ty * p->dragon->tiles_x + tx];
+	int64_t drawn = 0;
+	int i;
+
+	if (tile == NULL)
+		return 0;
+	for (i = 0; i < PYRAMID_AREA; i++) {
+		char id = tile[canvas_layout_offset(p->dragon->layout, i & CANVAS_TILE_MASK, i >> CANVAS_TILE_SHIFT)];
+		if (id == CANVAS_BLANK)
+			continue;
+		struct rgb color = p->palette->colors[(int) id];
+		sums[i].r = color.r;
+		sums[i].g = color.g;
+		sums[i].b = color.b;
+		sums[i].cnt = 1;
+		drawn++;
+	}
+	return drawn;
+}
+
+/*
+ * Build and write the tile (tx, ty) of zoom z and every tile below it,
+ * depth first. scratch holds a tile for each zoom below z.
+ */
+static int64_t tile_build(struct pyramid *p, int z, int64_t tx, int64_t ty,
+		struct rgb_bin *sums, struct rgb_bin *scratch)
+{
+	int64_t drawn = 0, cx, cy;
+	int q;
+
+	memset(sums, 0, PYRAMID_AREA * sizeof(struct rgb_bin));
+	if (z == p->zoom) {
+		drawn = tile_leaf(p, tx, ty, sums);
+	} else {
+		for (q = 0; q < 4; q++) {
+			cx = 2 * tx + (q & 1);
+			cy = 2 * ty + (q >> 1);
+			if (cx >= tiles_x(p, z + 1) || cy >= tiles_y(p, z + 1))
+				continue;
+			if (tile_build(p, z + 1, cx, cy, scratch, scratch + PYRAMID_AREA) > 0)
+				drawn += tile_reduce(sums, scratch, q & 1, q >> 1);
+		}
+	}
+
+	if (drawn > 0 && tile_write(p, z, tx, ty, sums) < 0)
+		__atomic_fetch_add(&p->errors, 1, __ATOMIC_RELAXED);
+	return drawn;
+}
+
+/*
+ * Write the pyramid of the dragon canvas under dir, drawn with palette.
+ * Tiles without any drawn pixel are not written.
+ */
+int pyramid_write(struct pyramid *p, const struct canvas *dragon,
+		const struct palette *palette, const char *dir, int nb_thread)
+{
+	struct rgb_bin **level = NULL, **upper;
+	int64_t t, nb_tiles, nx, ny;
+	char *path;
+	int z, zp, q;
+
+	memset(p, 0, sizeof(struct pyramid));
+	p->dragon = dragon;
+	p->palette = palette;
+	p->dir = dir;
+	p->zoom = pyramid_zoom(dragon);
+	crc_init();
+
+	if (make_dir(dir) < 0)
+		return -1;
+	for (z = 0; z <= p->zoom; z++) {
+		if (asprintf(&path, "%s/%d", dir, z) < 0)
+			return -1;
+		q = make_dir(path);
+		free(path);
+		if (q < 0)
+			return -1;
+	}
+
+	/* 1. Les threads se partagent les tuiles du niveau zp et
+	 * construisent chacune en profondeur. */
+	for (zp = 0; zp < p->zoom && tiles_x(p, zp) * tiles_y(p, zp) < PYRAMID_TILES_PER_THREAD * nb_thread; zp++)
+		;
+	nb_tiles = tiles_x(p, zp) * tiles_y(p, zp);
+	if ((level = (struct rgb_bin **) calloc(nb_tiles, sizeof(struct rgb_bin *))) == NULL)
+		return -1;
+
+	#pragma omp parallel num_threads(nb_thread)
+	{
+		struct rgb_bin *scratch = (struct rgb_bin *) malloc((size_t) (p->zoom - zp + 1) * PYRAMID_AREA * sizeof(struct rgb_bin));
+
+		#pragma omp for schedule(dynamic)
+		for (t = 0; t < nb_tiles; t++) {
+			struct rgb_bin *sums = (struct rgb_bin *) malloc(PYRAMID_AREA * sizeof(struct rgb_bin));
+
+			if (scratch == NULL || sums == NULL) {
+				__atomic_fetch_add(&p->errors, 1, __ATOMIC_RELAXED);
+				free(sums);
+				continue;
+			}
+			if (tile_build(p, zp, t % tiles_x(p, zp), t / tiles_x(p, zp), sums, scratch) > 0)
+				level[t] = sums;
+			else
+				free(sums);
+		}
+		free(scratch);
+	}
+
+	/* 2. Les niveaux au-dessus de zp sont réduits des sommes gardées. */
+	for (z = zp - 1; z >= 0; z--) {
+		nx = tiles_x(p, z);
+		ny = tiles_y(p, z);
+		if ((upper = (struct rgb_bin **) calloc(nx * ny, sizeof(struct rgb_bin *))) == NULL)
+			goto err;
+
+		for (t = 0; t < nx * ny; t++) {
+			int64_t drawn = 0, tx = t % nx, ty = t / nx;
+			struct rgb_bin *sums = (struct rgb_bin *) calloc(PYRAMID_AREA, sizeof(struct rgb_bin));
+
+			if (sums == NULL) {
+				p->errors++;
+				continue;
+			}
+			for (q = 0; q < 4; q++) {
+				int64_t cx = 2 * tx + (q & 1), cy = 2 * ty + (q >> 1);
+				if (cx < tiles_x(p, z + 1) && cy < tiles_y(p, z + 1)
+						&& level[cy * tiles_x(p, z + 1) + cx] != NULL)
+					drawn += tile_reduce(sums, level[cy * tiles_x(p, z + 1) + cx], q & 1, q >> 1);
+			}
+			if (drawn > 0 && tile_write(p, z, tx, ty, sums) < 0)
+				p->errors++;
+			if (drawn > 0)
+				upper[t] = sums;
+			else
+				free(sums);
+		}
+
+		for (t = 0; t < tiles_x(p, z + 1) * tiles_y(p, z + 1); t++)
+			free(level[t]);
+		free(level);
+		level = upper;
+	}
+
+	for (t = 0; t < tiles_x(p, 0) * tiles_y(p, 0); t++)
+		free(level[t]);
+	free(level);
+	return p->errors > 0 ? -1 : 0;
+
+err:
+	for (t = 0; t < tiles_x(p, z + 1) * tiles_y(p, z + 1); t++)
+		free(level[t]);
+	free(level);
+	return -1;
+}
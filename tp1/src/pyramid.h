@@ -0,0 +1,30 @@
+/*
+ * pyramid.h
+ *
+ * Zoom pyramid of a dragon canvas, in tiles of CANVAS_TILE_SIZE pixels
+ * written as dir/z/x/y.png. The finest zoom has one canvas pixel per
+ * pixel, each coarser zoom halves the resolution, down to zoom 0 which
+ * holds the whole dragon in one tile.
+ */
+
+#ifndef PYRAMID_H_
+#define PYRAMID_H_
+
+#include <stdint.h>
+#include "canvas.h"
+#include "color.h"
+
+struct pyramid {
+	const struct canvas *dragon;
+	const struct palette *palette;
+	const char *dir;
+	int zoom;					/* finest zoom */
+	int64_t tiles;				/* tiles written */
+	int errors;
+};
+
+int pyramid_zoom(const struct canvas *dragon);
+int pyramid_write(struct pyramid *pyramid, const struct canvas *dragon,
+		const struct palette *palette, const char *dir, int nb_thread);
+
+#endif /* PYRAMID_H_ */
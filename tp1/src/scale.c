@@ -0,0 +1,397 @@
+/*
+ * scale.c
+ *
+ * Each image pixel is the mean of a scale x scale box of the canvas,
+ * blank pixels being white. The vector kernels add whole tile rows into
+ * 16-bit column sums (colour channels and count of drawn pixels), which
+ * are reduced into the boxes of a strip of adjacent image pixels every
+ * SCALE_FLUSH rows. Blank tiles are not read at all: their pixels are
+ * accounted for as white from the count of drawn pixels. The palette is
+ * expanded without gathers, by a byte shuffle (AVX2) or by comparisons
+ * (SSE2), so these kernels need at most SCALE_LUT_SIZE colours. The sums
+ * are exact, so every kernel gives the image of scale_dragon_ref().
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "scale.h"
+#include "color.h"
+
+#define SCALE_STRIP		4096	/* canvas columns per strip */
+#define SCALE_FLUSH		256		/* 256 * 255 fits in 16 bits */
+#define SCALE_LUT_SIZE	16
+#define SCALE_PAD		32
+
+const char * const scale_isa_names[SCALE_ISA_COUNT] = {
+	"scalar", "sse2", "avx2"
+};
+
+struct scale_lut {
+	uint8_t r[SCALE_LUT_SIZE];
+	uint8_t g[SCALE_LUT_SIZE];
+	uint8_t b[SCALE_LUT_SIZE];
+	int len;
+};
+
+/*
+ * Add len pixels of a tile row into the column sums r, g, b and n, which
+ * are stride apart in acc.
+ */
+typedef void (*scale_accumulate)(const char *row, int64_t len, uint16_t *acc, int64_t stride,
+		const struct scale_lut *lut);
+
+static void accumulate_scalar(const char *row, int64_t len, uint16_t *acc, int64_t stride,
+		const struct scale_lut *lut)
+{
+	int64_t k;
+
+	for (k = 0; k < len; k++) {
+		int id = row[k];
+		if (id < 0)
+			continue;
+		acc[k] += lut->r[id];
+		acc[stride + k] += lut->g[id];
+		acc[2 * stride + k] += lut->b[id];
+		acc[3 * stride + k]++;
+	}
+}
+
+static inline void add_u8_sse2(uint16_t *acc, __m128i v)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i *p = (__m128i *) acc;
+
+	_mm_storeu_si128(p, _mm_add_epi16(_mm_loadu_si128(p), _mm_unpacklo_epi8(v, zero)));
+	_mm_storeu_si128(p + 1, _mm_add_epi16(_mm_loadu_si128(p + 1), _mm_unpackhi_epi8(v, zero)));
+}
+
+static void accumulate_sse2(const char *row, int64_t len, uint16_t *acc, int64_t stride,
+		const struct scale_lut *lut)
+{
+	__m128i blank = _mm_set1_epi8(-1);
+	__m128i one = _mm_set1_epi8(1);
+	int64_t k;
+	int c;
+
+	for (k = 0; k + 16 <= len; k += 16) {
+		__m128i ids = _mm_loadu_si128((const __m128i *) (row + k));
+		__m128i r = _mm_setzero_si128();
+		__m128i g = _mm_setzero_si128();
+		__m128i b = _mm_setzero_si128();
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(ids, blank)) == 0xffff)
+			continue;
+		for (c = 0; c < lut->len; c++) {
+			__m128i m = _mm_cmpeq_epi8(ids, _mm_set1_epi8(c));
+			if (_mm_movemask_epi8(m) == 0)
+				continue;
+			r = _mm_or_si128(r, _mm_and_si128(m, _mm_set1_epi8(lut->r[c])));
+			g = _mm_or_si128(g, _mm_and_si128(m, _mm_set1_epi8(lut->g[c])));
+			b = _mm_or_si128(b, _mm_and_si128(m, _mm_set1_epi8(lut->b[c])));
+		}
+		add_u8_sse2(acc + k, r);
+		add_u8_sse2(acc + stride + k, g);
+		add_u8_sse2(acc + 2 * stride + k, b);
+		add_u8_sse2(acc + 3 * stride + k, _mm_and_si128(_mm_cmpgt_epi8(ids, blank), one));
+	}
+	accumulate_scalar(row + k, len - k, acc + k, stride, lut);
+}
+
+__attribute__((target("avx2")))
+static inline void add_u8_avx2(uint16_t *acc, __m256i v)
+{
+	__m256i *p = (__m256i *) acc;
+	__m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v));
+	__m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1));
+
+	_mm256_storeu_si256(p, _mm256_add_epi16(_mm256_loadu_si256(p), lo));
+	_mm256_storeu_si256(p + 1, _mm256_add_epi16(_mm256_loadu_si256(p + 1), hi));
+}
+
+/*
+ * vpshufb returns 0 for the blank id -1, whose high bit is set, so the
+ * blank pixels add nothing.
+ */
+__attribute__((target("avx2")))
+static void accumulate_avx2(const char *row, int64_t len, uint16_t *acc, int64_t stride,
+		const struct scale_lut *lut)
+{
+	__m256i lr = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) lut->r));
+	__m256i lg = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) lut->g));
+	__m256i lb = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) lut->b));
+	__m256i blank = _mm256_set1_epi8(-1);
+	__m256i one = _mm256_set1_epi8(1);
+	int64_t k;
+
+	for (k = 0; k + 32 <= len; k += 32) {
+		__m256i ids = _mm256_loadu_si256((const __m256i *) (row + k));
+		__m256i drawn = _mm256_cmpgt_epi8(ids, blank);
+
+		if (_mm256_testz_si256(drawn, drawn))
+			continue;
+		add_u8_avx2(acc + k, _mm256_shuffle_epi8(lr, ids));
+		add_u8_avx2(acc + stride + k, _mm256_shuffle_epi8(lg, ids));
+		add_u8_avx2(acc + 2 * stride + k, _mm256_shuffle_epi8(lb, ids));
+		add_u8_avx2(acc + 3 * stride + k, _mm256_and_si256(drawn, one));
+	}
+	accumulate_scalar(row + k, len - k, acc + k, stride, lut);
+}
+
+static const scale_accumulate accumulators[SCALE_ISA_COUNT] = {
+	accumulate_scalar, accumulate_sse2, accumulate_avx2
+};
+
+int scale_isa_supported(enum scale_isa isa)
+{
+	switch (isa) {
+	case SCALE_ISA_SCALAR:
+	case SCALE_ISA_SSE2:
+		return 1;
+	case SCALE_ISA_AVX2:
+		return __builtin_cpu_supports("avx2");
+	default:
+		return 0;
+	}
+}
+
+enum scale_isa scale_isa_best(void)
+{
+	return scale_isa_supported(SCALE_ISA_AVX2) ? SCALE_ISA_AVX2 : SCALE_ISA_SSE2;
+}
+
+struct scale_strip {
+	int64_t scale;
+	int64_t deltaJ;
+	int64_t c0;			/* canvas column of acc[0] */
+	int64_t j_lo;		/* columns [j_lo, j_hi[ of the strip in the canvas */
+	int64_t j_hi;
+	int x0;				/* image pixels [x0, x1[ */
+	int x1;
+	int64_t stride;
+	uint16_t *acc;
+	uint64_t (*sums)[4];
+};
+
+/*
+ * Reduce the column sums into the boxes of the strip, then clear them.
+ */
+static void strip_flush(struct scale_strip *strip)
+{
+	int64_t j, j1, j2;
+	int x, c;
+
+	for (x = strip->x0; x < strip->x1; x++) {
+		j1 = x * strip->scale - strip->deltaJ;
+		j2 = j1 + strip->scale;
+		if (j1 < strip->j_lo) j1 = strip->j_lo;
+		if (j2 > strip->j_hi) j2 = strip->j_hi;
+		for (c = 0; c < 4; c++) {
+			const uint16_t *col = strip->acc + c * strip->stride;
+			uint64_t sum = 0;
+			for (j = j1; j < j2; j++)
+				sum += col[j - strip->c0];
+			strip->sums[x - strip->x0][c] += sum;
+		}
+	}
+	for (c = 0; c < 4; c++)
+		memset(strip->acc + c * strip->stride + (strip->j_lo - strip->c0), 0,
+				(strip->j_hi - strip->j_lo) * sizeof(uint16_t));
+}
+
+void scale_dragon_isa(enum scale_isa isa, int start, int end, struct rgb *image,
+		int image_width, int image_height, struct canvas *dragon, struct palette *palette)
+{
+	struct scale_strip strip;
+	struct scale_lut lut;
+	scale_accumulate accumulate;
+	int64_t dragon_width = dragon->width;
+	int64_t dragon_height = dragon->height;
+	int64_t scale_x = dragon_width / image_width + 1;
+	int64_t scale_y = dragon_height / image_height + 1;
+	int64_t deltaI, i, i1, i2, j, next, cnt;
+	int nbox, rows, dirty, x, y, c;
+	char gather[CANVAS_TILE_SIZE];
+
+	if (palette->len > SCALE_LUT_SIZE) {
+		scale_dragon_ref(start, end, image, image_width, image_height, dragon, palette);
+		return;
+	}
+	accumulate = accumulators[isa];
+
+	memset(&lut, 0, sizeof(lut));
+	lut.len = palette->len;
+	for (c = 0; c < palette->len; c++) {
+		lut.r[c] = palette->colors[c].r;
+		lut.g[c] = palette->colors[c].g;
+		lut.b[c] = palette->colors[c].b;
+	}
+
+	strip.scale = (scale_x > scale_y ? scale_x : scale_y);
+	strip.deltaJ = (strip.scale * image_width - dragon_width) / 2;
+	deltaI = (strip.scale * image_height - dragon_height) / 2;
+
+	nbox = SCALE_STRIP / strip.scale;
+	if (nbox < 1) nbox = 1;
+	if (nbox > image_width) nbox = image_width;
+	strip.stride = nbox * strip.scale + SCALE_PAD;
+	strip.acc = (uint16_t *) calloc(4 * strip.stride, sizeof(uint16_t));
+	strip.sums = (uint64_t (*)[4]) malloc(nbox * sizeof(*strip.sums));
+	if (strip.acc == NULL || strip.sums == NULL) {
+		free(strip.acc);
+		free(strip.sums);
+		scale_dragon_ref(start, end, image, image_width, image_height, dragon, palette);
+		return;
+	}
+
+	for (y = start; y < end; y++) {
+		i1 = y * strip.scale - deltaI;
+		i2 = i1 + strip.scale;
+		if (i1 < 0) i1 = 0;
+		if (i2 > dragon_height) i2 = dragon_height;
+
+		for (strip.x0 = 0; strip.x0 < image_width; strip.x0 = strip.x1) {
+			strip.x1 = strip.x0 + nbox;
+			if (strip.x1 > image_width)
+				strip.x1 = image_width;
+			strip.c0 = strip.x0 * strip.scale - strip.deltaJ;
+			strip.j_lo = strip.c0 < 0 ? 0 : strip.c0;
+			strip.j_hi = strip.x1 * strip.scale - strip.deltaJ;
+			if (strip.j_hi > dragon_width)
+				strip.j_hi = dragon_width;
+			memset(strip.sums, 0, nbox * sizeof(*strip.sums));
+
+			rows = 0;
+			dirty = 0;
+			for (i = i1; i < i2 && strip.j_lo < strip.j_hi; i++) {
+				for (j = strip.j_lo; j < strip.j_hi; j = next) {
+					next = (j | CANVAS_TILE_MASK) + 1;
+					if (next > strip.j_hi) next = strip.j_hi;
+					const char *row = canvas_row(dragon, j, i, next - j, gather);
+					if (row == NULL)
+						continue;
+					accumulate(row, next - j, strip.acc + (j - strip.c0), strip.stride, &lut);
+					dirty = 1;
+				}
+				if (++rows == SCALE_FLUSH) {
+					if (dirty)
+						strip_flush(&strip);
+					rows = 0;
+					dirty = 0;
+				}
+			}
+			if (dirty)
+				strip_flush(&strip);
+
+			for (x = strip.x0; x < strip.x1; x++) {
+				const uint64_t *sum = strip.sums[x - strip.x0];
+				int64_t j1 = x * strip.scale - strip.deltaJ, j2 = j1 + strip.scale;
+				int index = y * image_width + x;
+				if (j1 < 0) j1 = 0;
+				if (j2 > dragon_width) j2 = dragon_width;
+				cnt = (j2 > j1 && i2 > i1) ? (j2 - j1) * (i2 - i1) : 0;
+				if (cnt == 0) {
+					image[index] = white;
+					continue;
+				}
+				/* Les pixels vides comptent pour du blanc. */
+				image[index].r = (unsigned char) ((sum[0] + 255 * (cnt - sum[3])) / cnt);
+				image[index].g = (unsigned char) ((sum[1] + 255 * (cnt - sum[3])) / cnt);
+				image[index].b = (unsigned char) ((sum[2] + 255 * (cnt - sum[3])) / cnt);
+			}
+		}
+	}
+
+	free(strip.acc);
+	free(strip.sums);
+}
+
+/*
+ * Box filter of the dragon into the image, with the best kernel of the
+ * processor. Called by every backend on its rows [start, end[.
+ */
+void scale_dragon(int start, int end, struct rgb *image, int image_width, int image_height,
+        struct canvas *dragon, struct palette *palette)
+{
+	scale_dragon_isa(scale_isa_best(), start, end, image, image_width, image_height,
+			dragon, palette);
+}
+
+/*
+ * Reference box filter, one source pixel at a time. The canvas is read
+ * one tile row at a time, and blank tiles are counted as white without
+ * being read.
+ */
+void scale_dragon_ref(int start, int end, struct rgb *image, int image_width, int image_height,
+        struct canvas *dragon, struct palette *palette)
+{
+    int x, y;
+    int64_t i, j, k, next;
+    int64_t dragon_width = dragon->width;
+    int64_t dragon_height = dragon->height;
+
+    int64_t scale_x = dragon_width / image_width + 1;
+    int64_t scale_y = dragon_height / image_height + 1;
+    int64_t scale = (scale_x > scale_y ? scale_x : scale_y);
+
+    int64_t deltaJ = (scale * image_width - dragon_width) / 2;
+    int64_t deltaI = (scale * image_height - dragon_height) / 2;
+    struct rgb *colors = palette->colors;
+    char gather[CANVAS_TILE_SIZE];
+
+    for (y = start; y < end; y++) {
+        int64_t i1 = y * scale - deltaI;
+        int64_t i2 = i1 + scale;
+        if (i1 < 0) i1 = 0;
+        if (i2 > dragon_height) i2 = dragon_height;
+        for (x = 0; x < image_width; x++) {
+
+            int64_t j1 = x * scale - deltaJ, j2 = j1 + scale;
+            int64_t red = 0;
+            int64_t green = 0;
+            int64_t blue = 0;
+            int64_t cnt = 0;
+            if (j1 < 0) j1 = 0;
+            if (j2 > dragon_width) j2 = dragon_width;
+
+            for (i = i1; i < i2; i++) {
+                for (j = j1; j < j2; j = next) {
+                    next = (j | CANVAS_TILE_MASK) + 1;
+                    if (next > j2) next = j2;
+                    const char *row = canvas_row(dragon, j, i, next - j, gather);
+                    cnt += next - j;
+                    if (row == NULL) {
+                        red     += 255 * (next - j);
+                        green   += 255 * (next - j);
+                        blue    += 255 * (next - j);
+                        continue;
+                    }
+                    for (k = 0; k < next - j; k++) {
+                        int id = row[k];
+                        if (id >= 0) {
+                            red     += colors[id].r;
+                            green   += colors[id].g;
+                            blue    += colors[id].b;
+                        } else {
+                            red     += 255;
+                            green   += 255;
+                            blue    += 255;
+                        }
+                    }
+                }
+            }
+            int index = y * image_width + x;
+            if (cnt == 0) {
+                image[index] = white;
+            } else {
+                image[index].r = (unsigned char) (red   / cnt);
+                image[index].g = (unsigned char) (green / cnt);
+                image[index].b = (unsigned char) (blue  / cnt);
+            }
+        }
+    }
+}
+
@@ -0,0 +1,29 @@
+/*
+ * scale.h
+ *
+ * Box filter of the dragon canvas into the image, with vector kernels
+ * chosen at runtime.
+ */
+
+#ifndef SCALE_H_
+#define SCALE_H_
+
+#include "dragon.h"
+
+enum scale_isa {
+	SCALE_ISA_SCALAR,
+	SCALE_ISA_SSE2,
+	SCALE_ISA_AVX2,
+	SCALE_ISA_COUNT
+};
+
+extern const char * const scale_isa_names[SCALE_ISA_COUNT];
+
+int scale_isa_supported(enum scale_isa isa);
+enum scale_isa scale_isa_best(void);
+void scale_dragon_isa(enum scale_isa isa, int start, int end, struct rgb *image,
+		int image_width, int image_height, struct canvas *dragon, struct palette *palette);
+void scale_dragon_ref(int start, int end, struct rgb *image, int image_width, int image_height,
+		struct canvas *dragon, struct palette *palette);
+
+#endif /* SCALE_H_ */
@@ -0,0 +1,198 @@
+/*
+ * trace.c
+ *
+ * The ring of a thread is allocated on its first event. Rings are
+ * indexed by the thread number given by the caller (pthread worker id or
+ * TBB arena slot), so no lookup by tid is needed.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "trace.h"
+#include "utils.h"
+
+int trace_enabled = 0;
+static struct trace_ring **rings = NULL;
+static uint64_t trace_origin;
+
+const char * const trace_phase_names[PHASE_COUNT] = {
+	"limits", "canvas", "draw", "render", "write"
+};
+__thread uint64_t trace_phases[PHASE_COUNT];
+static __thread uint64_t trace_phase_mark;
+
+#define NS_PER_S UINT64_C(1000000000)
+
+uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+/*
+ * Phase timings are always on: they are only taken a few times per draw,
+ * by the thread running it. They are per thread, since the batch command
+ * runs serial draws on several threads at once.
+ */
+void trace_phase_reset(void)
+{
+	memset(trace_phases, 0, sizeof(trace_phases));
+	trace_phase_mark = trace_now();
+}
+
+void trace_phase(enum trace_phase phase)
+{
+	uint64_t now = trace_now();
+
+	trace_phases[phase] += now - trace_phase_mark;
+	trace_phase_mark = now;
+}
+
+int trace_init(void)
+{
+	rings = (struct trace_ring **) calloc(TRACE_MAX_THREADS, sizeof(struct trace_ring *));
+	if (rings == NULL)
+		return -1;
+	trace_origin = trace_now();
+	trace_enabled = 1;
+	return 0;
+}
+
+void trace_fini(void)
+{
+	int i;
+
+	trace_enabled = 0;
+	if (rings == NULL)
+		return;
+	for (i = 0; i < TRACE_MAX_THREADS; i++)
+		free(rings[i]);
+	free(rings);
+	rings = NULL;
+}
+
+static struct trace_ring *trace_ring_get(int thread)
+{
+	struct trace_ring **slot = &rings[thread];
+	struct trace_ring *expected = NULL;
+	struct trace_ring *ring;
+
+	ring = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (ring != NULL)
+		return ring;
+
+	if (posix_memalign((void **) &ring, 128, sizeof(struct trace_ring)) != 0)
+		return NULL;
+	ring->thread = thread;
+	ring->tid = gettid();
+	ring->cpu = sched_getcpu();
+	ring->head = 0;
+
+	if (!__atomic_compare_exchange_n(slot, &expected, ring, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(ring);
+		ring = expected;
+	}
+	return ring;
+}
+
+/*
+ * Record the event [begin, now] of the given thread. When the ring is
+ * full, the oldest events are overwritten.
+ */
+void trace_record(int thread, const char *name, uint64_t start, uint64_t stop, uint64_t begin)
+{
+	struct trace_ring *ring;
+	struct trace_event *event;
+	uint64_t end = trace_now();
+
+	if (thread < 0 || thread >= TRACE_MAX_THREADS)
+		return;
+	if ((ring = trace_ring_get(thread)) == NULL)
+		return;
+
+	event = &ring->events[ring->head & (TRACE_RING_SIZE - 1)];
+	event->name = name;
+	event->begin = begin;
+	event->end = end;
+	event->start = start;
+	event->stop = stop;
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+struct trace_point {
+	uint64_t ts;
+	const struct trace_ring *ring;
+	const struct trace_event *event;
+	const char *kind;
+};
+
+static int trace_point_cmp(const void *a, const void *b)
+{
+	const struct trace_point *pa = (const struct trace_point *) a;
+	const struct trace_point *pb = (const struct trace_point *) b;
+
+	return (pa->ts > pb->ts) - (pa->ts < pb->ts);
+}
+
+/*
+ * Print the entry and exit of every event kept, in the text format of
+ * babeltrace, sorted by timestamp. Must be called once the traced
+ * threads are done.
+ */
+int trace_dump(FILE *out)
+{
+	struct trace_point *points;
+	size_t nb = 0, k;
+	uint64_t first, n, last = trace_origin;
+	int i;
+
+	if (rings == NULL)
+		return -1;
+
+	for (i = 0; i < TRACE_MAX_THREADS; i++)
+		if (rings[i] != NULL)
+			nb += 2 * (rings[i]->head < TRACE_RING_SIZE ? rings[i]->head : TRACE_RING_SIZE);
+
+	points = (struct trace_point *) malloc((nb + 1) * sizeof(struct trace_point));
+	if (points == NULL)
+		return -1;
+
+	nb = 0;
+	for (i = 0; i < TRACE_MAX_THREADS; i++) {
+		const struct trace_ring *ring = rings[i];
+		if (ring == NULL)
+			continue;
+		first = ring->head > TRACE_RING_SIZE ? ring->head - TRACE_RING_SIZE : 0;
+		for (n = first; n < ring->head; n++) {
+			const struct trace_event *event = &ring->events[n & (TRACE_RING_SIZE - 1)];
+			points[nb++] = (struct trace_point) { event->begin, ring, event, "entry" };
+			points[nb++] = (struct trace_point) { event->end, ring, event, "exit" };
+		}
+	}
+	qsort(points, nb, sizeof(struct trace_point), trace_point_cmp);
+
+	for (k = 0; k < nb; k++) {
+		const struct trace_point *p = &points[k];
+		uint64_t rel = p->ts - trace_origin;
+		uint64_t delta = p->ts - last;
+
+		fprintf(out, "[%"PRIu64".%09"PRIu64"] (+%"PRIu64".%09"PRIu64") dragonizer dragon:%s_%s: "
+				"{ cpu_id = %d }, { thread = %d, tid = %d, start = %"PRIu64", end = %"PRIu64" }\n",
+				rel / NS_PER_S, rel % NS_PER_S,
+				delta / NS_PER_S, delta % NS_PER_S,
+				p->event->name, p->kind, p->ring->cpu, p->ring->thread, p->ring->tid,
+				p->event->start, p->event->stop);
+		last = p->ts;
+	}
+
+	free(points);
+	return 0;
+}
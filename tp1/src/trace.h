@@ -0,0 +1,75 @@
+/*
+ * trace.h
+ *
+ * Per-thread ring buffers of timed events, enabled by --trace. Each ring
+ * is written by a single thread without locking, and the rings are only
+ * read by trace_dump() once the threads are done. When tracing is off,
+ * recording an event costs a single test.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAX_THREADS	256
+#define TRACE_RING_SIZE		4096	/* power of two */
+
+struct trace_event {
+	const char *name;
+	uint64_t begin;		/* ns, CLOCK_MONOTONIC */
+	uint64_t end;
+	uint64_t start;		/* range of the event */
+	uint64_t stop;
+};
+
+struct trace_ring {
+	int thread;
+	int tid;
+	int cpu;
+	uint64_t head;
+	struct trace_event events[TRACE_RING_SIZE];
+} __attribute__((aligned(128)));
+
+/*
+ * Phases of a draw, timed by the thread calling the library. Each call
+ * to trace_phase() charges the time since the previous mark of the
+ * thread to a phase.
+ */
+enum trace_phase {
+	PHASE_LIMITS,
+	PHASE_CANVAS,
+	PHASE_DRAW,
+	PHASE_RENDER,
+	PHASE_WRITE,
+	PHASE_COUNT
+};
+
+extern int trace_enabled;
+extern const char * const trace_phase_names[PHASE_COUNT];
+extern __thread uint64_t trace_phases[PHASE_COUNT];
+
+int trace_init(void);
+void trace_fini(void);
+uint64_t trace_now(void);
+void trace_record(int thread, const char *name, uint64_t start, uint64_t stop, uint64_t begin);
+int trace_dump(FILE *out);
+void trace_phase_reset(void);
+void trace_phase(enum trace_phase phase);
+
+/*
+ * Timestamp for trace_end(), or 0 when tracing is off.
+ */
+static inline uint64_t trace_begin(void)
+{
+	return trace_enabled ? trace_now() : 0;
+}
+
+static inline void trace_end(int thread, const char *name, uint64_t start, uint64_t stop, uint64_t begin)
+{
+	if (trace_enabled)
+		trace_record(thread, name, start, stop, begin);
+}
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,160 @@
+/*
+ * worker_pool.c
+ *
+ * The workers are created once and wait for jobs on a condition. A job
+ * is published by bumping the generation, and the caller waits until
+ * every worker is done with it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "worker_pool.h"
+
+struct pool_thread {
+	struct worker_pool *pool;
+	pthread_t thread;
+	int id;
+};
+
+static void *pool_worker(void *data)
+{
+	struct pool_thread *self = (struct pool_thread *) data;
+	struct worker_pool *pool = self->pool;
+	uint64_t seen = 0;
+	worker_job job;
+	void *arg;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->generation == seen && !pool->stop)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->stop)
+			break;
+		seen = pool->generation;
+		job = pool->job;
+		arg = pool->args + self->id * pool->arg_size;
+		pthread_mutex_unlock(&pool->lock);
+
+		job(arg);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct worker_pool *worker_pool_create(int nb_thread)
+{
+	struct worker_pool *pool;
+	int i;
+
+	if (nb_thread <= 0)
+		return NULL;
+
+	pool = (struct worker_pool *) calloc(1, sizeof(struct worker_pool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->threads = (struct pool_thread *) calloc(nb_thread, sizeof(struct pool_thread));
+	if (pool->threads == NULL) {
+		free(pool);
+		return NULL;
+	}
+
+	if (pthread_barrier_init(&pool->barrier, NULL, nb_thread) != 0) {
+		printf("pool pthread_barrier_init error\n");
+		free(pool->threads);
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 0; i < nb_thread; i++) {
+		pool->threads[i].pool = pool;
+		pool->threads[i].id = i;
+		if (pthread_create(&pool->threads[i].thread, NULL, pool_worker, &pool->threads[i]) != 0) {
+			printf("pool pthread_create error\n");
+			break;
+		}
+		pool->nb_thread++;
+	}
+
+	if (pool->nb_thread != nb_thread) {
+		worker_pool_destroy(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void worker_pool_destroy(struct worker_pool *pool)
+{
+	int i;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nb_thread; i++)
+		pthread_join(pool->threads[i].thread, NULL);
+
+	pthread_barrier_destroy(&pool->barrier);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	free(pool->slots);
+	free(pool->threads);
+	free(pool);
+}
+
+/*
+ * Run job on every worker, worker i getting args + i * arg_size, and
+ * wait for all of them to return.
+ */
+int worker_pool_run(struct worker_pool *pool, worker_job job, void *args, size_t arg_size)
+{
+	if (pool == NULL || job == NULL)
+		return -1;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->job = job;
+	pool->args = (char *) args;
+	pool->arg_size = arg_size;
+	pool->pending = pool->nb_thread;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+/*
+ * Per-worker descriptors of size bytes each, kept from one job to the
+ * next and aligned on 128 bytes like struct draw_data.
+ */
+void *worker_pool_slots(struct worker_pool *pool, size_t size)
+{
+	size_t total = size * pool->nb_thread;
+
+	if (total > pool->slots_size) {
+		free(pool->slots);
+		pool->slots = NULL;
+		pool->slots_size = 0;
+		if (posix_memalign(&pool->slots, 128, total) != 0)
+			return NULL;
+		pool->slots_size = total;
+	}
+	memset(pool->slots, 0, total);
+	return pool->slots;
+}
@@ -0,0 +1,41 @@
+/*
+ * worker_pool.h
+ *
+ * Long-lived pool of pthreads. Every job runs on all the workers, which
+ * share a barrier that stays valid from one job to the next.
+ */
+
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+typedef void *(*worker_job)(void *);
+
+struct pool_thread;
+
+struct worker_pool {
+	int nb_thread;
+	struct pool_thread *threads;
+	pthread_barrier_t barrier;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	uint64_t generation;
+	int pending;
+	int stop;
+	worker_job job;
+	char *args;
+	size_t arg_size;
+	void *slots;
+	size_t slots_size;
+};
+
+struct worker_pool *worker_pool_create(int nb_thread);
+void worker_pool_destroy(struct worker_pool *pool);
+int worker_pool_run(struct worker_pool *pool, worker_job job, void *args, size_t arg_size);
+void *worker_pool_slots(struct worker_pool *pool, size_t size);
+
+#endif /* WORKER_POOL_H_ */
@@ -0,0 +1,5 @@
+#!/bin/sh
+# Compare chaque librairie à la table d'empreintes, sans redessin série
+GOLDEN=${abs_top_srcdir}/tests/golden.txt
+${abs_top_srcdir}/src/dragonizer --cmd regress --golden $GOLDEN --power 16 --max 22 --thread 10 && \
+${abs_top_srcdir}/src/dragonizer --cmd regress --golden $GOLDEN --power 20 --thread 10 --width 1024 --height 768
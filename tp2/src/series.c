@@ -0,0 +1,85 @@
+/*
+ * series.c
+ *
+ * The sums of a row and of a column are accumulated in double, each of
+ * them being reused for a whole line of pixels. With the recurrence, the
+ * cosines are the sines shifted by pi / 2.
+ */
+
+#include <math.h>
+
+#include "series.h"
+
+/*
+ * Sum over odd k <= taylor of sin(k * a + t) / k. (s, c) is turned by 2a
+ * from one term to the next, and brought back onto the unit circle every
+ * HARMONICS_RENORM terms so that the rounding errors of the rotations do
+ * not grow with taylor.
+ */
+double series_harmonics(double a, double t, int taylor)
+{
+    double s = sin(a + t), c = cos(a + t);
+    double s2 = sin(2 * a), c2 = cos(2 * a);
+    double val = 0.0, tmp, norm;
+    int k;
+
+    for (k = 1; k <= taylor; k += 2) {
+        val += s / k;
+        tmp = s * c2 + c * s2;
+        c = c * c2 - s * s2;
+        s = tmp;
+        /* Un pas de Newton vers 1 / sqrt(s * s + c * c) */
+        if (((k >> 1) % HARMONICS_RENORM) == HARMONICS_RENORM - 1) {
+            norm = 1.5 - 0.5 * (s * s + c * c);
+            s *= norm;
+            c *= norm;
+        }
+    }
+    return val;
+}
+
+/*
+ * Both sums at once, as the direct mode does for every pixel.
+ */
+float series_pixel(const sinoscope_t *sino, int x, int y)
+{
+    float px = sino->dx * y - 2 * M_PI;
+    float py = sino->dy * x - 2 * M_PI;
+    float val = 0.0f;
+    int taylor;
+
+    if (sino->harmonics == HARMONICS_RECURRENCE)
+        return series_harmonics(px * sino->phase1, sino->time, sino->taylor) +
+                series_harmonics(py * sino->phase0, M_PI_2, sino->taylor);
+
+    for (taylor = 1; taylor <= sino->taylor; taylor += 2) {
+        val += sin(px * taylor * sino->phase1 + sino->time) / taylor + cos(py * taylor * sino->phase0) / taylor;
+    }
+    return val;
+}
+
+float series_row(const sinoscope_t *sino, int y)
+{
+    float px = sino->dx * y - 2 * M_PI;
+    double val = 0.0;
+    int taylor;
+
+    if (sino->harmonics == HARMONICS_RECURRENCE)
+        return series_harmonics(px * sino->phase1, sino->time, sino->taylor);
+    for (taylor = 1; taylor <= sino->taylor; taylor += 2)
+        val += sin(px * taylor * sino->phase1 + sino->time) / taylor;
+    return val;
+}
+
+float series_col(const sinoscope_t *sino, int x)
+{
+    float py = sino->dy * x - 2 * M_PI;
+    double val = 0.0;
+    int taylor;
+
+    if (sino->harmonics == HARMONICS_RECURRENCE)
+        return series_harmonics(py * sino->phase0, M_PI_2, sino->taylor);
+    for (taylor = 1; taylor <= sino->taylor; taylor += 2)
+        val += cos(py * taylor * sino->phase0) / taylor;
+    return val;
+}
@@ -0,0 +1,59 @@
+/*
+ * series.h
+ *
+ * Odd harmonics of the sinoscope. The value of the pixel (x, y) is
+ *
+ *   sum over odd k <= taylor of sin(k * px * phase1 + time) / k
+ *                             + cos(k * py * phase0) / k
+ *
+ * where px only depends on the row y and py on the column x. In the
+ * separable mode, the first sum is computed once per row in
+ * series[0, height[ and the second once per column in
+ * series[height, height + width[, and a pixel only adds the two.
+ *
+ * The terms of a sum are the sines of k * a + t for odd k, so with the
+ * recurrence harmonics, the term k + 2 is the term k turned by 2a and a
+ * sum costs four libm calls instead of taylor.
+ */
+
+#ifndef SERIES_H_
+#define SERIES_H_
+
+#include <math.h>
+
+#include "sinoscope.h"
+#include "color.h"
+
+#define HARMONICS_RENORM 16
+
+double series_harmonics(double a, double t, int taylor);
+float series_pixel(const sinoscope_t *sino, int x, int y);
+float series_row(const sinoscope_t *sino, int y);
+float series_col(const sinoscope_t *sino, int x);
+
+static inline float *series_rows(const sinoscope_t *sino)
+{
+    return sino->series;
+}
+
+static inline float *series_cols(const sinoscope_t *sino)
+{
+    return sino->series + sino->height;
+}
+
+/*
+ * Colour of the sum val, written in the three bytes at buf.
+ */
+static inline void series_color(unsigned char *buf, float val, int interval, float interval_inv)
+{
+    struct rgb c;
+
+    val = (atan(1.0 * val) - atan(-1.0 * val)) / (M_PI);
+    val = (val + 1) * 100;
+    value_color(&c, val, interval, interval_inv);
+    buf[0] = c.r;
+    buf[1] = c.g;
+    buf[2] = c.b;
+}
+
+#endif /* SERIES_H_ */
@@ -27,7 +27,9 @@
 #include "sinoscope_openmp.h"
 #include "sinoscope_opencl.h"
 #include "sinoscope_serial.h"
+#include "sinoscope_simd.h"
 #include "color.h"
+#include "series.h"
 #include "memory.h"
 #include "util.h"
 
@@ -37,13 +39,27 @@
 #define DEFAULT_WIDTH 	512
 #define DEFAULT_LIB_NAME "serial"
 #define DEFAULT_CMD_NAME "gui"
+#define DEFAULT_MODE_NAME "separable"
+#define DEFAULT_HARMONICS_NAME "recurrence"
 #define DEFAULT_IMG_PATH "sinoscope.ppm"
 #define DEFAULT_TAYLOR 3
 #define DEFAULT_ITER 10
+#define DEFAULT_FRAMES 2
 #define TITLE "inf8601-lab2"
 #define FPS_DELAY 3000
 #define BYTE_PER_PIX 3
 #define MICROSECONDS 1000000
+#define CHECK_FRAMES 4
+#define CHECK_STEP 1.7
+#define CHECK_TOLERANCE 0.001
+/*
+ * -cl-fast-relaxed-math lets sin and cos be off by 2^-11, which moves
+ * 1.4% to 1.6% of the pixels from 200x200 to 512x512 (0.04% at 2^-16).
+ * This is the bound of the specification, emulated on the host: the
+ * count of a real device, printed by --cmd check, should replace it.
+ */
+#define CHECK_TOLERANCE_OPENCL 0.02
+#define CHECK_HARMONICS_ERROR 1e-6
 
 static int win_x, win_y, win_id;
 static sinoscope_t *global_bl = NULL;
@@ -66,34 +82,75 @@ enum thread_lib {
 	LIB_SERIAL,
 	LIB_OPENMP,
 	LIB_OPENCL,
+	LIB_SIMD,
 };
 
 struct command_opts {
 	const struct command_def *cmd;
 	const struct lib_def *lib;
+	const struct mode_def *mode;
+	const struct harmonics_def *harmonics;
+	char *simd;
 	char *ppm_path;
 	int enable_output;
 	int height;
 	int width;
 	int taylor;
 	int iter;
+	int frames;
 	int verbose;
 };
 
 typedef int (*sinoscope_handler)(sinoscope_t *);
 
+/*
+ * A pipelined library may return from handler before the image is in
+ * buf: sync, when it is not NULL, waits for the images in flight.
+ * tolerance is the fraction of pixels that --cmd check lets differ from
+ * the serial backend.
+ */
 struct lib_def {
 	const char *name;
 	enum thread_lib type;
 	sinoscope_handler handler;
+	sinoscope_handler sync;
+	double tolerance;
+};
+
+struct mode_def {
+	const char *name;
+	enum sinoscope_mode mode;
+};
+
+struct harmonics_def {
+	const char *name;
+	enum sinoscope_harmonics harmonics;
 };
 
 static struct command_opts *global_opts = NULL;
 
 static const struct lib_def libs[] = {
-		{ .name = "serial", .type = LIB_SERIAL, .handler = sinoscope_image_serial },
-		{ .name = "openmp", .type = LIB_OPENMP, .handler = sinoscope_image_openmp },
-		{ .name = "opencl", .type = LIB_OPENCL, .handler = sinoscope_image_opencl },
+		{ .name = "serial", .type = LIB_SERIAL, .handler = sinoscope_image_serial,
+				.tolerance = CHECK_TOLERANCE },
+		{ .name = "openmp", .type = LIB_OPENMP, .handler = sinoscope_image_openmp,
+				.tolerance = CHECK_TOLERANCE },
+		{ .name = "opencl", .type = LIB_OPENCL, .handler = sinoscope_image_opencl,
+				.sync = opencl_drain, .tolerance = CHECK_TOLERANCE_OPENCL },
+		{ .name = "simd", .type = LIB_SIMD, .handler = sinoscope_image_simd,
+				.tolerance = CHECK_TOLERANCE },
+		{ .name = NULL, .type = LIB_NONE, .handler = NULL },
+};
+
+static const struct mode_def modes[] = {
+		{ .name = "direct", .mode = SINOSCOPE_DIRECT },
+		{ .name = "separable", .mode = SINOSCOPE_SEPARABLE },
+		{ .name = NULL },
+};
+
+static const struct harmonics_def harmonics[] = {
+		{ .name = "libm", .harmonics = HARMONICS_LIBM },
+		{ .name = "recurrence", .harmonics = HARMONICS_RECURRENCE },
+		{ .name = NULL },
 };
 
 typedef int (*cmd_handler)(struct command_opts*);
@@ -110,14 +167,24 @@ static void usage(void)
 	fprintf(stderr, "Usage: " PROGNAME " [OPTIONS] [COMMAND]\n");
 	fprintf(stderr, "\nOptions:\n");
 	fprintf(stderr, "  --help	this help\n");
-	fprintf(stderr, "  --cmd		command [ gui | benchmark | image ]\n");
+	fprintf(stderr, "  --cmd		command [ gui | benchmark | image | check ]\n");
 	fprintf(stderr, "  --lib		set the threading library to use "\
-			"[ serial | openmp | opencl ]\n");
+			"[ serial | openmp | opencl | simd ]\n");
+	fprintf(stderr, "  --simd	instruction set of the simd library "\
+			"[ auto | avx512 | avx2 | sse ]\n");
+	fprintf(stderr, "  --mode	sum the harmonics per pixel or per row and column "\
+			"[ direct | separable ]\n");
+	fprintf(stderr, "  --harmonics	compute each term with libm or from the previous one "\
+			"[ libm | recurrence ]\n");
 	fprintf(stderr, "  --output set image path output\n");
 	fprintf(stderr, "  --height	set height\n");
 	fprintf(stderr, "  --width	set width\n");
 	fprintf(stderr, "  --taylor	set taylor series terms\n");
 	fprintf(stderr, "  --iter 	set number of benchmark iterations\n");
+	fprintf(stderr, "  --frames	set number of opencl frames in flight\n");
+	fprintf(stderr, "\nEnvironment:\n");
+	fprintf(stderr, "  SINOSCOPE_OPENCL_CACHE	file of the tuned opencl local sizes "\
+			"[ ~/.sinoscope-opencl ]\n");
 	fprintf(stderr, "\n");
 	exit(EXIT_FAILURE);
 }
@@ -133,8 +200,13 @@ static int init_lib(struct command_opts *opts)
 	case LIB_OPENMP:
 		break;
 	case LIB_OPENCL:
-		ret = opencl_init(opts->width, opts->height);
+		ret = opencl_init(opts->width, opts->height, opts->taylor, opts->frames);
 		ERR_THROW(0, ret, "init_data error");
+		break;
+	case LIB_SIMD:
+		ret = simd_init(opts->simd);
+		ERR_THROW(0, ret, "simd_init error");
+		break;
 	default:
 		break;
 	}
@@ -151,6 +223,7 @@ static int close_lib(struct command_opts *opts)
 	switch (opts->lib->type) {
 	case LIB_SERIAL:
 	case LIB_OPENMP:
+	case LIB_SIMD:
 		break;
 	case LIB_OPENCL:
 		opencl_shutdown();
@@ -166,6 +239,8 @@ static int cmd_gui(struct command_opts *opts)
 
 	ret = init_data(opts->width, opts->height, opts->taylor);
 	ERR_THROW(0, ret, "init_data error");
+	global_bl->mode = opts->mode->mode;
+	global_bl->harmonics = opts->harmonics->harmonics;
 
 	init_lib(opts);
 	ERR_THROW(0, ret, "init_lib error");
@@ -209,7 +284,8 @@ void write_stats(FILE *f, struct stats *s)
 			s->elapsed.tv_sec, s->elapsed.tv_usec);
 }
 
-int run_benchmark(struct stats *s, sinoscope_t *sinoscope, sinoscope_handler handler, int iter)
+int run_benchmark(struct stats *s, sinoscope_t *sinoscope, sinoscope_handler handler,
+		sinoscope_handler sync, int iter)
 {
 	int ret = 0;
 	int i;
@@ -227,6 +303,8 @@ int run_benchmark(struct stats *s, sinoscope_t *sinoscope, sinoscope_handler han
 		fflush(stdout);
 		handler(sinoscope);
 	}
+	if (sync != NULL)
+		sync(sinoscope);
 	printf("%-10s %3.0f %%\n", sinoscope->name, 100.0);
 
 	if (getrusage(RUSAGE_SELF, &r2) < 0) {
@@ -261,33 +339,43 @@ static int cmd_benchmark(struct command_opts *opts)
 
 	b = make_sinoscope(opts->width, opts->height, opts->taylor, amp);
 	ERR_NOMEM(b);
+	b->mode = opts->mode->mode;
+	b->harmonics = opts->harmonics->harmonics;
 
 	/* serial */
 	b->name = "serial";
 	write_stats_info(f, b->name, opts->width, opts->height, opts->iter);
-	run_benchmark(&stats, b, sinoscope_image_serial, opts->iter);
+	run_benchmark(&stats, b, sinoscope_image_serial, NULL, opts->iter);
 	write_stats(f, &stats);
 
 	/* openmp 1 thread */
 	b->name = "openmp_1";
 	omp_set_num_threads(1);
 	write_stats_info(f, b->name, opts->width, opts->height, opts->iter);
-	run_benchmark(&stats, b, sinoscope_image_openmp, opts->iter);
+	run_benchmark(&stats, b, sinoscope_image_openmp, NULL, opts->iter);
 	write_stats(f, &stats);
 
 	/* openmp 8 threads */
 	b->name = "openmp_8";
 	omp_set_num_threads(8);
 	write_stats_info(f, b->name, opts->width, opts->height, opts->iter);
-	run_benchmark(&stats, b, sinoscope_image_openmp, opts->iter);
+	run_benchmark(&stats, b, sinoscope_image_openmp, NULL, opts->iter);
+	write_stats(f, &stats);
+
+	/* simd 8 threads */
+	b->name = "simd_8";
+	ret = simd_init(opts->simd);
+	ERR_THROW(0, ret, "simd_init failed");
+	write_stats_info(f, b->name, opts->width, opts->height, opts->iter);
+	run_benchmark(&stats, b, sinoscope_image_simd, NULL, opts->iter);
 	write_stats(f, &stats);
 
 	/* opencl */
 	b->name = "opencl";
-	ret = opencl_init(opts->width, opts->height);
+	ret = opencl_init(opts->width, opts->height, opts->taylor, opts->frames);
 	ERR_THROW(0, ret, "opencl_init failed");
 	write_stats_info(f, b->name, opts->width, opts->height, opts->iter);
-	run_benchmark(&stats, b, sinoscope_image_opencl, opts->iter);
+	run_benchmark(&stats, b, sinoscope_image_opencl, opencl_drain, opts->iter);
 	write_stats(f, &stats);
 	opencl_shutdown();
 	ERR_THROW(0, ret, "opencl_shutdown failed");
@@ -315,8 +403,14 @@ static int cmd_image(struct command_opts *opts)
 
 	s = make_sinoscope(opts->width, opts->height, opts->taylor, amp);
 	ERR_NOMEM(s);
+	s->mode = opts->mode->mode;
+	s->harmonics = opts->harmonics->harmonics;
 	ret = opts->lib->handler(s);
 	ERR_THROW(0, ret, "handler returned error");
+	if (opts->lib->sync != NULL) {
+		ret = opts->lib->sync(s);
+		ERR_THROW(0, ret, "sync returned error");
+	}
 	ret = save_image_uchar(opts->ppm_path, s->buf, s->width, s->height);
 	ERR_THROW(0, ret, "save image failed");
 done:
@@ -328,12 +422,183 @@ error:
 	goto done;
 }
 
+/*
+ * Number of pixels whose colour differs between a and b. The border is
+ * not compared, since the backends do not all write it.
+ */
+static int cmp_image(sinoscope_t *a, sinoscope_t *b)
+{
+	int x, y, index, diff = 0;
+
+	for (x = 1; x < a->width - 1; x++) {
+		for (y = 1; y < a->height - 1; y++) {
+			index = (y * 3) + (x * 3) * a->width;
+			if (memcmp(a->buf + index, b->buf + index, 3) != 0)
+				diff++;
+		}
+	}
+	return diff;
+}
+
+/*
+ * Sums of the row y and of the column x with libm on the exact angles,
+ * where the libm harmonics round k * px * phase1 to a float.
+ */
+static void exact_sums(sinoscope_t *s, int x, int y, double *row, double *col)
+{
+	float px = s->dx * y - 2 * M_PI;
+	float py = s->dy * x - 2 * M_PI;
+	int k;
+
+	*row = 0.0;
+	*col = 0.0;
+	for (k = 1; k <= s->taylor; k += 2) {
+		*row += sin((double) k * (px * s->phase1) + s->time) / k;
+		*col += cos((double) k * (py * s->phase0)) / k;
+	}
+}
+
+/*
+ * Largest error of the sums of the rows and columns with libm and with
+ * the recurrence, against exact_sums().
+ */
+static int check_harmonics(struct command_opts *opts)
+{
+	int ret = 0;
+	int i, frame;
+	double row, col, err[2] = { 0.0, 0.0 };
+	sinoscope_t *s = NULL;
+
+	s = make_sinoscope(opts->width, opts->height, opts->taylor, amp);
+	ERR_NOMEM(s);
+
+	for (frame = 0; frame < CHECK_FRAMES; frame++) {
+		s->time = frame * CHECK_STEP;
+		sinoscope_corners(s);
+		for (i = 0; i < opts->width || i < opts->height; i++) {
+			exact_sums(s, i, i, &row, &col);
+			s->harmonics = HARMONICS_LIBM;
+			err[0] = fmax(err[0], fabs(series_row(s, i) - row));
+			err[0] = fmax(err[0], fabs(series_col(s, i) - col));
+			s->harmonics = HARMONICS_RECURRENCE;
+			err[1] = fmax(err[1], fabs(series_row(s, i) - row));
+			err[1] = fmax(err[1], fabs(series_col(s, i) - col));
+		}
+	}
+	ret = err[1] > CHECK_HARMONICS_ERROR ? -1 : 0;
+	printf("%s harmonics taylor=%d libm_error=%g recurrence_error=%g\n",
+			ret == 0 ? "PASS" : "FAIL", opts->taylor, err[0], err[1]);
+
+done:
+	free_sinoscope(s);
+	return ret;
+error:
+	ret = -1;
+	goto done;
+}
+
+/*
+ * Compare the backend lib in every mode and harmonics to the serial
+ * backend with the same ones over a few frames, the error of the sums
+ * being bounded by check_harmonics(). The simd sines are not libm's, so
+ * a few pixels may fall on the other side of a colour step.
+ */
+static int check_lib(const char *name, const struct lib_def *lib,
+		sinoscope_t *ref, sinoscope_t *s)
+{
+	int ret = 0;
+	int m, h, frame, diff;
+	int pixels = CHECK_FRAMES * (s->width - 2) * (s->height - 2);
+
+	for (m = 0; modes[m].name != NULL; m++) {
+		for (h = 0; harmonics[h].name != NULL; h++) {
+			ref->mode = s->mode = modes[m].mode;
+			ref->harmonics = s->harmonics = harmonics[h].harmonics;
+			diff = 0;
+			for (frame = 0; frame < CHECK_FRAMES; frame++) {
+				ref->time = s->time = frame * CHECK_STEP;
+				sinoscope_corners(ref);
+				sinoscope_corners(s);
+				memset(ref->buf, 0, ref->buf_size);
+				memset(s->buf, 0, s->buf_size);
+				if (sinoscope_image_serial(ref) < 0 || lib->handler(s) < 0 ||
+						(lib->sync != NULL && lib->sync(s) < 0)) {
+					diff = pixels;
+					break;
+				}
+				diff += cmp_image(ref, s);
+			}
+			if (diff > lib->tolerance * pixels) {
+				printf("FAIL %s %s %s diff=%d/%d\n", name, modes[m].name,
+						harmonics[h].name, diff, pixels);
+				ret = -1;
+			} else {
+				printf("PASS %s %s %s diff=%d/%d\n", name, modes[m].name,
+						harmonics[h].name, diff, pixels);
+			}
+		}
+	}
+	return ret;
+}
+
+/*
+ * Every backend, and the simd one on every instruction set of the
+ * processor.
+ */
+static int cmd_check(struct command_opts *opts)
+{
+	int ret = 0;
+	int i, j;
+	char name[64];
+	sinoscope_t *ref = NULL, *s = NULL;
+	struct command_opts lib_opts = *opts;
+
+	ref = make_sinoscope(opts->width, opts->height, opts->taylor, amp);
+	ERR_NOMEM(ref);
+	s = make_sinoscope(opts->width, opts->height, opts->taylor, amp);
+	ERR_NOMEM(s);
+
+	for (i = 0; libs[i].name != NULL; i++) {
+		lib_opts.lib = &libs[i];
+		if (init_lib(&lib_opts) < 0) {
+			printf("SKIP %s\n", libs[i].name);
+			continue;
+		}
+		if (libs[i].type != LIB_SIMD) {
+			ret |= check_lib(libs[i].name, &libs[i], ref, s);
+		} else {
+			for (j = 0; simd_isa(j) != NULL; j++) {
+				snprintf(name, sizeof(name), "%s-%s", libs[i].name, simd_isa(j));
+				if (simd_init(simd_isa(j)) < 0) {
+					printf("SKIP %s\n", name);
+					continue;
+				}
+				ret |= check_lib(name, &libs[i], ref, s);
+			}
+		}
+		close_lib(&lib_opts);
+	}
+
+	if (check_harmonics(opts) < 0)
+		ret = -1;
+
+done:
+	free_sinoscope(ref);
+	free_sinoscope(s);
+	return ret;
+error:
+	ret = -1;
+	goto done;
+}
+
 static const struct command_def cmd_gui_def =
 { .name = "gui", .handler = cmd_gui };
 static const struct command_def cmd_benchmark_def =
 { .name = "benchmark", .handler = cmd_benchmark };
 static const struct command_def cmd_image_def =
 { .name = "image", .handler = cmd_image };
+static const struct command_def cmd_check_def =
+{ .name = "check", .handler = cmd_check };
 static const struct command_def cmd_def_last =
 { .name = NULL, .handler = NULL };
 
@@ -341,6 +606,7 @@ static const struct command_def * const commands[] = {
 		&cmd_gui_def,
 		&cmd_benchmark_def,
 		&cmd_image_def,
+		&cmd_check_def,
 		&cmd_def_last
 };
 
@@ -364,16 +630,39 @@ static const struct lib_def *lookup_lib(const char *name)
 	return NULL;
 }
 
+static const struct mode_def *lookup_mode(const char *name)
+{
+	int i;
+	for (i = 0; modes[i].name != NULL; i++) {
+		if (strcmp(modes[i].name, name) == 0)
+			return &modes[i];
+	}
+	return NULL;
+}
+
+static const struct harmonics_def *lookup_harmonics(const char *name)
+{
+	int i;
+	for (i = 0; harmonics[i].name != NULL; i++) {
+		if (strcmp(harmonics[i].name, name) == 0)
+			return &harmonics[i];
+	}
+	return NULL;
+}
+
 static void dump_opts(struct command_opts *opts)
 {
 	printf("%10s %s\n", "option", "value");
 	printf("%10s %s\n", "cmd", opts->cmd->name);
 	printf("%10s %s\n", "lib", opts->lib->name);
+	printf("%10s %s\n", "mode", opts->mode->name);
+	printf("%10s %s\n", "harmonics", opts->harmonics->name);
 	printf("%10s %s\n", "output", opts->ppm_path);
 	printf("%10s %d\n", "width", opts->width);
 	printf("%10s %d\n", "height", opts->height);
 	printf("%10s %d\n", "taylor", opts->taylor);
 	printf("%10s %d\n", "iter", opts->iter);
+	printf("%10s %d\n", "frames", opts->frames);
 }
 
 void default_int_value(int *val, int def)
@@ -393,10 +682,14 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 			{ "cmd",	 1, 0, 'c' },
 			{ "output",	 1, 0, 'o' },
 			{ "lib",	 1, 0, 'l' },
+			{ "mode",	 1, 0, 'm' },
+			{ "harmonics", 1, 0, 'k' },
+			{ "simd",	 1, 0, 's' },
 			{ "height",	 1, 0, 'y' },
 			{ "width",	 1, 0, 'x' },
 			{ "taylor",	 1, 0, 't' },
 			{ "iter",	 1, 0, 'i' },
+			{ "frames",	 1, 0, 'f' },
 			{ "verbose", 0, 0, 'v' },
 			{ 0, 0, 0, 0}
 	};
@@ -406,8 +699,9 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 	opts->width = DEFAULT_WIDTH;
 	opts->taylor = DEFAULT_TAYLOR;
 	opts->iter = DEFAULT_ITER;
+	opts->frames = DEFAULT_FRAMES;
 
-	while ((opt = getopt_long(argc, argv, "hvx:y:c:l:o:t:i:", options, &idx)) != -1) {
+	while ((opt = getopt_long(argc, argv, "hvx:y:c:l:m:k:s:o:t:i:f:", options, &idx)) != -1) {
 		switch(opt) {
 		case 'c':
 			opts->cmd = lookup_cmd(optarg);
@@ -419,6 +713,24 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 				ret = -1;
 			}
 			break;
+		case 'm':
+			opts->mode = lookup_mode(optarg);
+			if (opts->mode == NULL) {
+				printf("unknown mode %s\n", optarg);
+				ret = -1;
+			}
+			break;
+		case 'k':
+			opts->harmonics = lookup_harmonics(optarg);
+			if (opts->harmonics == NULL) {
+				printf("unknown harmonics %s\n", optarg);
+				ret = -1;
+			}
+			break;
+		case 's':
+			if (asprintf(&opts->simd, "%s", optarg) < 0)
+				goto err;
+			break;
 		case 'o':
 			if (asprintf(&opts->ppm_path, "%s", optarg) < 0)
 				goto err;
@@ -435,6 +747,9 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 		case 'i':
 			opts->iter = atoi(optarg);
 			break;
+		case 'f':
+			opts->frames = atoi(optarg);
+			break;
 		case 'h':
 			usage();
 			break;
@@ -455,6 +770,12 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 	if (opts->cmd == NULL)
 		opts->cmd = lookup_cmd(DEFAULT_CMD_NAME);
 
+	if (opts->mode == NULL)
+		opts->mode = lookup_mode(DEFAULT_MODE_NAME);
+
+	if (opts->harmonics == NULL)
+		opts->harmonics = lookup_harmonics(DEFAULT_HARMONICS_NAME);
+
 	if (opts->ppm_path == NULL)
 		opts->ppm_path = DEFAULT_IMG_PATH;
 
@@ -483,12 +804,17 @@ sinoscope_t *make_sinoscope(int width, int height, int taylor, float max)
 	b->buf = malloc(b->buf_size);
 	if (b->buf == NULL)
 		return NULL;
+	b->series = calloc(width + height, sizeof(float));
+	if (b->series == NULL)
+		return NULL;
 	b->width = width;
 	b->height = height;
 	b->max = max;
 	b->interval = get_color_interval(max);
 	b->interval_inv = get_color_interval_inv(max);
 	b->taylor = taylor;
+	b->mode = SINOSCOPE_SEPARABLE;
+	b->harmonics = HARMONICS_RECURRENCE;
 	b->dx = 3 * M_PI / width;
 	b->dy = 3 * M_PI / height;
 	return b;
@@ -496,8 +822,10 @@ sinoscope_t *make_sinoscope(int width, int height, int taylor, float max)
 
 void free_sinoscope(sinoscope_t *b)
 {
-	if (b != NULL)
+	if (b != NULL) {
 		FREE(b->buf);
+		FREE(b->series);
+	}
 	FREE(b);
 }
 
@@ -625,6 +953,11 @@ void key_func(unsigned char key, int x, int y)
 		global_opts->lib = lookup_lib("opencl");
 		init_lib(global_opts);
 		break;
+	case '4':
+		close_lib(global_opts);
+		global_opts->lib = lookup_lib("simd");
+		init_lib(global_opts);
+		break;
 	case ' ':
 		enable_display = !enable_display;
 		break;
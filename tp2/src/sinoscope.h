@@ -10,14 +10,34 @@
 
 typedef struct sinoscope sinoscope_t;
 
+/*
+ * The direct mode sums the harmonics at every pixel, the separable mode
+ * once per row and once per column (see series.h).
+ */
+enum sinoscope_mode {
+    SINOSCOPE_DIRECT,
+    SINOSCOPE_SEPARABLE,
+};
+
+/*
+ * Terms of the sums computed by libm, or by rotating the previous term.
+ */
+enum sinoscope_harmonics {
+    HARMONICS_LIBM,
+    HARMONICS_RECURRENCE,
+};
+
 struct sinoscope {
     unsigned char *buf;
+    float *series;
     char *name;
     int buf_size;
     int width;
     int height;
     int interval;
     int taylor;
+    int mode;
+    int harmonics;
     float interval_inv;
     float time;
     float max;
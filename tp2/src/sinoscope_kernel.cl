@@ -17,6 +17,17 @@
 #define M_PI 3.14159265358979323846264338328
 #endif
 
+#define HARMONICS_RENORM 16
+
+/*
+ * KERNEL_PIXELS, the consecutive pixels of a column written by a
+ * work-item of the image kernels, is given by sinoscope_opencl.cpp in
+ * the build options.
+ */
+#ifndef KERNEL_PIXELS
+#error "KERNEL_PIXELS must be defined by the build options"
+#endif
+
 typedef struct sinoscope sinoscope_t;
 
 struct sinoscope {
@@ -87,28 +98,142 @@ void value_color(struct rgb *color, float value, int interval, float interval_in
 }
 
 
-__kernel void sinoscope_kernel(__global unsigned char* buf, const int width, const int interval, const int taylor, const float interval_inv, const float time, const float phase0, const float phase1, const float dx, const float dy)
+/*
+ * Sum over odd k <= taylor of sin(k * a + t) / k, each term being the
+ * previous one turned by 2a, as series_harmonics() of series.c. In float, the
+ * renormalisation keeps (s, c) on the unit circle.
+ */
+float series_harmonics(float a, float t, int taylor)
 {
-	const int x = get_global_id(0);
-	const int y = get_global_id(1);
-    
+	float s = sin(a + t), c = cos(a + t);
+	float s2 = sin(2 * a), c2 = cos(2 * a);
+	float val = 0.0f, tmp, norm;
+
+	for (int k = 1; k <= taylor; k += 2) {
+		val += s / k;
+		tmp = s * c2 + c * s2;
+		c = c * c2 - s * s2;
+		s = tmp;
+		if (((k >> 1) % HARMONICS_RENORM) == HARMONICS_RENORM - 1) {
+			norm = 1.5f - 0.5f * (s * s + c * c);
+			s *= norm;
+			c *= norm;
+		}
+	}
+	return val;
+}
+
+/*
+ * Colours of the sums val of n <= KERNEL_PIXELS consecutive pixels from
+ * buf. Those of a full group are 12 bytes, written by three uchar4.
+ */
+void store_colors(__global unsigned char *buf, const float *val, int n, int interval, float interval_inv)
+{
+	unsigned char rgb[3 * KERNEL_PIXELS];
 	struct rgb c;
-	
-	float px = dx * y - 2 * M_PI;
+	float v;
+
+	for (int i = 0; i < KERNEL_PIXELS; i++) {
+		v = (atan(1.0 * val[i]) - atan(-1.0 * val[i])) / (M_PI);
+		v = (v + 1) * 100;
+		value_color(&c, v, interval, interval_inv);
+		rgb[3 * i + 0] = c.r;
+		rgb[3 * i + 1] = c.g;
+		rgb[3 * i + 2] = c.b;
+	}
+	if (n == KERNEL_PIXELS) {
+		for (int i = 0; i < 3; i++)
+			vstore4(vload4(i, rgb), i, buf);
+	} else {
+		for (int i = 0; i < 3 * n; i++)
+			buf[i] = rgb[i];
+	}
+}
+
+/*
+ * The pixels of a column x are consecutive in buf, so the dimension 0 of
+ * the image kernels is y, by groups of KERNEL_PIXELS, and the neighbour
+ * work-items write neighbour bytes. The global size may be rounded up to
+ * the local size, hence the bounds.
+ */
+__kernel void sinoscope_kernel(__global unsigned char* buf, const int width, const int height, const int interval, const int taylor, const float interval_inv, const float time, const float phase0, const float phase1, const float dx, const float dy, const int recurrence)
+{
+	const int y = get_global_id(0) * KERNEL_PIXELS;
+	const int x = get_global_id(1);
+	float val[KERNEL_PIXELS];
 	float py = dy * x - 2 * M_PI;
-	float val = 0.0f;
-			
-	for (int tayl = 1; tayl <= taylor; tayl += 2) {
-		val += sin(px * tayl * phase1 + time) / tayl + cos(py * tayl * phase0) / tayl;
+	float col = 0.0f;
+
+	if (x >= width || y >= height)
+		return;
+	int n = min(KERNEL_PIXELS, height - y);
+
+	/* La colonne est commune aux pixels du groupe */
+	if (recurrence) {
+		col = series_harmonics(py * phase0, M_PI / 2, taylor);
+	} else {
+		for (int tayl = 1; tayl <= taylor; tayl += 2)
+			col += cos(py * tayl * phase0) / tayl;
+	}
+
+	for (int i = 0; i < KERNEL_PIXELS; i++) {
+		float px = dx * (y + i) - 2 * M_PI;
+
+		val[i] = col;
+		if (i >= n)
+			continue;
+		if (recurrence) {
+			val[i] += series_harmonics(px * phase1, time, taylor);
+		} else {
+			for (int tayl = 1; tayl <= taylor; tayl += 2)
+				val[i] += sin(px * tayl * phase1 + time) / tayl;
+		}
 	}
-		
-	val = (atan(1.0 * val) - atan(-1.0 * val)) / (M_PI);
-	val = (val + 1) * 100;
-	value_color(&c, val, interval, interval_inv);
+
 	int index = (y * 3) + (x * 3) * width;
-	
-	buf[index + 0] = c.r;
-	buf[index + 1] = c.g;
-	buf[index + 2] = c.b;
+	store_colors(buf + index, val, n, interval, interval_inv);
+}
+
+/*
+ * Sums of the separable mode: the work-item i < height sums the row
+ * y = i, the others the column x = i - height.
+ */
+__kernel void sinoscope_series_kernel(__global float *series, const int height, const int taylor, const float time, const float phase0, const float phase1, const float dx, const float dy, const int recurrence)
+{
+	const int i = get_global_id(0);
+	float val = 0.0f;
+
+	if (i < height) {
+		float px = dx * i - 2 * M_PI;
+		if (recurrence)
+			val = series_harmonics(px * phase1, time, taylor);
+		else
+			for (int tayl = 1; tayl <= taylor; tayl += 2)
+				val += sin(px * tayl * phase1 + time) / tayl;
+	} else {
+		float py = dy * (i - height) - 2 * M_PI;
+		if (recurrence)
+			val = series_harmonics(py * phase0, M_PI / 2, taylor);
+		else
+			for (int tayl = 1; tayl <= taylor; tayl += 2)
+				val += cos(py * tayl * phase0) / tayl;
+	}
+	series[i] = val;
 }
 
+__kernel void sinoscope_separable_kernel(__global unsigned char* buf, __global const float *series, const int width, const int height, const int interval, const float interval_inv)
+{
+	const int y = get_global_id(0) * KERNEL_PIXELS;
+	const int x = get_global_id(1);
+	float val[KERNEL_PIXELS];
+
+	if (x >= width || y >= height)
+		return;
+	int n = min(KERNEL_PIXELS, height - y);
+
+	for (int i = 0; i < KERNEL_PIXELS; i++)
+		val[i] = i < n ? series[y + i] + series[height + x] : 0.0f;
+
+	int index = (y * 3) + (x * 3) * width;
+	store_colors(buf + index, val, n, interval, interval_inv);
+}
@@ -11,6 +11,7 @@ extern "C" {
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/time.h>
 #include "sinoscope.h"
 #include "color.h"
 #include "memory.h"
@@ -24,19 +25,85 @@ using namespace std;
 
 #define BUF_SIZE 1024
 #define MAGIC "!@#~"
+
+/* Pixels d'une colonne par work-item, passé au noyau par -DKERNEL_PIXELS */
+#define KERNEL_PIXELS 4
+
+#define TUNE_ITER 5
+#define TUNE_CACHE_ENV "SINOSCOPE_OPENCL_CACHE"
+#define TUNE_CACHE_NAME ".sinoscope-opencl"
 extern char __ocl_code_start, __ocl_code_end;
 static cl_command_queue queue = NULL;
+static cl_command_queue transfer = NULL;
 static cl_context context = NULL;
+static cl_device_id device = NULL;
 static cl_program prog = NULL;
 static cl_kernel kernel = NULL;
+static cl_kernel series_kernel = NULL;
+static cl_kernel separable_kernel = NULL;
+
+static cl_mem series = NULL;
+
+/*
+ * Frames in flight. The kernels of a frame write its output buffer on
+ * the queue, then its read into the pinned host buffer is chained on the
+ * transfer queue by the event of the kernels, so that the next frame is
+ * computed while this one is read back.
+ */
+struct opencl_frame {
+    cl_mem output;
+    cl_mem pinned;
+    unsigned char *host;
+    cl_event done;
+};
+
+static struct opencl_frame frames[OPENCL_FRAMES_MAX];
+static int nb_frames = 0;
+static int next_frame = 0;
+static int nb_pending = 0;
+static size_t frame_size = 0;
+
+/*
+ * Local sizes tried by the autotuner, in work-items of KERNEL_PIXELS
+ * rows by columns. {0, 0} leaves the choice to the runtime.
+ */
+static const size_t tune_sizes[][2] = {
+        { 0, 0 },
+        { 16, 1 }, { 32, 1 }, { 64, 1 }, { 128, 1 }, { 256, 1 },
+        { 8, 2 }, { 16, 2 }, { 32, 2 }, { 64, 2 }, { 128, 2 },
+        { 8, 4 }, { 16, 4 }, { 32, 4 }, { 64, 4 },
+        { 8, 8 }, { 16, 8 }, { 32, 8 },
+};
+
+typedef int (*run_handler)(sinoscope_t *, cl_mem, const size_t *, cl_event *);
 
-static cl_mem output = NULL;
+static int run_direct(sinoscope_t *ptr, cl_mem output, const size_t *local, cl_event *ev);
+static int run_separable(sinoscope_t *ptr, cl_mem output, const size_t *local, cl_event *ev);
+
+/*
+ * Local size of the image kernel of each mode, in the order of enum
+ * sinoscope_mode, tuned by opencl_init().
+ */
+struct tuning {
+    const char *name;
+    run_handler run;
+    cl_kernel *kernel;
+    size_t local[2];
+};
+
+static struct tuning tunings[] = {
+        { "sinoscope_kernel", run_direct, &kernel, { 0, 0 } },
+        { "sinoscope_separable_kernel", run_separable, &separable_kernel, { 0, 0 } },
+};
+
+static int tune_local_size(sinoscope_t *ptr, cl_mem output, struct tuning *t);
 
 int get_opencl_queue()
 {
-    cl_int ret, i;
+    cl_int ret = CL_DEVICE_NOT_FOUND;
+    cl_uint i, j;
     cl_uint num_dev;
-    cl_device_id device;
+    cl_device_type types[2] = { CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_ALL };
     cl_platform_id *platform_ids = NULL;
     cl_uint num_platforms;
     cl_uint info;
@@ -53,16 +120,21 @@ int get_opencl_queue()
     ret = clGetPlatformIDs(num_platforms, platform_ids, NULL);
     ERR_THROW(CL_SUCCESS, ret, "failed to get plateform ids");
 
-    for (i = 0; i < num_platforms; i++) {
-        ret = clGetPlatformInfo(platform_ids[i], CL_PLATFORM_VENDOR, BUF_SIZE, vendor, NULL);
-        ERR_THROW(CL_SUCCESS, ret, "failed to get plateform info");
-        ret = clGetPlatformInfo(platform_ids[i], CL_PLATFORM_NAME, BUF_SIZE, name, NULL);
-        ERR_THROW(CL_SUCCESS, ret, "failed to get plateform info");
-        cout << vendor << " " << name << "\n";
-        ret = clGetDeviceIDs(platform_ids[i], CL_DEVICE_TYPE_GPU, 1, &device, &num_dev);
-        if (CL_SUCCESS == ret) {
-            break;
+    /* Un GPU de préférence, sinon tout périphérique, comme pocl sur CPU */
+    for (j = 0; j < 2; j++) {
+        for (i = 0; i < num_platforms; i++) {
+            ret = clGetPlatformInfo(platform_ids[i], CL_PLATFORM_VENDOR, BUF_SIZE, vendor, NULL);
+            ERR_THROW(CL_SUCCESS, ret, "failed to get plateform info");
+            ret = clGetPlatformInfo(platform_ids[i], CL_PLATFORM_NAME, BUF_SIZE, name, NULL);
+            ERR_THROW(CL_SUCCESS, ret, "failed to get plateform info");
+            cout << vendor << " " << name << "\n";
+            ret = clGetDeviceIDs(platform_ids[i], types[j], 1, &device, &num_dev);
+            if (CL_SUCCESS == ret) {
+                break;
+            }
         }
+        if (CL_SUCCESS == ret)
+            break;
     }
     ERR_THROW(CL_SUCCESS, ret, "failed to find a device\n");
 
@@ -80,6 +152,9 @@ int get_opencl_queue()
     queue = clCreateCommandQueue(context, device, 0, &ret);
     ERR_THROW(CL_SUCCESS, ret, "failed to create queue");
 
+    transfer = clCreateCommandQueue(context, device, 0, &ret);
+    ERR_THROW(CL_SUCCESS, ret, "failed to create transfer queue");
+
     ret = 0;
 
 done:
@@ -125,17 +200,31 @@ error:
     goto done;
 }
 
+/*
+ * The output buffers are only written by the kernels, so nothing is ever
+ * uploaded. The pinned buffers (CL_MEM_ALLOC_HOST_PTR) stay mapped for
+ * the lifetime of the pipeline, and reads into them are DMA transfers.
+ */
 int create_buffer(int width, int height)
 {
-    /*
-     * TODO: initialiser la memoire requise avec clCreateBuffer()
-     */
     cl_int ret = 0;
-    
-    size_t buffSize = width * height * 3 * sizeof(unsigned char);
+    int i;
+
+    frame_size = width * height * 3 * sizeof(unsigned char);
+
+    for (i = 0; i < nb_frames; i++) {
+        frames[i].output = clCreateBuffer(context, CL_MEM_WRITE_ONLY, frame_size, NULL, &ret);
+        ERR_THROW(CL_SUCCESS, ret, "failed to create buffer");
+        frames[i].pinned = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, frame_size, NULL, &ret);
+        ERR_THROW(CL_SUCCESS, ret, "failed to create pinned buffer");
+        frames[i].host = (unsigned char *) clEnqueueMapBuffer(transfer, frames[i].pinned, CL_TRUE,
+                CL_MAP_READ | CL_MAP_WRITE, 0, frame_size, 0, NULL, NULL, &ret);
+        ERR_THROW(CL_SUCCESS, ret, "failed to map pinned buffer");
+    }
 
-    output = clCreateBuffer(context, CL_MEM_WRITE_ONLY, buffSize, NULL, &ret);
-	ERR_THROW(CL_SUCCESS, ret, "failed to create buffer");
+    /* Sommes des rangées puis des colonnes du mode séparable */
+    series = clCreateBuffer(context, CL_MEM_READ_WRITE, (width + height) * sizeof(float), NULL, &ret);
+    ERR_THROW(CL_SUCCESS, ret, "failed to create series buffer");
     
 done:
     return ret;
@@ -144,109 +233,388 @@ error:
     goto done;
 }
 
-int opencl_init(int width, int height)
+/*
+ * The local sizes are tuned here on an image of width by height with
+ * taylor terms, so that the frames timed or shown never wait for it.
+ */
+int opencl_init(int width, int height, int taylor, int depth)
 {
     cl_int err;
     char *code = NULL;
+    char options[64];
     size_t length = 0;
+    sinoscope_t *ptr = NULL;
+    int i;
 
-    get_opencl_queue();
-    if (queue == NULL)
+    if (depth < 1 || depth > OPENCL_FRAMES_MAX) {
+        fprintf(stderr, "opencl: %d frames in flight, expected 1 to %d\n", depth, OPENCL_FRAMES_MAX);
         return -1;
+    }
+    nb_frames = depth;
+    next_frame = 0;
+    nb_pending = 0;
+
+    get_opencl_queue();
+    if (queue == NULL || transfer == NULL)
+        goto error;
     load_kernel_code(&code, &length);
     if (code == NULL)
-        return -1;
+        goto error;
 
     /*
      * Initialisation du programme
      */
     prog = clCreateProgramWithSource(context, 1, (const char **) &code, &length, &err);
     ERR_THROW(CL_SUCCESS, err, "clCreateProgramWithSource failed");
-    err = clBuildProgram(prog, 0, NULL, "-cl-fast-relaxed-math", NULL, NULL);
+    snprintf(options, sizeof(options), "-cl-fast-relaxed-math -DKERNEL_PIXELS=%d", KERNEL_PIXELS);
+    err = clBuildProgram(prog, 0, NULL, options, NULL, NULL);
     ERR_THROW(CL_SUCCESS, err, "clBuildProgram failed");
     kernel = clCreateKernel(prog, "sinoscope_kernel", &err);
     ERR_THROW(CL_SUCCESS, err, "clCreateKernel failed");
+    series_kernel = clCreateKernel(prog, "sinoscope_series_kernel", &err);
+    ERR_THROW(CL_SUCCESS, err, "clCreateKernel failed");
+    separable_kernel = clCreateKernel(prog, "sinoscope_separable_kernel", &err);
+    ERR_THROW(CL_SUCCESS, err, "clCreateKernel failed");
     err = create_buffer(width, height);
     ERR_THROW(CL_SUCCESS, err, "create_buffer failed");
 
+    /* Seules la taille et taylor comptent pour le temps, pas les couleurs */
+    ptr = make_sinoscope(width, height, taylor, 0);
+    ERR_NOMEM(ptr);
+    sinoscope_corners(ptr);
+    for (i = 0; i < (int) (sizeof(tunings) / sizeof(tunings[0])); i++) {
+        err = tune_local_size(ptr, frames[0].output, &tunings[i]);
+        ERR_THROW(0, err, "tune_local_size failed");
+    }
+
+    free_sinoscope(ptr);
     free(code);
     return 0;
 error:
+    free_sinoscope(ptr);
+    FREE(code);
+    opencl_shutdown();
     return -1;
 }
 
 
 void opencl_shutdown()
 {
-    if (queue) 	clReleaseCommandQueue(queue);
-    if (context)	clReleaseContext(context);
+    int i;
+
+    /* Les lectures en vol écrivent encore dans les tampons épinglés */
+    if (queue) clFinish(queue);
+    if (transfer) clFinish(transfer);
+    for (i = 0; i < OPENCL_FRAMES_MAX; i++) {
+        if (frames[i].done) clReleaseEvent(frames[i].done);
+        if (frames[i].host) clEnqueueUnmapMemObject(transfer, frames[i].pinned, frames[i].host, 0, NULL, NULL);
+        if (transfer) clFinish(transfer);
+        if (frames[i].pinned) clReleaseMemObject(frames[i].pinned);
+        if (frames[i].output) clReleaseMemObject(frames[i].output);
+    }
+    memset(frames, 0, sizeof(frames));
+    nb_frames = 0;
+    next_frame = 0;
+    nb_pending = 0;
 
-    /*
-     * TODO: liberer les ressources allouees
-     */
     if (prog)   clReleaseProgram(prog);
     if (kernel) clReleaseKernel(kernel);
-	if (output) clReleaseMemObject(output);
+    if (series_kernel) clReleaseKernel(series_kernel);
+    if (separable_kernel) clReleaseKernel(separable_kernel);
+    if (series) clReleaseMemObject(series);
+    if (transfer) clReleaseCommandQueue(transfer);
+    if (queue) 	clReleaseCommandQueue(queue);
+    if (context)	clReleaseContext(context);
+    queue = NULL;
+    transfer = NULL;
+    context = NULL;
+    device = NULL;
+    prog = NULL;
+    kernel = NULL;
+    series_kernel = NULL;
+    separable_kernel = NULL;
+    series = NULL;
 }
 
-int sinoscope_image_opencl(sinoscope_t *ptr)
+/*
+ * Global size of the image kernels: the rows by groups of KERNEL_PIXELS,
+ * then the columns, rounded up to the local size when there is one.
+ */
+static void image_range(sinoscope_t *ptr, const size_t *local, size_t *global)
 {
-    //TODO("sinoscope_image_opencl");
-    /*
-     * TODO: Executer le noyau avec la fonction run_kernel().
-     *
-     *       1. Passer les arguments au noyau avec clSetKernelArg(). Si des
-     *          arguments sont passees par un tampon, copier les valeurs avec
-     *          clEnqueueWriteBuffer() de maniere synchrone.
-     *
-     *       2. Appeller le noyau avec clEnqueueNDRangeKernel(). L'argument
-     *          work_dim de clEnqueueNDRangeKernel() est un tableau size_t
-     *          avec les dimensions width et height.
-     *
-     *       3. Attendre que le noyau termine avec clFinish()
-     *
-     *       4. Copier le resultat dans la structure sinoscope_t avec
-     *          clEnqueueReadBuffer() de maniere synchrone
-     *
-     *       Utilisez ERR_THROW partout pour gerer systematiquement les exceptions
-     */
+    int i;
 
+    global[0] = (ptr->height + KERNEL_PIXELS - 1) / KERNEL_PIXELS;
+    global[1] = ptr->width;
+    for (i = 0; local != NULL && local[0] != 0 && i < 2; i++)
+        global[i] = (global[i] + local[i] - 1) / local[i] * local[i];
+}
+
+static int run_direct(sinoscope_t *ptr, cl_mem output, const size_t *local, cl_event *ev)
+{
     cl_int ret = 0;
-    cl_event ev;
-	
-	size_t work_dim[2] = {static_cast<size_t>(ptr->width), static_cast<size_t>(ptr->height)};
-	
-	if (ptr == NULL)
-        goto error;
-      
-	ret = clEnqueueWriteBuffer(queue, output, CL_FALSE, 0, ptr->buf_size, ptr->buf, 0, NULL, &ev);
-	ERR_THROW(CL_SUCCESS, ret, "failed to copy buffer : clEnqueueWriteBuffer");
+    int recurrence = ptr->harmonics == HARMONICS_RECURRENCE;
+    size_t work_dim[2];
 
     ret = clSetKernelArg(kernel, 0, sizeof(cl_mem), &output);
     ret |= clSetKernelArg(kernel, 1, sizeof(int), &(ptr->width));
-    ret |= clSetKernelArg(kernel, 2, sizeof(int), &(ptr->interval));
-    ret |= clSetKernelArg(kernel, 3, sizeof(int), &(ptr->taylor));
-    ret |= clSetKernelArg(kernel, 4, sizeof(float), &(ptr->interval_inv));
-    ret |= clSetKernelArg(kernel, 5, sizeof(float), &(ptr->time));;
-    ret |= clSetKernelArg(kernel, 6, sizeof(float), &(ptr->phase0));
-    ret |= clSetKernelArg(kernel, 7, sizeof(float), &(ptr->phase1));
-    ret |= clSetKernelArg(kernel, 8, sizeof(float), &(ptr->dx));
-    ret |= clSetKernelArg(kernel, 9, sizeof(float), &(ptr->dy));
+    ret |= clSetKernelArg(kernel, 2, sizeof(int), &(ptr->height));
+    ret |= clSetKernelArg(kernel, 3, sizeof(int), &(ptr->interval));
+    ret |= clSetKernelArg(kernel, 4, sizeof(int), &(ptr->taylor));
+    ret |= clSetKernelArg(kernel, 5, sizeof(float), &(ptr->interval_inv));
+    ret |= clSetKernelArg(kernel, 6, sizeof(float), &(ptr->time));;
+    ret |= clSetKernelArg(kernel, 7, sizeof(float), &(ptr->phase0));
+    ret |= clSetKernelArg(kernel, 8, sizeof(float), &(ptr->phase1));
+    ret |= clSetKernelArg(kernel, 9, sizeof(float), &(ptr->dx));
+    ret |= clSetKernelArg(kernel, 10, sizeof(float), &(ptr->dy));
+    ret |= clSetKernelArg(kernel, 11, sizeof(int), &recurrence);
 
     ERR_THROW(CL_SUCCESS, ret, "failed to pass args to kernel : clSetKernelArg");
 
-    ret = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, work_dim, NULL, 0, NULL, NULL);
+    image_range(ptr, local, work_dim);
+    ret = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, work_dim, local[0] ? local : NULL, 0, NULL, ev);
     ERR_THROW(CL_SUCCESS, ret, "failed to call kernel : clEnqueueNDRangeKernel");
 
-    ret = clFinish(queue);
-    ERR_THROW(CL_SUCCESS, ret, "wait fail : clFinish()");
+done:
+    return ret;
+error:
+    ret = -1;
+    goto done;
+}
+
+/*
+ * The sums of the rows and columns are computed by a first kernel, then
+ * added per pixel by a second one. The queue is in order, so the second
+ * kernel sees the sums of the first, and the next frame does not
+ * overwrite them before.
+ */
+static int run_separable(sinoscope_t *ptr, cl_mem output, const size_t *local, cl_event *ev)
+{
+    cl_int ret = 0;
+    size_t series_dim = ptr->width + ptr->height;
+    size_t work_dim[2];
+    int recurrence = ptr->harmonics == HARMONICS_RECURRENCE;
+
+    ret = clSetKernelArg(series_kernel, 0, sizeof(cl_mem), &series);
+    ret |= clSetKernelArg(series_kernel, 1, sizeof(int), &(ptr->height));
+    ret |= clSetKernelArg(series_kernel, 2, sizeof(int), &(ptr->taylor));
+    ret |= clSetKernelArg(series_kernel, 3, sizeof(float), &(ptr->time));
+    ret |= clSetKernelArg(series_kernel, 4, sizeof(float), &(ptr->phase0));
+    ret |= clSetKernelArg(series_kernel, 5, sizeof(float), &(ptr->phase1));
+    ret |= clSetKernelArg(series_kernel, 6, sizeof(float), &(ptr->dx));
+    ret |= clSetKernelArg(series_kernel, 7, sizeof(float), &(ptr->dy));
+    ret |= clSetKernelArg(series_kernel, 8, sizeof(int), &recurrence);
+    ERR_THROW(CL_SUCCESS, ret, "failed to pass args to kernel : clSetKernelArg");
+
+    ret = clEnqueueNDRangeKernel(queue, series_kernel, 1, NULL, &series_dim, NULL, 0, NULL, NULL);
+    ERR_THROW(CL_SUCCESS, ret, "failed to call kernel : clEnqueueNDRangeKernel");
+
+    ret = clSetKernelArg(separable_kernel, 0, sizeof(cl_mem), &output);
+    ret |= clSetKernelArg(separable_kernel, 1, sizeof(cl_mem), &series);
+    ret |= clSetKernelArg(separable_kernel, 2, sizeof(int), &(ptr->width));
+    ret |= clSetKernelArg(separable_kernel, 3, sizeof(int), &(ptr->height));
+    ret |= clSetKernelArg(separable_kernel, 4, sizeof(int), &(ptr->interval));
+    ret |= clSetKernelArg(separable_kernel, 5, sizeof(float), &(ptr->interval_inv));
+    ERR_THROW(CL_SUCCESS, ret, "failed to pass args to kernel : clSetKernelArg");
+
+    image_range(ptr, local, work_dim);
+    ret = clEnqueueNDRangeKernel(queue, separable_kernel, 2, NULL, work_dim, local[0] ? local : NULL, 0, NULL, ev);
+    ERR_THROW(CL_SUCCESS, ret, "failed to call kernel : clEnqueueNDRangeKernel");
+
+done:
+    return ret;
+error:
+    ret = -1;
+    goto done;
+}
+
+static double tune_time(void)
+{
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec * 1e-6;
+}
+
+static int tune_cache_path(char *path, size_t size)
+{
+    const char *env = getenv(TUNE_CACHE_ENV);
+    const char *home = getenv("HOME");
+
+    if (env != NULL)
+        snprintf(path, size, "%s", env);
+    else if (home != NULL)
+        snprintf(path, size, "%s/%s", home, TUNE_CACHE_NAME);
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * The cache has a line per kernel, global size and device, the last one
+ * read winning:
+ *
+ *   kernel global0 global1 local0 local1 device / driver version
+ */
+static int tune_lookup(struct tuning *t, const size_t *global, const char *device_id)
+{
+    char path[BUF_SIZE], line[4 * BUF_SIZE], name[64], id[3 * BUF_SIZE];
+    size_t g[2], l[2];
+    int found = 0;
+    FILE *f;
+
+    if (tune_cache_path(path, sizeof(path)) < 0 || (f = fopen(path, "r")) == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%63s %zu %zu %zu %zu %3071[^\n]", name, &g[0], &g[1], &l[0], &l[1], id) != 6)
+            continue;
+        if (strcmp(name, t->name) == 0 && g[0] == global[0] && g[1] == global[1] &&
+                strcmp(id, device_id) == 0) {
+            t->local[0] = l[0];
+            t->local[1] = l[1];
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+static void tune_store(struct tuning *t, const size_t *global, const char *device_id)
+{
+    char path[BUF_SIZE];
+    FILE *f;
+
+    if (tune_cache_path(path, sizeof(path)) < 0 || (f = fopen(path, "a")) == NULL)
+        return;
+    fprintf(f, "%s %zu %zu %zu %zu %s\n", t->name, global[0], global[1], t->local[0], t->local[1], device_id);
+    fclose(f);
+}
+
+/*
+ * Time TUNE_ITER frames of ptr for each candidate local size that the
+ * kernel accepts on the device, and keep the fastest in the cache, so
+ * that a device is only tuned once per image size.
+ */
+static int tune_local_size(sinoscope_t *ptr, cl_mem output, struct tuning *t)
+{
+    cl_int ret = 0;
+    char name[BUF_SIZE], version[BUF_SIZE], device_id[3 * BUF_SIZE];
+    size_t global[2], max_size = 0, c;
+    double start, elapsed, best = -1;
+    int i;
+
+    image_range(ptr, NULL, global);
+    ret = clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+    ret |= clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(version), version, NULL);
+    ERR_THROW(CL_SUCCESS, ret, "failed to get device info");
+    snprintf(device_id, sizeof(device_id), "%s / %s", name, version);
+
+    if (tune_lookup(t, global, device_id))
+        goto done;
+
+    ret = clGetKernelWorkGroupInfo(*t->kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_size), &max_size, NULL);
+    ERR_THROW(CL_SUCCESS, ret, "failed to get work group size : clGetKernelWorkGroupInfo");
+
+    for (c = 0; c < sizeof(tune_sizes) / sizeof(tune_sizes[0]); c++) {
+        if (tune_sizes[c][0] * tune_sizes[c][1] > max_size)
+            continue;
+        /* Le premier lancement n'est pas mesuré */
+        if (t->run(ptr, output, tune_sizes[c], NULL) < 0 || clFinish(queue) != CL_SUCCESS)
+            continue;
+        start = tune_time();
+        for (i = 0; i < TUNE_ITER; i++)
+            t->run(ptr, output, tune_sizes[c], NULL);
+        clFinish(queue);
+        elapsed = tune_time() - start;
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+            t->local[0] = tune_sizes[c][0];
+            t->local[1] = tune_sizes[c][1];
+        }
+    }
+    ERR_ASSERT(best >= 0, "no local size accepted by the kernel");
+    tune_store(t, global, device_id);
+
+done:
+    cout << t->name << " local size " << t->local[0] << "x" << t->local[1] << "\n";
+    return ret;
+error:
+    ret = -1;
+    goto done;
+}
+
+/*
+ * Wait for the oldest frame in flight and copy it into ptr->buf.
+ */
+static int collect_frame(sinoscope_t *ptr)
+{
+    cl_int ret = 0;
+    struct opencl_frame *frame = &frames[(next_frame + nb_frames - nb_pending) % nb_frames];
 
-    ret = clEnqueueReadBuffer(queue, output, CL_FALSE, 0, ptr->buf_size, ptr->buf, 0, NULL, NULL);
-	ERR_THROW(CL_SUCCESS, ret, "failed to write results : clEnqueueReadBuffer");
+    ret = clWaitForEvents(1, &frame->done);
+    ERR_THROW(CL_SUCCESS, ret, "failed to wait for frame : clWaitForEvents");
+    memcpy(ptr->buf, frame->host, frame_size);
 
 done:
+    if (frame->done)
+        clReleaseEvent(frame->done);
+    frame->done = NULL;
+    nb_pending--;
     return ret;
 error:
     ret = -1;
     goto done;
 }
+
+/*
+ * Submit the frame of ptr, then copy the oldest frame into ptr->buf once
+ * all the buffers are in flight: with n frames, ptr->buf is the image of
+ * n - 1 calls ago, and opencl_drain() waits for the last ones.
+ */
+int sinoscope_image_opencl(sinoscope_t *ptr)
+{
+    cl_int ret = 0;
+    cl_event computed = NULL;
+    struct opencl_frame *frame = &frames[next_frame];
+    struct tuning *t;
+
+    if (ptr == NULL || (size_t) ptr->buf_size != frame_size)
+        goto error;
+    t = &tunings[ptr->mode == SINOSCOPE_SEPARABLE ? SINOSCOPE_SEPARABLE : SINOSCOPE_DIRECT];
+
+    ret = t->run(ptr, frame->output, t->local, &computed);
+    ERR_THROW(0, ret, "failed to run kernel");
+
+    ret = clEnqueueReadBuffer(transfer, frame->output, CL_FALSE, 0, frame_size, frame->host, 1, &computed, &frame->done);
+	ERR_THROW(CL_SUCCESS, ret, "failed to read results : clEnqueueReadBuffer");
+    next_frame = (next_frame + 1) % nb_frames;
+    nb_pending++;
+
+    ret = clFlush(queue);
+    ret |= clFlush(transfer);
+    ERR_THROW(CL_SUCCESS, ret, "failed to submit frame : clFlush");
+
+    if (nb_pending == nb_frames) {
+        ret = collect_frame(ptr);
+        ERR_THROW(0, ret, "collect_frame failed");
+    }
+
+done:
+    if (computed)
+        clReleaseEvent(computed);
+    return ret;
+error:
+    ret = -1;
+    goto done;
+}
+
+int opencl_drain(sinoscope_t *ptr)
+{
+    int ret = 0;
+
+    if (ptr == NULL || (size_t) ptr->buf_size != frame_size)
+        return -1;
+    while (nb_pending > 0)
+        ret |= collect_frame(ptr);
+    return ret;
+}
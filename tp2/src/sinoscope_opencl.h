@@ -12,8 +12,14 @@
 extern "C" {
 #endif
 
+/*
+ * Frames computed or read back while the host uses the previous ones.
+ */
+#define OPENCL_FRAMES_MAX 3
+
 int sinoscope_image_opencl(sinoscope_t *ptr);
-int opencl_init(int width, int height);
+int opencl_drain(sinoscope_t *ptr);
+int opencl_init(int width, int height, int taylor, int depth);
 void opencl_shutdown();
 
 #ifdef __cplusplus
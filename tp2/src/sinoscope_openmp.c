@@ -14,6 +14,7 @@
 
 #include "sinoscope.h"
 #include "color.h"
+#include "series.h"
 #include "util.h"
 
 int sinoscope_image_openmp(sinoscope_t *ptr)
@@ -24,32 +25,36 @@ int sinoscope_image_openmp(sinoscope_t *ptr)
         return -1;
      
     sinoscope_t sino = *ptr;
-	int x, y, index, taylor;
-	struct rgb c;
-	float val, px, py;   
-	
-	
-	#pragma omp parallel for private(x, y, px, py, val, taylor, index, c)
+	float *rows = series_rows(&sino);
+	float *cols = series_cols(&sino);
+	int x, y, index;
+	float val;
+
+	#pragma omp parallel private(x, y, val, index)
+	{
+		/* Les sommes des rangées et des colonnes avant les pixels */
+		if (sino.mode == SINOSCOPE_SEPARABLE) {
+			#pragma omp for nowait
+			for (y = 1; y < sino.height - 1; y++)
+				rows[y] = series_row(&sino, y);
+			#pragma omp for
+			for (x = 1; x < sino.width - 1; x++)
+				cols[x] = series_col(&sino, x);
+		}
+
+		#pragma omp for
 		for(x=1; x < sino.width-1;x++)
 		{
 				for(y = 1; y < sino.height-1; y++){
-					px = sino.dx * y - 2 * M_PI;
-					py = sino.dy * x - 2 * M_PI;
-					val = 0.0f;
-					
-				for (taylor = 1; taylor <= sino.taylor; taylor += 2) {
-					val += sin(px * taylor * sino.phase1 + sino.time) / taylor + cos(py * taylor * sino.phase0) / taylor;
-				}
-					
-				val = (atan(1.0 * val) - atan(-1.0 * val)) / (M_PI);
-				val = (val + 1) * 100;
-				value_color(&c, val, sino.interval, sino.interval_inv);
-				index = (y * 3) + (x * 3) * sino.width;
-				sino.buf[index + 0] = c.r;
-				sino.buf[index + 1] = c.g;
-				sino.buf[index + 2] = c.b;
+					if (sino.mode == SINOSCOPE_SEPARABLE)
+						val = rows[y] + cols[x];
+					else
+						val = series_pixel(&sino, x, y);
+					index = (y * 3) + (x * 3) * sino.width;
+					series_color(sino.buf + index, val, sino.interval, sino.interval_inv);
 			}
 		}
+	}
 		
     return 0;
 }
@@ -10,6 +10,7 @@
 #include <math.h>
 
 #include "color.h"
+#include "series.h"
 #include "sinoscope_serial.h"
 
 int sinoscope_image_serial(sinoscope_t *ptr)
@@ -18,27 +19,28 @@ int sinoscope_image_serial(sinoscope_t *ptr)
         return -1;
 
     sinoscope_t sino = *ptr;
-    int x, y, index, taylor;
-    struct rgb c;
-    float val, px, py;
+    float *rows = series_rows(&sino);
+    float *cols = series_cols(&sino);
+    int x, y, index;
+    float val;
+
+    if (sino.mode == SINOSCOPE_SEPARABLE) {
+        for (y = 1; y < sino.height - 1; y++)
+            rows[y] = series_row(&sino, y);
+        for (x = 1; x < sino.width - 1; x++)
+            cols[x] = series_col(&sino, x);
+    }
 
     x = 1;
     while(1) {
         y = 1;
         while(1) {
-            px = sino.dx * y - 2 * M_PI;
-            py = sino.dy * x - 2 * M_PI;
-            val = 0.0f;
-            for (taylor = 1; taylor <= sino.taylor; taylor += 2) {
-                val += sin(px * taylor * sino.phase1 + sino.time) / taylor + cos(py * taylor * sino.phase0) / taylor;
-            }
-            val = (atan(1.0 * val) - atan(-1.0 * val)) / (M_PI);
-            val = (val + 1) * 100;
-            value_color(&c, val, sino.interval, sino.interval_inv);
+            if (sino.mode == SINOSCOPE_SEPARABLE)
+                val = rows[y] + cols[x];
+            else
+                val = series_pixel(&sino, x, y);
             index = (y * 3) + (x * 3) * sino.width;
-            sino.buf[index + 0] = c.r;
-            sino.buf[index + 1] = c.g;
-            sino.buf[index + 2] = c.b;
+            series_color(sino.buf + index, val, sino.interval, sino.interval_inv);
             y++;
             if (y >= sino.height-1)
                 break;
@@ -0,0 +1,140 @@
+/*
+ * sinoscope_simd.c
+ *
+ * The body of sinoscope_simd_impl.h is compiled once per instruction set
+ * and the widest one the processor supports is chosen at run time, so
+ * the same binary runs on any x86-64. SSE has vectors of 4 floats: with
+ * 8, the compiler splits every operation and converts some lane by lane.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "sinoscope.h"
+#include "series.h"
+#include "sinoscope_simd.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define SIMD_WIDTH 16
+#define SIMD(name) name##_avx512
+#include "sinoscope_simd_impl.h"
+#undef SIMD
+#undef SIMD_WIDTH
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#define SIMD_WIDTH 8
+#define SIMD(name) name##_avx2
+#include "sinoscope_simd_impl.h"
+#undef SIMD
+#undef SIMD_WIDTH
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+#define SIMD_WIDTH 4
+#define SIMD(name) name##_sse
+#include "sinoscope_simd_impl.h"
+#undef SIMD
+#undef SIMD_WIDTH
+#pragma GCC pop_options
+
+static int supports_avx512(void)
+{
+    return __builtin_cpu_supports("avx512f");
+}
+
+static int supports_avx2(void)
+{
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+static int supports_sse(void)
+{
+    return __builtin_cpu_supports("sse4.1");
+}
+
+#else
+
+/* Sans dispatch, les vecteurs génériques du compilateur */
+#define SIMD_WIDTH 8
+#define SIMD(name) name##_generic
+#include "sinoscope_simd_impl.h"
+#undef SIMD
+#undef SIMD_WIDTH
+
+static int supports_generic(void)
+{
+    return 1;
+}
+
+#endif
+
+struct simd_isa {
+    const char *name;
+    int width;
+    int (*supported)(void);
+    int (*handler)(sinoscope_t *);
+};
+
+/* Du plus large au plus étroit */
+static const struct simd_isa isas[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { .name = "avx512", .width = 16, .supported = supports_avx512, .handler = sinoscope_image_simd_avx512 },
+    { .name = "avx2", .width = 8, .supported = supports_avx2, .handler = sinoscope_image_simd_avx2 },
+    { .name = "sse", .width = 4, .supported = supports_sse, .handler = sinoscope_image_simd_sse },
+#else
+    { .name = "generic", .width = 8, .supported = supports_generic, .handler = sinoscope_image_simd_generic },
+#endif
+    { .name = NULL },
+};
+
+static const struct simd_isa *isa = NULL;
+
+/*
+ * Select the instruction set name, or the widest supported one when name
+ * is NULL or "auto".
+ */
+int simd_init(const char *name)
+{
+    int i;
+
+    __builtin_cpu_init();
+    for (i = 0; isas[i].name != NULL; i++) {
+        if (name != NULL && strcmp(name, "auto") != 0 && strcmp(name, isas[i].name) != 0)
+            continue;
+        if (isas[i].supported()) {
+            isa = &isas[i];
+            return 0;
+        }
+        if (name != NULL && strcmp(name, "auto") != 0)
+            break;
+    }
+    fprintf(stderr, "simd: %s not supported\n", name != NULL ? name : "auto");
+    return -1;
+}
+
+const char *simd_isa(int i)
+{
+    return isas[i].name;
+}
+
+const char *simd_name(void)
+{
+    return isa != NULL ? isa->name : NULL;
+}
+
+int sinoscope_image_simd(sinoscope_t *ptr)
+{
+    if (isa == NULL && simd_init(NULL) < 0)
+        return -1;
+    return isa->handler(ptr);
+}
@@ -0,0 +1,19 @@
+/*
+ * sinoscope_simd.h
+ *
+ * Vectorised CPU backend, on the widest instruction set among AVX-512,
+ * AVX2 and SSE that the processor supports, with OpenMP threads over
+ * the columns.
+ */
+
+#ifndef SINOSCOPE_SIMD_H_
+#define SINOSCOPE_SIMD_H_
+
+#include "sinoscope.h"
+
+int sinoscope_image_simd(sinoscope_t *ptr);
+int simd_init(const char *name);
+const char *simd_isa(int i);
+const char *simd_name(void);
+
+#endif /* SINOSCOPE_SIMD_H_ */
@@ -0,0 +1,281 @@
+/*
+ * sinoscope_simd_impl.h
+ *
+ * Body of the SIMD backend for one instruction set, included by
+ * sinoscope_simd.c once per instruction set with:
+ *
+ *   SIMD_WIDTH  number of float lanes of a vector
+ *   SIMD(name)  name suffixed by the instruction set
+ *
+ * and the matching "#pragma GCC target". The vectors are GCC vector
+ * extensions, so the same code gives 16 lanes of AVX-512, 8 of AVX2 or
+ * 4 of SSE.
+ *
+ * The sin, cos and atan are the float polynomials of Cephes, and the
+ * colour of value_color() is computed with masks instead of a switch.
+ */
+
+/*
+ * The helpers are always inlined in the loops, where their constants
+ * stay in registers.
+ */
+#define SIMD_INLINE static inline __attribute__((always_inline))
+#define vf SIMD(vf)
+#define vi SIMD(vi)
+#define vd SIMD(vd)
+
+typedef float vf __attribute__((vector_size(SIMD_WIDTH * sizeof(float))));
+typedef int vi __attribute__((vector_size(SIMD_WIDTH * sizeof(int))));
+typedef double vd __attribute__((vector_size(SIMD_WIDTH * sizeof(double))));
+
+SIMD_INLINE vf SIMD(select)(vi mask, vf a, vf b)
+{
+    return (vf) (((vi) a & mask) | ((vi) b & ~mask));
+}
+
+SIMD_INLINE vf SIMD(set)(float f)
+{
+    vf v = { 0 };
+
+    return v + f;
+}
+
+SIMD_INLINE vf SIMD(iota)(void)
+{
+    vf v;
+    int i;
+
+    for (i = 0; i < SIMD_WIDTH; i++)
+        v[i] = i;
+    return v;
+}
+
+/*
+ * Abscissas d * i - 2 pi of the rows or columns i = first + lane. As in
+ * series.c, 2 pi is subtracted in double before rounding to a float.
+ */
+SIMD_INLINE vf SIMD(abscissa)(float d, int first)
+{
+    vf p = d * (SIMD(iota)() + (float) first);
+
+    return __builtin_convertvector(__builtin_convertvector(p, vd) - 2 * M_PI, vf);
+}
+
+/*
+ * sin(x), and cos(x) in *cos. x is brought back to [-pi / 4, pi / 4] in
+ * double, and the octant j selects the polynomial and the signs. The
+ * three float steps of pi / 4 of Cephes lose the result beyond
+ * |x| ~ 8192, and the libm harmonics reach 1e6.
+ */
+SIMD_INLINE vf SIMD(sincos)(vf x, vf *cos)
+{
+    vf ax, y, z, ps, pc;
+    vd ad;
+    vi j, swap, sign_s, sign_c;
+
+    ax = SIMD(select)(x < 0, -x, x);
+    ad = __builtin_convertvector(ax, vd);
+    j = __builtin_convertvector(ad * (4 / M_PI), vi);
+    j = (j + 1) & ~1;
+    ad -= __builtin_convertvector(j, vd) * M_PI_4;
+    ax = __builtin_convertvector(ad, vf);
+
+    z = ax * ax;
+    ps = ((-1.9515295891e-4f * z + 8.3321608736e-3f) * z - 1.6666654611e-1f) * z * ax + ax;
+    pc = ((2.443315711809948e-5f * z - 1.388731625493765e-3f) * z + 4.166664568298827e-2f) * z * z
+            - 0.5f * z + 1.0f;
+
+    /* Dans les octants 2 et 6, les polynômes sont échangés */
+    swap = (j & 2) != 0;
+    sign_s = ((j & 4) != 0) ^ (x < 0);
+    sign_c = ((j + 2) & 4) != 0;
+    *cos = SIMD(select)(swap, ps, pc);
+    *cos = SIMD(select)(sign_c, -*cos, *cos);
+    y = SIMD(select)(swap, pc, ps);
+    return SIMD(select)(sign_s, -y, y);
+}
+
+/*
+ * atan(x), with |x| brought back under tan(pi / 8).
+ */
+SIMD_INLINE vf SIMD(atan)(vf x)
+{
+    vf ax, y0, z, y;
+    vi big, mid;
+
+    ax = SIMD(select)(x < 0, -x, x);
+    big = ax > 2.414213562373095f;
+    mid = (ax > 0.4142135623730950f) & ~big;
+    y0 = SIMD(select)(big, SIMD(set)(M_PI_2), SIMD(select)(mid, SIMD(set)(M_PI_4), SIMD(set)(0.0f)));
+    ax = SIMD(select)(big, -1.0f / ax, SIMD(select)(mid, (ax - 1.0f) / (ax + 1.0f), ax));
+
+    z = ax * ax;
+    y = (((8.05374449538e-2f * z - 1.38776856032e-1f) * z + 1.99777106478e-1f) * z
+            - 3.33329491539e-1f) * z * ax + ax + y0;
+    return SIMD(select)(x < 0, -y, y);
+}
+
+/*
+ * Sums of series_row() (cosine = 0) or series_col() (cosine = 1) of the
+ * lanes of p, for the abscissas p of a vector of rows or columns.
+ */
+SIMD_INLINE vf SIMD(harmonics)(vf p, float phase, float t, int taylor, int recurrence, int cosine)
+{
+    vf a = p * phase, val = { 0 }, s, c, s2, c2, tmp, norm;
+    int k;
+
+    if (!recurrence) {
+        for (k = 1; k <= taylor; k += 2) {
+            if (cosine) {
+                SIMD(sincos)(p * (float) k * phase, &c);
+                val += c / (float) k;
+            } else {
+                s = SIMD(sincos)(p * (float) k * phase + t, &c);
+                val += s / (float) k;
+            }
+        }
+        return val;
+    }
+
+    /* cos(k * a) est sin(k * a + pi / 2), dont le premier terme est (cos a, -sin a) */
+    if (cosine) {
+        tmp = SIMD(sincos)(a, &s);
+        c = -tmp;
+    } else {
+        s = SIMD(sincos)(a + t, &c);
+    }
+    s2 = SIMD(sincos)(a + a, &c2);
+    for (k = 1; k <= taylor; k += 2) {
+        val += s / (float) k;
+        tmp = s * c2 + c * s2;
+        c = c * c2 - s * s2;
+        s = tmp;
+        if (((k >> 1) % HARMONICS_RENORM) == HARMONICS_RENORM - 1) {
+            norm = 1.5f - 0.5f * (s * s + c * c);
+            s *= norm;
+            c *= norm;
+        }
+    }
+    return val;
+}
+
+/*
+ * Colour of the sums val, as series_color(), for the first n lanes
+ * written from buf.
+ */
+SIMD_INLINE void SIMD(color)(unsigned char *buf, vf val, int n, int interval, float interval_inv)
+{
+    vf value;
+    vi nan, v, q, rem, x, i, m0, m1, m2, m3, m4, other, r, g, b;
+    int l;
+
+    nan = val != val;
+    val = SIMD(select)(nan, val - val, val);
+    value = (SIMD(atan)(val) * (float) M_2_PI + 1.0f) * 100.0f;
+
+    /* (int) value % interval, corrigé d'une erreur d'arrondi du quotient */
+    v = __builtin_convertvector(value, vi);
+    q = __builtin_convertvector(__builtin_convertvector(v, vf) * (1.0f / interval), vi);
+    rem = v - q * interval;
+    rem += (rem < 0) & interval;
+    rem -= (rem >= interval) & interval;
+    x = __builtin_convertvector(__builtin_convertvector(rem * 255, vf) * interval_inv, vi);
+    i = __builtin_convertvector(value * interval_inv, vi);
+
+    m0 = i == 0;
+    m1 = i == 1;
+    m2 = i == 2;
+    m3 = i == 3;
+    m4 = i == 4;
+    other = ~(m0 | m1 | m2 | m3 | m4);
+    r = (m2 & x) | ((m3 | m4 | other) & 255);
+    g = (m0 & x) | ((m1 | m2 | other) & 255) | (m3 & (255 - x));
+    b = ((m0 | other) & 255) | (m1 & (255 - x)) | (m4 & x);
+    r &= ~nan;
+    g &= ~nan;
+    b &= ~nan;
+
+    for (l = 0; l < n; l++) {
+        buf[3 * l + 0] = r[l];
+        buf[3 * l + 1] = g[l];
+        buf[3 * l + 2] = b[l];
+    }
+}
+
+SIMD_INLINE vf SIMD(load)(const float *src, int n)
+{
+    vf v = { 0 };
+
+    if (n == SIMD_WIDTH)
+        memcpy(&v, src, sizeof(v));
+    else
+        memcpy(&v, src, n * sizeof(float));
+    return v;
+}
+
+SIMD_INLINE void SIMD(store)(float *dst, vf v, int n)
+{
+    memcpy(dst, &v, n * sizeof(float));
+}
+
+/*
+ * The pixels of a column x are consecutive in buf, so a vector holds
+ * SIMD_WIDTH consecutive rows y.
+ */
+static int SIMD(sinoscope_image_simd)(sinoscope_t *ptr)
+{
+    if (ptr == NULL)
+        return -1;
+
+    sinoscope_t sino = *ptr;
+    float *rows = series_rows(&sino);
+    float *cols = series_cols(&sino);
+    int separable = sino.mode == SINOSCOPE_SEPARABLE;
+    int recurrence = sino.harmonics == HARMONICS_RECURRENCE;
+    int x, y, n;
+
+    #pragma omp parallel private(x, y, n)
+    {
+        vf val, px, py, sum;
+
+        if (separable) {
+            #pragma omp for nowait
+            for (y = 1; y < sino.height - 1; y += SIMD_WIDTH) {
+                n = MIN(SIMD_WIDTH, sino.height - 1 - y);
+                px = SIMD(abscissa)(sino.dx, y);
+                val = SIMD(harmonics)(px, sino.phase1, sino.time, sino.taylor, recurrence, 0);
+                SIMD(store)(rows + y, val, n);
+            }
+            #pragma omp for
+            for (x = 1; x < sino.width - 1; x += SIMD_WIDTH) {
+                n = MIN(SIMD_WIDTH, sino.width - 1 - x);
+                py = SIMD(abscissa)(sino.dy, x);
+                val = SIMD(harmonics)(py, sino.phase0, 0.0f, sino.taylor, recurrence, 1);
+                SIMD(store)(cols + x, val, n);
+            }
+        }
+
+        #pragma omp for
+        for (x = 1; x < sino.width - 1; x++) {
+            for (y = 1; y < sino.height - 1; y += SIMD_WIDTH) {
+                n = MIN(SIMD_WIDTH, sino.height - 1 - y);
+                if (separable) {
+                    val = SIMD(load)(rows + y, n) + cols[x];
+                } else {
+                    px = SIMD(abscissa)(sino.dx, y);
+                    py = SIMD(set)(sino.dy * x - 2 * M_PI);
+                    sum = SIMD(harmonics)(px, sino.phase1, sino.time, sino.taylor, recurrence, 0);
+                    val = sum + SIMD(harmonics)(py, sino.phase0, 0.0f, sino.taylor, recurrence, 1);
+                }
+                SIMD(color)(sino.buf + (y * 3) + (x * 3) * sino.width, val, n,
+                        sino.interval, sino.interval_inv);
+            }
+        }
+    }
+    return 0;
+}
+
+#undef SIMD_INLINE
+#undef vf
+#undef vi
+#undef vd
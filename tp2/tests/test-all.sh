@@ -2,4 +2,9 @@
 
 ${abs_top_srcdir}/encode/encode --cmd check
 RET=$?
+${abs_top_builddir}/src/sinoscope --cmd check || RET=1
+# Beaucoup d'harmoniques, et une taille impaire qui n'est pas un multiple
+# des vecteurs (l'image doit rester carrée)
+${abs_top_builddir}/src/sinoscope --cmd check --taylor 1001 --width 200 --height 200 || RET=1
+${abs_top_builddir}/src/sinoscope --cmd check --width 67 --height 67 || RET=1
 exit $RET